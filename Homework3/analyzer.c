@@ -1,27 +1,233 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <limits.h>
 #include <math.h>
+#include <sys/stat.h>
 #include "analyzer.h"
 #include "bmp.h"
+#include "cache.h"
+#include "metrics.h"
+
+// Number of image paths the analysis queue holds before scanners wait
+#define ANALYSIS_QUEUE_SIZE (4096)
+// Number of directory descriptors kept open on the scan stack, directories
+// pushed beyond it are reopened by path
+#define MAX_PENDING_DIRECTORY_FDS (256)
+// 64 bit FNV-1a parameters of the tile hashes, applied to whole pixels
+#define TILE_HASH_BASIS (14695981039346656037ULL)
+#define TILE_HASH_PRIME (1099511628211ULL)
+
+// An image waiting for analysis
+typedef struct {
+	char * path;
+	// Position in the order the images were found
+	int sequence;
+	// Times recorded for the metrics, 0 when they are disabled
+	long long queued_at;
+	long long scan_time;
+} queued_image;
+
+// A directory waiting to be scanned
+typedef struct {
+	int fd; // -1 when it has to be opened by path
+	char * path;
+} pending_directory;
+
+int scan_thread_limit = 4;
+bool recursive_scan = false;
+int top_rectangles = 0;
+bool color_statistics = false;
+int total_images_count;
+int analyzed_images_count;
+image_info * images_info;
+pthread_mutex_t images_mutex;
+pthread_mutex_t images_info_mutex;
+
+// Capacity of images_info, it grows as images are discovered
+static int images_info_capacity;
+
+// Where results go, called with images_info_mutex locked
+static image_result_callback result_callback;
+static void * result_context;
+
+// A result kept until every image found before it was reported
+typedef struct {
+	bool ready;
+	// False for images that couldn't be loaded, they only hold their place
+	bool analyzed;
+	image_info result;
+} pending_result;
+
+// Reorder buffer used when results are reported in discovery order, the
+// result of sequence number s is at s % reorder_capacity
+static bool ordered_results;
+static pending_result * reorder_buffer;
+static int reorder_capacity;
+static int next_sequence;
+
+// Bounded FIFO of images found by the scanners
+static queued_image analysis_queue[ANALYSIS_QUEUE_SIZE];
+static int analysis_queue_head;
+static int analysis_queue_count;
+static bool scanning_done;
+// Images queued so far, unlike total_images_count it counts unsupported images
+static int images_found;
+static pthread_cond_t images_available;
+static pthread_cond_t images_space;
+
+// Stack of directories still to be scanned
+static pending_directory * scan_stack;
+static int scan_stack_count;
+static int scan_stack_capacity;
+static int pending_fds;
+static int active_scanners;
+static pthread_mutex_t scan_mutex;
+static pthread_cond_t directories_available;
+
+// Time the current scanner or analyzer thread spent waiting, for the metrics
+static __thread long long thread_idle_time;
+
+static void process_image(const char * file_name, int sequence, image_metrics * metrics);
+
+static void push_directory(int fd, char * path) {
+	pending_directory * old_stack = scan_stack;
+
+	if (scan_stack_count == scan_stack_capacity) {
+		scan_stack_capacity = scan_stack_capacity == 0 ? 64 : 2 * scan_stack_capacity;
+		scan_stack = safe_malloc(scan_stack_capacity * sizeof(pending_directory));
+		if (old_stack != NULL) {
+			memcpy(scan_stack, old_stack, scan_stack_count * sizeof(pending_directory));
+			safe_free(old_stack);
+		}
+	}
+
+	scan_stack[scan_stack_count].fd = fd;
+	scan_stack[scan_stack_count].path = path;
+	scan_stack_count++;
+}
+
+static bool has_bmp_extension(const char * name) {
+	size_t length = strlen(name);
+	return length >= 4 && strcmp(".bmp", &name[length - 4]) == 0;
+}
+
+static char * join_path(const char * directory, const char * name) {
+	size_t length = strlen(directory);
+	char * path = safe_malloc(length + strlen(name) + 2);
+
+	strcpy(path, directory);
+	if (length == 0 || directory[length - 1] != '/') {
+		path[length++] = '/';
+	}
+	strcpy(path + length, name);
+	return path;
+}
+
+// Hands a discovered image to the analyzer threads, waits while the queue is full.
+// scan_time is the time it took to find the image.
+static void queue_image(char * path, long long scan_time) {
+	queued_image * image;
+	long long wait_start;
+
+	pthread_mutex_lock(&images_mutex);
+	if (analysis_queue_count == ANALYSIS_QUEUE_SIZE) {
+		wait_start = metrics_now();
+		while (analysis_queue_count == ANALYSIS_QUEUE_SIZE) {
+			pthread_cond_wait(&images_space, &images_mutex);
+		}
+		thread_idle_time += metrics_now() - wait_start;
+	}
+
+	image = &analysis_queue[(analysis_queue_head + analysis_queue_count) % ANALYSIS_QUEUE_SIZE];
+	image->path = path;
+	image->sequence = images_found++;
+	image->queued_at = metrics_now();
+	image->scan_time = scan_time;
+	analysis_queue_count++;
+	total_images_count++;
+	metrics_queue_depth(analysis_queue_count);
+	LOG_MSG("Queued image %s, %d waiting for analysis", path, analysis_queue_count);
+	pthread_cond_signal(&images_available);
+	pthread_mutex_unlock(&images_mutex);
+}
+
+// Appends result to images_info, growing it when full
+static void collect_result(const image_info * result, void * context) {
+	image_info * old_images_info;
+
+	if (analyzed_images_count == images_info_capacity) {
+		old_images_info = images_info;
+		images_info_capacity = images_info_capacity == 0 ? 64 : 2 * images_info_capacity;
+		images_info = safe_malloc(images_info_capacity * sizeof(image_info));
+		if (old_images_info != NULL) {
+			memcpy(images_info, old_images_info, analyzed_images_count * sizeof(image_info));
+			safe_free(old_images_info);
+		}
+	}
+
+	images_info[analyzed_images_count] = *result;
+	images_info[analyzed_images_count].path = safe_strdup(result->path);
+	images_info[analyzed_images_count].analysis = NULL;
+	LOG_MSG("saved image %s in index %d", result->path, analyzed_images_count);
+}
 
 image_info * analyze_images_in_directory(int thread_limit, const char * directory, int * images_analyzed) {
+	images_info = NULL;
+	images_info_capacity = 0;
+	*images_analyzed = analyze_images_streaming(thread_limit, directory, false, collect_result, NULL);
+	return images_info;
+}
+
+int analyze_images_streaming(int thread_limit, const char * directory, bool ordered, image_result_callback callback, void * context) {
 	uint i;
 	pthread_t * analyzers = safe_malloc(thread_limit * sizeof(pthread_t));
-	pthread_t loader;
-	available_images_count = 0;
+	pthread_t * scanners = safe_malloc(scan_thread_limit * sizeof(pthread_t));
+	char root[PATH_MAX + 1];
+	int root_fd;
+
 	total_images_count = 0;
 	analyzed_images_count = 0;
-	images = NULL;
+	result_callback = callback;
+	result_context = context;
+	ordered_results = ordered;
+	reorder_buffer = NULL;
+	reorder_capacity = 0;
+	next_sequence = 0;
+	analysis_queue_head = 0;
+	analysis_queue_count = 0;
+	scanning_done = false;
+	images_found = 0;
+	scan_stack = NULL;
+	scan_stack_count = 0;
+	scan_stack_capacity = 0;
+	pending_fds = 0;
+	active_scanners = 0;
 	pthread_mutex_init(&images_mutex, NULL);
 	pthread_mutex_init(&images_info_mutex, NULL);
+	pthread_mutex_init(&scan_mutex, NULL);
+	pthread_cond_init(&images_available, NULL);
+	pthread_cond_init(&images_space, NULL);
+	pthread_cond_init(&directories_available, NULL);
+
+	// Results report absolute paths, so resolve the directory once
+	if (realpath(directory, root) != NULL && (root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		push_directory(root_fd, safe_strdup(root));
+		pending_fds++;
+	} else {
+		fprintf(stderr, "WARNING: unable to open directory %s\n", directory);
+	}
 
-	// Create images loader thread
-	safe_pthread_create(&loader, NULL, load_images, (void *)directory);
-	LOG_MSG("%s Thread created", "Loader");
+	// Create directory scanner threads
+	for (i = 0; i < scan_thread_limit; i++) {
+		safe_pthread_create(&scanners[i], NULL, scan_directories, (void *) (intptr_t)(i + 1));
+		LOG_MSG("Scanner thread %d created", i + 1);
+	}
 
 	// Create images analyzer threads
 	for (i = 0; i < thread_limit; i++) {
@@ -29,180 +235,752 @@ image_info * analyze_images_in_directory(int thread_limit, const char * director
 		LOG_MSG("Thread %d created", i + 1);
 	}
 
-	// Load and analyze
-	pthread_join(loader, NULL);
+	// Scan, then let the analyzers drain the queue and exit
+	for (i = 0; i < scan_thread_limit; i++) {
+		pthread_join(scanners[i], NULL);
+	}
 
-	LOG_MSG("Loading images is done, total count is %d", total_images_count);
+	pthread_mutex_lock(&images_mutex);
+	scanning_done = true;
+	pthread_cond_broadcast(&images_available);
+	pthread_mutex_unlock(&images_mutex);
 
-	*images_analyzed = total_images_count;
-	while (total_images_count != analyzed_images_count);
+	LOG_MSG("Scanning images is done, total count is %d", total_images_count);
+
+	for (i = 0; i < thread_limit; i++) {
+		pthread_join(analyzers[i], NULL);
+	}
 
 	LOG_MSG("Analyzing images is done, total count is %d", analyzed_images_count);
 
 	assert(total_images_count == analyzed_images_count);
-	assert(analyzed_images_count == *images_analyzed);
+	assert(analysis_queue_count == 0 && scan_stack_count == 0 && pending_fds == 0);
 
 	// cleanup
-	for (i = 0; i < thread_limit; i++) {
-		pthread_cancel(analyzers[i]);
-	}
-
+	pthread_cond_destroy(&directories_available);
+	pthread_cond_destroy(&images_space);
+	pthread_cond_destroy(&images_available);
+	pthread_mutex_destroy(&scan_mutex);
 	pthread_mutex_destroy(&images_info_mutex);
 	pthread_mutex_destroy(&images_mutex);
+	safe_free(reorder_buffer);
+	safe_free(scan_stack);
+	safe_free(scanners);
 	safe_free(analyzers);
-	safe_free(images);
 
-	return images_info;
+	return analyzed_images_count;
 }
 
-void * analyze_image(void * arg) {
-	bmp image;
-	image_info analyzed_image;
+void * scan_directories(void * arg) {
 	uint id = (intptr_t)arg;
-	int src_index, dest_index;
+	pending_directory directory;
+	long long start = metrics_now(), wait_start;
+	int directories = 0;
+
+	thread_idle_time = 0;
 	while (true) {
-		src_index = INT_MIN;
-		dest_index = INT_MIN;
-		pthread_mutex_lock(&images_mutex);
-		if (available_images_count > 0) {
-			available_images_count--;
-			src_index = available_images_count;
-			image = images[src_index];
-			LOG_MSG("Thread %d: will process image %s", id, image.path);
-			LOG_MSG("Thread %d: available images to process %d", id, available_images_count);
+		pthread_mutex_lock(&scan_mutex);
+		// Other scanners may still push subdirectories
+		if (scan_stack_count == 0 && active_scanners > 0) {
+			wait_start = metrics_now();
+			while (scan_stack_count == 0 && active_scanners > 0) {
+				pthread_cond_wait(&directories_available, &scan_mutex);
+			}
+			thread_idle_time += metrics_now() - wait_start;
 		}
-		pthread_mutex_unlock(&images_mutex);
-
-		if (src_index != INT_MIN) {
-			assert(image.pixels != NULL);
-			assert(image.path != NULL);
 
-			LOG_MSG("Thread %d: started processing image %s", id, image.path);
+		if (scan_stack_count == 0) {
+			// Nothing left and nobody scanning, wake up the waiting scanners so they exit too
+			pthread_cond_broadcast(&directories_available);
+			pthread_mutex_unlock(&scan_mutex);
+			break;
+		}
 
-			analyzed_image = get_max_rectangle(&image);
+		directory = scan_stack[--scan_stack_count];
+		if (directory.fd != -1) {
+			pending_fds--;
+		}
+		active_scanners++;
+		pthread_mutex_unlock(&scan_mutex);
 
-			LOG_MSG("Thread %d: finished processing image %s", id, image.path);
+		LOG_MSG("Scanner %d: scanning directory %s", id, directory.path);
+		if (directory.fd == -1) {
+			directory.fd = open(directory.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		}
+		if (directory.fd != -1) {
+			scan_directory(directory.fd, directory.path);
+		}
+		safe_free(directory.path);
+		directories++;
 
-			pthread_mutex_lock(&images_info_mutex);
-			dest_index = analyzed_images_count;
-			analyzed_image.path = safe_strdup(image.path);
-			images_info[dest_index] = analyzed_image;
-			safe_free(image.path);
-			safe_free(image.pixels);
-			LOG_MSG("Thread %d: saved image %s in index %d", id, analyzed_image.path, dest_index);
-			LOG_MSG("Thread %d: analyzed images %d", id, analyzed_images_count + 1);
-			analyzed_images_count++;
-			pthread_mutex_unlock(&images_info_mutex);
+		pthread_mutex_lock(&scan_mutex);
+		active_scanners--;
+		if (scan_stack_count == 0 && active_scanners == 0) {
+			pthread_cond_broadcast(&directories_available);
 		}
+		pthread_mutex_unlock(&scan_mutex);
 	}
 
+	metrics_record_thread(SCANNER_THREAD, id, metrics_now() - start - thread_idle_time, thread_idle_time, directories);
 	return NULL;
 }
 
-void * load_images(void * arg) {
-	const char * directory = (const char *)arg;
-	read_dir(directory, count_images);
+void scan_directory(int dir_fd, const char * directory) {
+	struct dirent * dirent;
+	struct stat file_stat;
+	int type, child_fd;
+	long long found_at = metrics_now(), now;
+	DIR * dir;
+
+	dir = fdopendir(dir_fd);
+	if (dir == NULL) {
+		close(dir_fd);
+		return;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+			continue;
+		}
 
-	if (total_images_count > 0) {
-		images_info = safe_malloc((total_images_count) * sizeof(image_info));
-		images = safe_malloc((total_images_count) * sizeof(bmp));
-		read_dir(directory, load_image);
+		// Only stat when the file system doesn't report the type, or for links
+		// which are followed for files but never for directories
+		type = dirent->d_type;
+		if (type == DT_UNKNOWN && (recursive_scan || has_bmp_extension(dirent->d_name))) {
+			if (fstatat(dir_fd, dirent->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+			type = S_ISREG(file_stat.st_mode) ? DT_REG : S_ISDIR(file_stat.st_mode) ? DT_DIR : S_ISLNK(file_stat.st_mode) ? DT_LNK : DT_UNKNOWN;
+		}
+		if (type == DT_LNK && has_bmp_extension(dirent->d_name)) {
+			if (fstatat(dir_fd, dirent->d_name, &file_stat, 0) != 0) {
+				continue;
+			}
+			type = S_ISREG(file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_REG && has_bmp_extension(dirent->d_name)) {
+			now = metrics_now();
+			queue_image(join_path(directory, dirent->d_name), now - found_at);
+			found_at = metrics_now();
+		} else if (type == DT_DIR && recursive_scan) {
+			pthread_mutex_lock(&scan_mutex);
+			child_fd = -1;
+			if (pending_fds < MAX_PENDING_DIRECTORY_FDS) {
+				child_fd = openat(dir_fd, dirent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				pending_fds += child_fd != -1;
+			}
+			push_directory(child_fd, join_path(directory, dirent->d_name));
+			pthread_cond_signal(&directories_available);
+			pthread_mutex_unlock(&scan_mutex);
+		}
 	}
 
-	return NULL;
+	closedir(dir);
 }
 
-void read_dir(const char * directory, void (*file_action)(const char *)) {
-	uint length;
-	struct dirent *dirent;
-	DIR *dir;
-
-	dir = opendir(directory);
-	if (dir != NULL) {
-	    while ((dirent = readdir(dir)) != NULL) {
-	    	length = strlen (dirent->d_name);
-			if (length >= 4) {
-				if (strcmp (".bmp", &(dirent->d_name[length - 4])) == 0) {
-					char path[PATH_MAX + 1];
-					realpath(dirent->d_name, path);
-					file_action(path);
-				}
+void * analyze_image(void * arg) {
+	uint id = (intptr_t)arg;
+	queued_image image;
+	image_metrics metrics;
+	long long start = metrics_now(), wait_start;
+	int images = 0;
+
+	thread_idle_time = 0;
+	while (true) {
+		pthread_mutex_lock(&images_mutex);
+		if (analysis_queue_count == 0 && !scanning_done) {
+			wait_start = metrics_now();
+			while (analysis_queue_count == 0 && !scanning_done) {
+				pthread_cond_wait(&images_available, &images_mutex);
 			}
-	    }
-	    closedir(dir);
+			thread_idle_time += metrics_now() - wait_start;
+		}
+
+		if (analysis_queue_count == 0) {
+			pthread_mutex_unlock(&images_mutex);
+			break;
+		}
+
+		image = analysis_queue[analysis_queue_head];
+		analysis_queue_head = (analysis_queue_head + 1) % ANALYSIS_QUEUE_SIZE;
+		analysis_queue_count--;
+		metrics_queue_depth(analysis_queue_count);
+		LOG_MSG("Thread %d: will process image %s", id, image.path);
+		LOG_MSG("Thread %d: available images to process %d", id, analysis_queue_count);
+		pthread_cond_signal(&images_space);
+		pthread_mutex_unlock(&images_mutex);
+
+		metrics.path = image.path;
+		metrics.thread = id;
+		metrics.discovered = image.queued_at;
+		metrics.scan_time = image.scan_time;
+		metrics.queue_time = metrics_now() - image.queued_at;
+		process_image(image.path, image.sequence, &metrics);
+		metrics_record_image(&metrics);
+		safe_free(image.path);
+		images++;
 	}
+
+	metrics_record_thread(ANALYZER_THREAD, id, metrics_now() - start - thread_idle_time, thread_idle_time, images);
+	return NULL;
 }
 
-void count_images(const char * file_name) {
-	total_images_count++;
+// Hands a result to the callback and releases its path and analysis
+static void report_result(image_info * result) {
+	if (result_callback != NULL) {
+		result_callback(result, result_context);
+	}
+	safe_free(result->path);
+	free_image_analysis(result->analysis);
+	analyzed_images_count++;
 }
 
-void load_image(const char * file_name) {
+// Doubles the reorder buffer, keeping every pending result at its new index
+static void grow_reorder_buffer() {
+	pending_result * old_buffer = reorder_buffer;
+	int i, sequence, old_capacity = reorder_capacity;
+
+	reorder_capacity = reorder_capacity == 0 ? 64 : 2 * reorder_capacity;
+	reorder_buffer = safe_malloc(reorder_capacity * sizeof(pending_result));
+	for (i = 0; i < old_capacity; i++) {
+		sequence = next_sequence + i;
+		reorder_buffer[sequence % reorder_capacity] = old_buffer[sequence % old_capacity];
+	}
+	safe_free(old_buffer);
+}
+
+// Reports the result of the image with the given sequence number, taking
+// ownership of its path. result is NULL for images that couldn't be loaded.
+// In discovery order, results wait in the reorder buffer until the results of
+// every image found before them were reported.
+static void deliver_result(int sequence, image_info * result) {
+	pending_result * pending;
+
+	pthread_mutex_lock(&images_info_mutex);
+	if (!ordered_results || sequence < 0) {
+		if (result != NULL) {
+			report_result(result);
+		}
+		pthread_mutex_unlock(&images_info_mutex);
+		return;
+	}
+
+	while (sequence - next_sequence >= reorder_capacity) {
+		grow_reorder_buffer();
+	}
+
+	pending = &reorder_buffer[sequence % reorder_capacity];
+	pending->ready = true;
+	pending->analyzed = result != NULL;
+	if (result != NULL) {
+		pending->result = *result;
+	}
+
+	pending = &reorder_buffer[next_sequence % reorder_capacity];
+	while (pending->ready) {
+		if (pending->analyzed) {
+			report_result(&pending->result);
+		}
+		pending->ready = false;
+		next_sequence++;
+		pending = &reorder_buffer[next_sequence % reorder_capacity];
+	}
+	pthread_mutex_unlock(&images_info_mutex);
+}
+
+// Loads and analyzes the image at file_name and delivers its result, filling
+// the load and analysis fields of metrics
+static void process_image(const char * file_name, int sequence, image_metrics * metrics) {
 	bmp image;
-	load_bmp(file_name, &image);
+	image_info analyzed_image;
+	tile_summary * tiles = NULL, * previous_tiles;
+	long long start = metrics_now();
+
+	metrics->bytes_read = 0;
+	metrics->analysis_time = 0;
+	// Cached results only hold the largest rectangle
+	metrics->cached = top_rectangles == 0 && !color_statistics && cache_lookup(file_name, &analyzed_image);
+	if (metrics->cached) {
+		// Unchanged since the last run, no need to load the pixels
+		LOG_MSG("image from %s found in cache", file_name);
+		metrics->load_time = metrics_now() - start;
+		metrics->analyzed = true;
+		analyzed_image.path = safe_strdup(file_name);
+		analyzed_image.analysis = NULL;
+		deliver_result(sequence, &analyzed_image);
+		return;
+	}
+
 	LOG_MSG("Loading image from %s", file_name);
-	pthread_mutex_lock(&images_mutex);
-	images[available_images_count++] = image;
-	LOG_MSG("image from %s loaded in index %d", file_name, available_images_count - 1);
-	pthread_mutex_unlock(&images_mutex);
+	metrics->analyzed = load_bmp(file_name, &image);
+	metrics->load_time = metrics_now() - start;
+	metrics->bytes_read = image.bytes_read;
+	if (!metrics->analyzed) {
+		// Unsupported or corrupt images are skipped instead of aborting the batch
+		fprintf(stderr, "WARNING: skipping unsupported image %s\n", file_name);
+		pthread_mutex_lock(&images_mutex);
+		total_images_count--;
+		pthread_mutex_unlock(&images_mutex);
+		deliver_result(sequence, NULL);
+		return;
+	}
+
+	assert(image.pixels != NULL);
+	assert(image.path != NULL);
+
+	LOG_MSG("started processing image %s", image.path);
+
+	start = time_us();
+	if (top_rectangles > 0 || color_statistics) {
+		memset(&analyzed_image, 0, sizeof(analyzed_image));
+		analyzed_image.analysis = analyze_bmp(&image, top_rectangles, color_statistics);
+		if (analyzed_image.analysis->rectangles_count > 0) {
+			analyzed_image.top_left_x = analyzed_image.analysis->rectangles[0].top_left_x;
+			analyzed_image.top_left_y = analyzed_image.analysis->rectangles[0].top_left_y;
+			analyzed_image.bottom_right_x = analyzed_image.analysis->rectangles[0].bottom_right_x;
+			analyzed_image.bottom_right_y = analyzed_image.analysis->rectangles[0].bottom_right_y;
+		}
+	} else if (cache_enabled()) {
+		// Only the tiles changed since the cached result need a rescan
+		previous_tiles = cache_take_tiles(file_name);
+		analyzed_image = analyze_bmp_incremental(&image, previous_tiles, &tiles);
+		free_tile_summary(previous_tiles);
+	} else {
+		analyzed_image = get_max_rectangle(&image);
+	}
+	metrics->analysis_time = time_us() - start;
+	cache_store(image.path, &analyzed_image, metrics->analysis_time, tiles);
+
+	LOG_MSG("finished processing image %s", image.path);
+
+	analyzed_image.path = safe_strdup(image.path);
+	free_bmp(&image);
+	deliver_result(sequence, &analyzed_image);
 }
 
-image_info get_max_rectangle(const bmp * image) {
-	int row = image->header.height;
-	int rowFrom, rowTo, columnFrom, columnTo;
-	int max = 0;
-	int area;
-	int column = image->header.width;
-	image_info analyzed_image;
+void load_image(const char * file_name) {
+	image_metrics metrics;
+	process_image(file_name, -1, &metrics);
+}
+
+// Column where a bar of the histogram starts and its height
+typedef struct {
+	int start;
+	int height;
+} histogram_bar;
+
+// State of one analyze_bmp scan
+typedef struct {
+	// Min-heap of the best maximal rectangles found so far, worst at index 0
+	color_rectangle * candidates;
+	int candidates_count;
+	int candidates_capacity;
+	// Open addressing table of color_stats indexes by color, -1 when empty
+	int * color_slots;
+	int color_slots_capacity;
+	color_stats * colors;
+	int colors_count;
+	int colors_capacity;
+} rectangle_scan;
+
+// Returns true if a ranks before b: larger area, then topmost top edge,
+// topmost bottom edge and rightmost left edge, which is the rectangle the
+// former exhaustive search reported
+static bool ranks_before(const color_rectangle * a, const color_rectangle * b) {
+	if (a->area != b->area) return a->area > b->area;
+	if (a->top_left_y != b->top_left_y) return a->top_left_y < b->top_left_y;
+	if (a->bottom_right_y != b->bottom_right_y) return a->bottom_right_y < b->bottom_right_y;
+	return a->top_left_x > b->top_left_x;
+}
+
+static int compare_rectangles(const void * left, const void * right) {
+	return ranks_before(left, right) ? -1 : ranks_before(right, left) ? 1 : 0;
+}
+
+static bool rectangles_overlap(const color_rectangle * a, const color_rectangle * b) {
+	return a->top_left_x <= b->bottom_right_x && b->top_left_x <= a->bottom_right_x &&
+		   a->top_left_y <= b->bottom_right_y && b->top_left_y <= a->bottom_right_y;
+}
+
+// Keeps candidate if it is among the candidates_capacity best seen so far
+static void offer_candidate(rectangle_scan * scan, const color_rectangle * candidate) {
+	color_rectangle * heap = scan->candidates;
+	color_rectangle moved;
+	int i, child, count = scan->candidates_count;
+
+	if (count < scan->candidates_capacity) {
+		// Sift up from the new leaf
+		for (i = count; i > 0 && ranks_before(&heap[(i - 1) / 2], candidate); i = (i - 1) / 2) {
+			heap[i] = heap[(i - 1) / 2];
+		}
+		heap[i] = *candidate;
+		scan->candidates_count++;
+		return;
+	}
+
+	if (!ranks_before(candidate, &heap[0])) {
+		return;
+	}
+
+	// Replace the worst and sift it down
+	moved = *candidate;
+	for (i = 0; (child = 2 * i + 1) < count; i = child) {
+		if (child + 1 < count && ranks_before(&heap[child], &heap[child + 1])) {
+			child++;
+		}
+		if (!ranks_before(&moved, &heap[child])) {
+			break;
+		}
+		heap[i] = heap[child];
+	}
+	heap[i] = moved;
+}
+
+// Returns the statistics entry of color, adding it on first sight
+static color_stats * find_color(rectangle_scan * scan, int color) {
+	int * old_slots = scan->color_slots;
+	color_stats * old_colors;
+	int i, slot, old_capacity = scan->color_slots_capacity;
+
+	if (2 * (scan->colors_count + 1) > scan->color_slots_capacity) {
+		scan->color_slots_capacity = old_capacity == 0 ? 256 : 2 * old_capacity;
+		scan->color_slots = safe_malloc_uninitialized(scan->color_slots_capacity * sizeof(int));
+		memset(scan->color_slots, -1, scan->color_slots_capacity * sizeof(int));
+		for (i = 0; i < scan->colors_count; i++) {
+			slot = ((unsigned int)scan->colors[i].color * 2654435761u) & (scan->color_slots_capacity - 1);
+			while (scan->color_slots[slot] != -1) {
+				slot = (slot + 1) & (scan->color_slots_capacity - 1);
+			}
+			scan->color_slots[slot] = i;
+		}
+		safe_free(old_slots);
+	}
+
+	slot = ((unsigned int)color * 2654435761u) & (scan->color_slots_capacity - 1);
+	while (scan->color_slots[slot] != -1) {
+		if (scan->colors[scan->color_slots[slot]].color == color) {
+			return &scan->colors[scan->color_slots[slot]];
+		}
+		slot = (slot + 1) & (scan->color_slots_capacity - 1);
+	}
+
+	if (scan->colors_count == scan->colors_capacity) {
+		old_colors = scan->colors;
+		scan->colors_capacity = scan->colors_capacity == 0 ? 64 : 2 * scan->colors_capacity;
+		scan->colors = safe_malloc(scan->colors_capacity * sizeof(color_stats));
+		if (old_colors != NULL) {
+			memcpy(scan->colors, old_colors, scan->colors_count * sizeof(color_stats));
+			safe_free(old_colors);
+		}
+	}
+
+	scan->color_slots[slot] = scan->colors_count;
+	scan->colors[scan->colors_count].color = color;
+	scan->colors[scan->colors_count].pixels = 0;
+	scan->colors[scan->colors_count].largest_area = 0;
+	return &scan->colors[scan->colors_count++];
+}
 
-	if(row == 0) {
-		// if row equals to 0 then there's no pixels at all
-		// means that column is equal to 0 as well.
-		assert(column == 0);
-		analyzed_image.top_left_x = 0;
-		analyzed_image.top_left_y = 0;
-		analyzed_image.bottom_right_x = 0;
-		analyzed_image.bottom_right_y = 0;
-	}
-
-	for (rowFrom = 0; rowFrom < row; rowFrom++) {
-		for (rowTo = rowFrom; rowTo < row; rowTo++) {
-			for (columnFrom = 0; columnFrom < column; columnFrom++) {
-				for (columnTo = columnFrom; columnTo < column; columnTo++) {
-					area = get_area(image, columnFrom, columnTo, rowFrom, rowTo);
-
-					if (area > max) {
-						max = area;
-						analyzed_image.top_left_x = columnFrom;
-						analyzed_image.top_left_y = rowFrom;
-						analyzed_image.bottom_right_x = columnTo;
-						analyzed_image.bottom_right_y = rowTo;
+static int compare_colors(const void * left, const void * right) {
+	const color_stats * l = left, * r = right;
+	if (l->pixels != r->pixels) return l->pixels > r->pixels ? -1 : 1;
+	return l->color < r->color ? -1 : l->color > r->color;
+}
+
+// Enumerates every maximal rectangle of uniform color in one pass over the
+// rows. heights[j] counts the pixels of the same color ending at the current
+// row in column j; within every run of one color in the row, the largest
+// rectangles of the histogram are found with a stack of increasing bars. A
+// rectangle popped from the stack can't grow left, right or up; it is only
+// offered when it can't grow down either, which continues[] tells by counting
+// the columns whose color goes on in the next row. Scans the rows from
+// first_row up to last_row (excluded); heights holds the heights of the row
+// above first_row and is left with those of the last row scanned.
+static void scan_rectangles(const bmp * image, rectangle_scan * scan, bool colors, int first_row, int last_row, int * heights) {
+	int width = image->header.width, height = image->header.height;
+	int * continues = safe_malloc((width + 1) * sizeof(int));
+	histogram_bar * stack = safe_malloc((width + 1) * sizeof(histogram_bar));
+	const pixel * row, * next_row;
+	const pixel * previous_row = first_row > 0 ? &image->pixels[(first_row - 1) * width] : NULL;
+	color_stats * stats = NULL;
+	color_rectangle candidate;
+	int i, j, run_start, run_end, bar_height, start, top;
+
+	for (i = first_row; i < last_row; i++) {
+		row = &image->pixels[i * width];
+		next_row = i + 1 < height ? &image->pixels[(i + 1) * width] : NULL;
+
+		continues[0] = 0;
+		for (j = 0; j < width; j++) {
+			heights[j] = previous_row != NULL && row[j] == previous_row[j] ? heights[j] + 1 : 1;
+			continues[j + 1] = continues[j] + (next_row != NULL && next_row[j] == row[j]);
+		}
+
+		for (run_start = 0; run_start < width; run_start = run_end) {
+			for (run_end = run_start + 1; run_end < width && row[run_end] == row[run_start]; run_end++);
+			if (colors) {
+				stats = find_color(scan, row[run_start]);
+				stats->pixels += run_end - run_start;
+			}
+
+			// The bar of height 0 past the run pops everything left
+			top = 0;
+			for (j = run_start; j <= run_end; j++) {
+				bar_height = j < run_end ? heights[j] : 0;
+				start = j;
+				while (top > 0 && stack[top - 1].height > bar_height) {
+					top--;
+					start = stack[top].start;
+					if (continues[j] - continues[start] == j - start) {
+						// The next row extends it
+						continue;
 					}
-					else if(area == max && rowFrom == analyzed_image.top_left_y) {
-						analyzed_image.top_left_x = columnFrom;
-						analyzed_image.bottom_right_x = columnTo;
+
+					candidate.top_left_x = start;
+					candidate.top_left_y = i - stack[top].height + 1;
+					candidate.bottom_right_x = j - 1;
+					candidate.bottom_right_y = i;
+					candidate.color = row[run_start];
+					candidate.area = stack[top].height * (j - start);
+					offer_candidate(scan, &candidate);
+					if (colors && candidate.area > stats->largest_area) {
+						stats->largest_area = candidate.area;
 					}
 				}
+
+				if (j < run_end && (top == 0 || stack[top - 1].height < bar_height)) {
+					stack[top].start = start;
+					stack[top].height = bar_height;
+					top++;
+				}
 			}
 		}
+
+		previous_row = row;
 	}
 
+	safe_free(stack);
+	safe_free(continues);
+}
+
+image_analysis * analyze_bmp(const bmp * image, int k, bool colors) {
+	image_analysis * analysis = safe_malloc(sizeof(image_analysis));
+	rectangle_scan scan;
+	int i, j, * heights;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.candidates_capacity = k <= 1 ? 1 : k * TOP_RECTANGLE_CANDIDATES;
+	scan.candidates = safe_malloc(scan.candidates_capacity * sizeof(color_rectangle));
+	heights = safe_malloc((image->header.width + 1) * sizeof(int));
+	scan_rectangles(image, &scan, colors, 0, image->header.height, heights);
+	safe_free(heights);
+
+	// Greedy choice among the candidates, best first
+	qsort(scan.candidates, scan.candidates_count, sizeof(color_rectangle), compare_rectangles);
+	analysis->rectangles = safe_malloc((k < 1 ? 1 : k) * sizeof(color_rectangle));
+	analysis->rectangles_count = 0;
+	for (i = 0; i < scan.candidates_count && analysis->rectangles_count < (k < 1 ? 1 : k); i++) {
+		for (j = 0; j < analysis->rectangles_count && !rectangles_overlap(&scan.candidates[i], &analysis->rectangles[j]); j++);
+		if (j == analysis->rectangles_count) {
+			analysis->rectangles[analysis->rectangles_count++] = scan.candidates[i];
+		}
+	}
+
+	// colors stays NULL unless -C is given
+	if (scan.colors_count > 1) {
+		qsort(scan.colors, scan.colors_count, sizeof(color_stats), compare_colors);
+	}
+	analysis->colors = scan.colors;
+	analysis->colors_count = scan.colors_count;
+	safe_free(scan.color_slots);
+	safe_free(scan.candidates);
+	return analysis;
+}
+
+void free_image_analysis(image_analysis * analysis) {
+	if (analysis != NULL) {
+		safe_free(analysis->rectangles);
+		safe_free(analysis->colors);
+		safe_free(analysis);
+	}
+}
+
+image_info get_max_rectangle(const bmp * image) {
+	image_info analyzed_image;
+	image_analysis * analysis;
+
+	memset(&analyzed_image, 0, sizeof(analyzed_image));
+	if (image->header.width == 0 || image->header.height == 0) {
+		// No pixels at all
+		return analyzed_image;
+	}
+
+	analysis = analyze_bmp(image, 1, false);
+	analyzed_image.top_left_x = analysis->rectangles[0].top_left_x;
+	analyzed_image.top_left_y = analysis->rectangles[0].top_left_y;
+	analyzed_image.bottom_right_x = analysis->rectangles[0].bottom_right_x;
+	analyzed_image.bottom_right_y = analysis->rectangles[0].bottom_right_y;
+	free_image_analysis(analysis);
 	return analyzed_image;
 }
 
-int calc_area(int columnFrom, int columnTo, int rowFrom, int rowTo) {
-	return (columnTo - columnFrom + 1) * (rowTo - rowFrom + 1);
+tile_summary * create_tile_summary(int width, int height) {
+	tile_summary * summary = safe_malloc(sizeof(tile_summary));
+	summary->width = width;
+	summary->height = height;
+	summary->bands_count = (height + TILE_SIZE - 1) / TILE_SIZE;
+	summary->tiles_per_band = (width + TILE_SIZE - 1) / TILE_SIZE;
+	summary->bands = safe_malloc(summary->bands_count * sizeof(tile_band));
+	summary->tile_hashes = safe_malloc(summary->bands_count * summary->tiles_per_band * sizeof(unsigned long long));
+	summary->rows_scanned = 0;
+	return summary;
 }
 
-int get_area(const bmp * image, int columnFrom, int columnTo, int rowFrom, int rowTo) {
-	int i, j;
-	int color = get_pixel(rowFrom, columnFrom, image);
+void free_tile_summary(tile_summary * summary) {
+	if (summary != NULL) {
+		safe_free(summary->tile_hashes);
+		safe_free(summary->bands);
+		safe_free(summary);
+	}
+}
 
-	for (i = rowFrom; i <= rowTo; i++) {
-		for (j = columnFrom; j <= columnTo; j++) {
-			if (get_pixel(i, j, image) != color) return 0;
+// Hashes the pixels of every tile, one row at a time so the pixels are read in order
+static void hash_tiles(const bmp * image, tile_summary * summary) {
+	int width = summary->width, i, j, tile, end;
+	unsigned long long * hashes, hash;
+	const pixel * row;
+
+	for (i = 0; i < summary->bands_count * summary->tiles_per_band; i++) {
+		summary->tile_hashes[i] = TILE_HASH_BASIS;
+	}
+
+	for (i = 0; i < summary->height; i++) {
+		row = &image->pixels[i * width];
+		hashes = &summary->tile_hashes[(i / TILE_SIZE) * summary->tiles_per_band];
+		for (tile = 0; tile < summary->tiles_per_band; tile++) {
+			hash = hashes[tile];
+			end = (tile + 1) * TILE_SIZE < width ? (tile + 1) * TILE_SIZE : width;
+			// Two pixels per step halves the chain of dependent multiplications
+			for (j = tile * TILE_SIZE; j + 1 < end; j += 2) {
+				hash = (hash ^ ((unsigned long long)(unsigned int)row[j] << 32 | (unsigned int)row[j + 1])) * TILE_HASH_PRIME;
+			}
+			if (j < end) {
+				hash = (hash ^ (unsigned int)row[j]) * TILE_HASH_PRIME;
+			}
+			hashes[tile] = hash;
 		}
 	}
+}
+
+static unsigned long long hash_heights(const int * heights, int width) {
+	unsigned long long hash = TILE_HASH_BASIS;
+	int j;
+
+	for (j = 0; j < width; j++) {
+		hash = (hash ^ (unsigned int)heights[j]) * TILE_HASH_PRIME;
+	}
+
+	return hash;
+}
 
-	return calc_area(columnFrom, columnTo, rowFrom, rowTo);
+// Computes the heights scan_rectangles has after scanning up to row, walking
+// up only the columns whose color still goes on
+static void rebuild_heights(const bmp * image, int row, int * heights) {
+	int width = image->header.width;
+	int * columns = safe_malloc_uninitialized(width * sizeof(int));
+	int i, j, n, count = width, kept;
+	const pixel * current, * above;
+
+	for (j = 0; j < width; j++) {
+		heights[j] = 1;
+		columns[j] = j;
+	}
+
+	for (i = row; i > 0 && count > 0; i--) {
+		current = &image->pixels[i * width];
+		above = &image->pixels[(i - 1) * width];
+		for (n = 0, kept = 0; n < count; n++) {
+			j = columns[n];
+			if (above[j] == current[j]) {
+				heights[j]++;
+				columns[kept++] = j;
+			}
+		}
+		count = kept;
+	}
+
+	safe_free(columns);
+}
+
+static bool band_changed(const tile_summary * current, const tile_summary * previous, int band) {
+	int offset = band * current->tiles_per_band;
+	return memcmp(&current->tile_hashes[offset], &previous->tile_hashes[offset],
+				  current->tiles_per_band * sizeof(unsigned long long)) != 0;
+}
+
+// A band holds the rectangles whose bottom edge lies in it. They depend on the
+// pixels up to the row below the band, so the band above the first changed one
+// is rescanned too. Past the last changed band, once the heights after a band
+// hash like before, every following band would find the same rectangles again.
+image_info analyze_bmp_incremental(const bmp * image, const tile_summary * previous, tile_summary ** summary) {
+	int width = image->header.width, height = image->header.height;
+	tile_summary * current = create_tile_summary(width, height);
+	int band, first_band = 0, first_changed, last_changed = current->bands_count - 1;
+	int * heights = safe_malloc((width + 1) * sizeof(int));
+	const color_rectangle * best = NULL;
+	image_info analyzed_image;
+	rectangle_scan scan;
+	bool reuse;
+
+	hash_tiles(image, current);
+	reuse = previous != NULL && previous->width == width && previous->height == height;
+	if (reuse) {
+		for (first_changed = 0; first_changed < current->bands_count && !band_changed(current, previous, first_changed); first_changed++);
+		for (last_changed = current->bands_count - 1; last_changed > first_changed && !band_changed(current, previous, last_changed); last_changed--);
+		first_band = first_changed == current->bands_count ? first_changed : first_changed > 0 ? first_changed - 1 : 0;
+		memcpy(current->bands, previous->bands, first_band * sizeof(tile_band));
+		if (first_band > 0 && first_band < current->bands_count) {
+			rebuild_heights(image, first_band * TILE_SIZE - 1, heights);
+		}
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	scan.candidates_capacity = 1;
+	scan.candidates = safe_malloc(sizeof(color_rectangle));
+	for (band = first_band; band < current->bands_count; band++) {
+		scan.candidates_count = 0;
+		scan_rectangles(image, &scan, false, band * TILE_SIZE,
+						(band + 1) * TILE_SIZE < height ? (band + 1) * TILE_SIZE : height, heights);
+		current->rows_scanned += ((band + 1) * TILE_SIZE < height ? (band + 1) * TILE_SIZE : height) - band * TILE_SIZE;
+		if (scan.candidates_count > 0) {
+			current->bands[band].largest = scan.candidates[0];
+		}
+		current->bands[band].heights_hash = hash_heights(heights, width);
+
+		if (reuse && band > last_changed && current->bands[band].heights_hash == previous->bands[band].heights_hash) {
+			memcpy(&current->bands[band + 1], &previous->bands[band + 1],
+				   (current->bands_count - band - 1) * sizeof(tile_band));
+			break;
+		}
+	}
+
+	for (band = 0; band < current->bands_count; band++) {
+		if (current->bands[band].largest.area > 0 && (best == NULL || ranks_before(&current->bands[band].largest, best))) {
+			best = &current->bands[band].largest;
+		}
+	}
+
+	memset(&analyzed_image, 0, sizeof(analyzed_image));
+	if (best != NULL) {
+		analyzed_image.top_left_x = best->top_left_x;
+		analyzed_image.top_left_y = best->top_left_y;
+		analyzed_image.bottom_right_x = best->bottom_right_x;
+		analyzed_image.bottom_right_y = best->bottom_right_y;
+	}
+
+	safe_free(scan.candidates);
+	safe_free(heights);
+	*summary = current;
+	return analyzed_image;
 }
@@ -5,6 +5,7 @@
 #include "utility.h"
 
 typedef struct bmp_t bmp;
+typedef struct image_analysis_t image_analysis;
 
 struct ImageInfo {
 	// Path to the image file.
@@ -16,30 +17,101 @@ struct ImageInfo {
 	// Coordinates of the bottom-right corner of the largest rectangle of
 	// uniform color.
 	int bottom_right_x, bottom_right_y;
+	// Top rectangles and color statistics when top_rectangles or
+	// color_statistics are set, NULL otherwise. Only valid in the result
+	// callback, released with the path.
+	image_analysis * analysis;
 };
 
 typedef struct ImageInfo image_info;
 
-// The last image index available for processing
-int available_images_count;
+// Maximal rectangles kept per requested top rectangle by analyze_bmp
+#define TOP_RECTANGLE_CANDIDATES (32)
 
-// Total number of images to analyze
-int total_images_count;
+// A rectangle of uniform color, corners are inclusive
+typedef struct {
+	int top_left_x, top_left_y;
+	int bottom_right_x, bottom_right_y;
+	int color; // 0BGR
+	int area;
+} color_rectangle;
+
+// Pixels of one color of an image
+typedef struct {
+	int color; // 0BGR
+	int pixels;
+	// Area of the largest uniform rectangle of this color
+	int largest_area;
+} color_stats;
+
+// Everything analyze_bmp found in an image
+struct image_analysis_t {
+	// Largest non-overlapping rectangles, largest first
+	color_rectangle * rectangles;
+	int rectangles_count;
+	// One entry per color, most frequent first, when requested
+	color_stats * colors;
+	int colors_count;
+};
 
-// Total number of images to analyzed till current moment
-int analyzed_images_count;
+// Side in pixels of the square tiles tracked by analyze_bmp_incremental
+#define TILE_SIZE (64)
+
+// What analyze_bmp_incremental remembers about one row of tiles
+typedef struct {
+	// Hash of the same color heights of every column after the last pixel
+	// row of the band, tells when a rescan can stop
+	unsigned long long heights_hash;
+	// Largest rectangle whose bottom edge lies in the band, area 0 if none
+	color_rectangle largest;
+} tile_band;
+
+// Tile hashes and per band results of an image, kept with its cached result
+// so a modified copy only needs the changed bands rescanned
+typedef struct {
+	int width, height;
+	int bands_count;
+	int tiles_per_band;
+	tile_band * bands;
+	// bands_count * tiles_per_band hashes of the pixels of every tile
+	unsigned long long * tile_hashes;
+	// Pixel rows scanned to produce this summary
+	int rows_scanned;
+} tile_summary;
+
+// Receives every result as soon as it is known. Calls are serialized, the
+// path is released once the callback returns.
+typedef void (*image_result_callback)(const image_info * result, void * context);
+
+// Number of threads scanning directories for images
+extern int scan_thread_limit;
+
+// When true, subdirectories of the analyzed directory are scanned as well
+extern bool recursive_scan;
+
+// Number of non-overlapping rectangles reported in image_info.analysis, 0 to
+// report only the largest one. Cached results are not used when this is set.
+extern int top_rectangles;
+
+// When true, image_info.analysis holds per-color statistics. Cached results
+// are not used when this is set.
+extern bool color_statistics;
+
+// Total number of images found till current moment, images that can't be
+// loaded are not counted
+extern int total_images_count;
 
-// Data structure to hold the analyzed images.
-image_info * images_info;
+// Total number of images to analyzed till current moment
+extern int analyzed_images_count;
 
-// Data structure to hold the bitmaps
-bmp * images;
+// Data structure to hold the analyzed images, filled by analyze_images_in_directory.
+extern image_info * images_info;
 
-// Mutex to lock the critical section in analyze_image and load_images
-pthread_mutex_t images_mutex;
+// Mutex to lock the analysis queue filled by scan_directory and emptied by analyze_image
+extern pthread_mutex_t images_mutex;
 
-// Mutex to lock the critical section in analyze_image and load_images
-pthread_mutex_t images_info_mutex;
+// Mutex serializing the delivery of results to the callback
+extern pthread_mutex_t images_info_mutex;
 
 // Returns a dynamically allocated array of ImageInfo structs, one per image.
 // The number of valid elements in the array should be written to the address
@@ -47,34 +119,55 @@ pthread_mutex_t images_info_mutex;
 // Processes images in the directory and detect the largesr rectangle of same color in every image.
 image_info * analyze_images_in_directory(int thread_limit, const char * directory, int * images_analyzed);
 
-// Returns a dynamically allocated array of ImageInfo structs, one per image.
-// The number of valid elements in the array should be written to the address
-// in global variable images_index.
-// Iterates over the directory and loads the available *.bmp images.
-void * load_images(void * arg);
+// Analyzes the images in directory like analyze_images_in_directory, passing
+// every result to callback with context instead of keeping them. When ordered
+// is true, results are reported in the order the images were found, holding
+// back those that finish early. Returns the number of images analyzed.
+int analyze_images_streaming(int thread_limit, const char * directory, bool ordered, image_result_callback callback, void * context);
 
-// Returns an ImageInfo struct for one image filled with coordinates of largest
-// rectangle of same color.
-void * analyze_image(void * arg);
+// Scanner thread, takes directories from the scan stack until every directory
+// reachable from the analyzed one was scanned.
+void * scan_directories(void * arg);
 
-// Iterates over a directory and lists all files there and use function
-// pointer passed to apply some action on the files.
-void read_dir(const char * directory, void (*file_action)(const char *));
+// Lists a directory opened as dir_fd, queues its *.bmp files for analysis as
+// soon as they are found and pushes its subdirectories on the scan stack when
+// scanning recursively. Takes ownership of dir_fd.
+void scan_directory(int dir_fd, const char * directory);
 
-// Utility function used with read_dir to count number of bmp files
-// in a directory.
-void count_images(const char * file_name);
+// Analyzer thread, takes image paths from the analysis queue, loads and
+// analyzes them until the queue is empty and scanning is done.
+void * analyze_image(void * arg);
 
-// Utility function used with read_dir to load bmp image.
+// Loads the image at file_name and reports the largest rectangle of same color
+// found in it to the callback of the current run. Images with a cached result
+// are not loaded, their result is reported right away.
 void load_image(const char * file_name);
 
-// Finds maximum rectangle of contiguous color in an image
+// Finds maximum rectangle of contiguous color in an image. Among rectangles of
+// the same area the one with the topmost top edge wins, then the one with the
+// topmost bottom edge, then the rightmost.
 image_info get_max_rectangle(const bmp * image);
 
-// Calculates area of a rectangle
-int calc_area(int columnFrom, int columnTo, int rowFrom, int rowTo);
+// Finds, in a single scan of the pixels, the maximal rectangles of uniform
+// color (those that can't grow in any direction) and keeps the largest. The
+// top k are then chosen greedily, largest first, skipping those overlapping a
+// rectangle already chosen; ties are broken like in get_max_rectangle. Only
+// the TOP_RECTANGLE_CANDIDATES * k largest maximal rectangles are considered,
+// so heavily overlapping images may get fewer than k. When colors is true the
+// pixels of every color are counted as well. Release with free_image_analysis.
+image_analysis * analyze_bmp(const bmp * image, int k, bool colors);
+
+void free_image_analysis(image_analysis * analysis);
+
+// Finds the same rectangle as get_max_rectangle and writes the tile summary of
+// image to summary. When previous is the summary of an earlier version of the
+// image, only the rows from the band above the first changed tile are scanned,
+// stopping as soon as the scan state matches the previous one again; the other
+// bands keep their previous results.
+image_info analyze_bmp_incremental(const bmp * image, const tile_summary * previous, tile_summary ** summary);
+
+tile_summary * create_tile_summary(int width, int height);
 
-// Calculates the area of the contiguous rectangle in the specific coordinates
-int get_area(const bmp * image, int columnFrom, int columnTo, int rowFrom, int rowTo);
+void free_tile_summary(tile_summary * summary);
 
 #endif // _ANALYZER_H_
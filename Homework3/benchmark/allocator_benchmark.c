@@ -0,0 +1,183 @@
+// Measures the memory allocator behind load_bmp: threads loading and freeing
+// the same large images over and over, the path the analyzer takes per image,
+// then only the allocations of those loads. Prints ms per image and the peak
+// RSS of each phase, so run it once per allocator to compare them. Build
+// from Homework3/benchmark with:
+//   gcc -O2 -o allocator_benchmark allocator_benchmark.c synthetic_bmp.c ../bmp.c
+//       ../utility.c ../logger.c -lpthread -lm
+// Usage: allocator_benchmark [-a allocator] [-t threads] [-n loads] [-s <width>x<height>]
+// caching allocator, 4 threads, 10 loads of each image per thread and
+// 2048x2048 images by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "synthetic_bmp.h"
+#include "../bmp.h"
+
+#define MAX_THREADS (64)
+#define PAGE_SIZE (4096)
+
+// Bits per pixel of the images, the formats write_synthetic_bmp supports
+static const int bit_counts[] = { 24, 8 };
+#define IMAGES (sizeof(bit_counts) / sizeof(bit_counts[0]))
+
+static char paths[IMAGES][64];
+static int loads = 10;
+static int width = 2048, height = 2048;
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void * load_images(void * arg) {
+	bmp image;
+	uint i;
+	int j;
+
+	for (j = 0; j < loads; j++) {
+		for (i = 0; i < IMAGES; i++) {
+			if (!load_bmp(paths[i], &image)) {
+				printf("ERROR: loading file at %s\n", paths[i]);
+				exit(1);
+			}
+			free_bmp(&image);
+		}
+	}
+	return NULL;
+}
+
+// Allocates what load_bmp would for every load, touching each page of the
+// pixels like the decoder does, without reading the files
+static void * allocate_images(void * arg) {
+	size_t pixels_size = (size_t)width * height * sizeof(pixel), offset;
+	arena * arena;
+	byte * pixels;
+	uint i;
+	int j;
+
+	for (j = 0; j < loads; j++) {
+		for (i = 0; i < IMAGES; i++) {
+			arena = arena_create(pixels_size + ((size_t)bit_counts[i] * width + 31) / 32 * 4 + strlen(paths[i]) + 64);
+			arena_strdup(arena, paths[i]);
+			pixels = arena_malloc(arena, pixels_size, false);
+			for (offset = 0; offset < pixels_size; offset += PAGE_SIZE) {
+				pixels[offset] = 1;
+			}
+			arena_destroy(arena);
+		}
+	}
+	return NULL;
+}
+
+// Returns the peak RSS of the process in MB since the last reset_peak_rss
+static long peak_rss() {
+	FILE * stream = safe_fopen("/proc/self/status", "r");
+	char line[256];
+	long peak = 0;
+
+	while (fgets(line, sizeof(line), stream) != NULL) {
+		if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) {
+			break;
+		}
+	}
+	fclose(stream);
+	return peak / 1024;
+}
+
+// Restarts the peak RSS from the current RSS, so writing the images doesn't count
+static void reset_peak_rss() {
+	FILE * stream = safe_fopen("/proc/self/clear_refs", "w");
+	fputs("5", stream);
+	fclose(stream);
+}
+
+// Runs body on threads threads and returns the ms spent per image, the
+// peak RSS during the run goes to rss
+static double run(void * (*body)(void *), int threads, long * rss) {
+	pthread_t ids[MAX_THREADS];
+	double start, elapsed;
+	int i;
+
+	reset_peak_rss();
+	start = now();
+	for (i = 0; i < threads; i++) {
+		safe_pthread_create(&ids[i], NULL, body, NULL);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	elapsed = now() - start;
+	*rss = peak_rss();
+	return elapsed * 1e3 / ((double)threads * loads * IMAGES);
+}
+
+int main(int argc, char * argv[]) {
+	const memory_allocator * allocator = &caching_allocator;
+	char directory[] = "/tmp/allocator_benchmarkXXXXXX";
+	int threads = 4, option;
+	synthetic_options options;
+	double load_time, allocation_time;
+	long load_rss, allocation_rss;
+	image_info truth;
+	uint i;
+
+	while ((option = getopt(argc, argv, "a:t:n:s:")) != -1) {
+		switch (option) {
+		case 'a':
+			allocator = find_memory_allocator(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			loads = atoi(optarg);
+			break;
+		case 's':
+			if (!parse_size(optarg, &width, &height)) {
+				width = 0;
+			}
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc || allocator == NULL || threads < 1 || threads > MAX_THREADS || loads < 1 || width < 1) {
+		printf("Usage: %s [-a caching|system] [-t threads] [-n loads] [-s <width>x<height>]\n", argv[0]);
+		return 1;
+	}
+	set_memory_allocator(allocator);
+
+	if (mkdtemp(directory) == NULL) {
+		printf("ERROR: creating a directory at %s\n", directory);
+		return 1;
+	}
+	default_synthetic_options(&options);
+	options.width = width;
+	options.height = height;
+	for (i = 0; i < IMAGES; i++) {
+		options.bit_count = bit_counts[i];
+		snprintf(paths[i], sizeof(paths[i]), "%s/%d.bmp", directory, bit_counts[i]);
+		if (!write_synthetic_bmp(paths[i], &options, i + 1, &truth)) {
+			printf("ERROR: writing file at %s\n", paths[i]);
+			return 1;
+		}
+	}
+
+	load_time = run(load_images, threads, &load_rss);
+	allocation_time = run(allocate_images, threads, &allocation_rss);
+	printf("%s allocator, %d thread(s), %dx%d images, %d loads of each per thread\n",
+		   allocator->name, threads, width, height, loads);
+	printf("load and free     %6.2f ms per image, peak RSS %4ld MB\n", load_time, load_rss);
+	printf("allocations only  %6.2f ms per image, peak RSS %4ld MB\n", allocation_time, allocation_rss);
+
+	for (i = 0; i < IMAGES; i++) {
+		unlink(paths[i]);
+	}
+	rmdir(directory);
+	return 0;
+}
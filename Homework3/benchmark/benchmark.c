@@ -0,0 +1,226 @@
+// Measures analyze_images_in_directory on synthetic bitmaps for every
+// combination of image size and thread count, checking every result against
+// the planted rectangle. Build from Homework3/benchmark with:
+//   gcc -O2 -o benchmark benchmark.c synthetic_bmp.c ../analyzer.c ../bmp.c ../cache.c
+//       ../metrics.c ../logger.c ../utility.c -lpthread -lm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "synthetic_bmp.h"
+
+#define MAX_CONFIGURATIONS (32)
+
+void show_usage(const char * exe);
+
+// Parses a comma separated list of positive numbers, returns how many were read or 0
+static int parse_list(const char * value, int * list) {
+	char * end;
+	int count = 0;
+
+	do {
+		if (count == MAX_CONFIGURATIONS) {
+			return 0;
+		}
+		list[count] = strtol(value, &end, 10);
+		if (end == value || list[count] < 1) {
+			return 0;
+		}
+		count++;
+		value = end + 1;
+	} while (*end == ',');
+
+	return *end == '\0' ? count : 0;
+}
+
+// Parses a comma separated list of sizes, returns how many were read or 0
+static int parse_sizes(const char * value, int * widths, int * heights) {
+	char size[64];
+	int count = 0;
+	size_t length;
+
+	while (*value != '\0') {
+		length = strcspn(value, ",");
+		if (count == MAX_CONFIGURATIONS || length >= sizeof(size)) {
+			return 0;
+		}
+		memcpy(size, value, length);
+		size[length] = '\0';
+		if (!parse_size(size, &widths[count], &heights[count])) {
+			return 0;
+		}
+		count++;
+		value += length + (value[length] == ',');
+	}
+
+	return count;
+}
+
+// Counts the results that don't match the planted rectangle of their image
+static int count_errors(const image_info * results, int count, const image_info * truths, int images) {
+	const char * name;
+	int i, index, errors = images - count;
+
+	for (i = 0; i < count; i++) {
+		name = strrchr(results[i].path, '/');
+		if (name == NULL || sscanf(name, "/img%d.bmp", &index) != 1 || index < 0 || index >= images ||
+			results[i].top_left_x != truths[index].top_left_x || results[i].top_left_y != truths[index].top_left_y ||
+			results[i].bottom_right_x != truths[index].bottom_right_x ||
+			results[i].bottom_right_y != truths[index].bottom_right_y) {
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+int main(int argc, char * argv[]) {
+	synthetic_options options;
+	int widths[MAX_CONFIGURATIONS] = { 64 }, heights[MAX_CONFIGURATIONS] = { 64 };
+	int threads[MAX_CONFIGURATIONS] = { 1, 2, 4, 8 };
+	int sizes_count = 1, threads_count = 4, images = 16;
+	const char * work_directory = "/tmp/analyzer-benchmark";
+	unsigned int seed = 1;
+	bool keep = false;
+	image_info * truths, * results;
+	int i, s, t, option, count, errors, total_errors = 0;
+	long long start, elapsed;
+	const char * problem;
+	char * directory, * path, * end;
+
+	default_synthetic_options(&options);
+	while ((option = getopt(argc, argv, SYNTHETIC_OPTIONS "d:kn:s:S:t:")) != -1) {
+		switch (option) {
+		case 'd':
+			work_directory = optarg;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'n':
+			images = strtol(optarg, &end, 10);
+			if (*end != '\0' || images < 1) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if ((sizes_count = parse_sizes(optarg, widths, heights)) == 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			seed = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if ((threads_count = parse_list(optarg, threads)) == 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			if (!parse_synthetic_option(option, optarg, &options)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (argc != optind) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (mkdir(work_directory, 0755) != 0 && errno != EEXIST) {
+		printf("ERROR: unable to create directory %s\n", work_directory);
+		return EXIT_FAILURE;
+	}
+
+	set_memory_allocator(&caching_allocator);
+	directory = safe_malloc(strlen(work_directory) + 32);
+	path = safe_malloc(strlen(work_directory) + 64);
+	truths = safe_malloc(images * sizeof(image_info));
+
+	printf("%-11s %7s %7s %9s %10s %10s %7s\n", "size", "threads", "images", "seconds", "images/s", "MPixels/s", "errors");
+	for (s = 0; s < sizes_count; s++) {
+		options.width = widths[s];
+		options.height = heights[s];
+		problem = check_synthetic_options(&options);
+		if (problem != NULL) {
+			printf("ERROR: %dx%d: %s.\n", options.width, options.height, problem);
+			return EXIT_FAILURE;
+		}
+
+		sprintf(directory, "%s/%dx%d", work_directory, options.width, options.height);
+		if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+			printf("ERROR: unable to create directory %s\n", directory);
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < images; i++) {
+			sprintf(path, "%s/img%06d.bmp", directory, i);
+			if (!write_synthetic_bmp(path, &options, seed + i, &truths[i])) {
+				printf("ERROR: unable to write %s\n", path);
+				return EXIT_FAILURE;
+			}
+		}
+
+		for (t = 0; t < threads_count; t++) {
+			start = time_us();
+			results = analyze_images_in_directory(threads[t], directory, &count);
+			elapsed = time_us() - start;
+
+			errors = count_errors(results, count, truths, images);
+			total_errors += errors;
+			printf("%5dx%-5d %7d %7d %9.3f %10.1f %10.2f %7d\n", options.width, options.height, threads[t], count,
+				   elapsed / 1e6, count * 1e6 / elapsed, (double)count * options.width * options.height / elapsed, errors);
+			fflush(stdout);
+
+			for (i = 0; i < count; i++) {
+				safe_free(results[i].path);
+			}
+			safe_free(results);
+		}
+
+		if (!keep) {
+			for (i = 0; i < images; i++) {
+				sprintf(path, "%s/img%06d.bmp", directory, i);
+				unlink(path);
+			}
+			rmdir(directory);
+		}
+	}
+
+	if (!keep) {
+		rmdir(work_directory);
+	}
+
+	safe_free(truths);
+	safe_free(path);
+	safe_free(directory);
+
+	if (total_errors > 0) {
+		printf("ERROR: %d result(s) don't match the planted rectangles.\n", total_errors);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void show_usage(const char * exe) {
+	printf("Usage: %s [-d <directory>] [-k] [-n <images>] [-s <sizes>] [-S <seed>] [-t <threads>] [options]\n", exe);
+	printf("  -d <directory>    where the images are written, /tmp/analyzer-benchmark by default\n");
+	printf("  -k                keep the images\n");
+	printf("  -n <images>       images per size, 16 by default\n");
+	printf("  -s <sizes>        comma separated <width>x<height> list, 64x64 by default\n");
+	printf("  -S <seed>         seed of the first image, 1 by default\n");
+	printf("  -t <threads>      comma separated analyzer thread counts, 1,2,4,8 by default\n");
+	show_synthetic_usage();
+}
@@ -0,0 +1,92 @@
+// Writes synthetic bitmaps with planted rectangles and their expected results.
+// Build from Homework3/benchmark with:
+//   gcc -O2 -o bmp_generator bmp_generator.c synthetic_bmp.c ../utility.c -lpthread -lm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "synthetic_bmp.h"
+
+#define TRUTH_FILE "truth.txt"
+
+void show_usage(const char * exe);
+
+int main(int argc, char * argv[]) {
+	synthetic_options options;
+	unsigned int seed = 1;
+	image_info truth;
+	int i, count, option;
+	const char * problem;
+	char * path, * end;
+	FILE * truth_stream;
+
+	default_synthetic_options(&options);
+	while ((option = getopt(argc, argv, SYNTHETIC_OPTIONS "s:S:")) != -1) {
+		switch (option) {
+		case 's':
+			if (!parse_size(optarg, &options.width, &options.height)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			seed = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			if (!parse_synthetic_option(option, optarg, &options)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (argc - optind != 2 || (count = strtol(argv[optind + 1], &end, 10)) < 1 || *end != '\0') {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	problem = check_synthetic_options(&options);
+	if (problem != NULL) {
+		printf("ERROR: %s.\n", problem);
+		return EXIT_FAILURE;
+	}
+
+	if (mkdir(argv[optind], 0755) != 0 && errno != EEXIST) {
+		printf("ERROR: unable to create directory %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	path = safe_malloc(strlen(argv[optind]) + 32);
+	sprintf(path, "%s/%s", argv[optind], TRUTH_FILE);
+	truth_stream = safe_fopen(path, "w");
+
+	// Every image gets its own seed so they all differ
+	for (i = 0; i < count; i++) {
+		sprintf(path, "%s/img%06d.bmp", argv[optind], i);
+		if (!write_synthetic_bmp(path, &options, seed + i, &truth)) {
+			printf("ERROR: unable to write %s\n", path);
+			return EXIT_FAILURE;
+		}
+		fprintf(truth_stream, "img%06d.bmp  (%d,%d)-(%d,%d)\n", i,
+				truth.top_left_x, truth.top_left_y, truth.bottom_right_x, truth.bottom_right_y);
+	}
+
+	fclose(truth_stream);
+	safe_free(path);
+	printf("%d image(s) of %dx%d written to %s, expected results in %s\n",
+		   count, options.width, options.height, argv[optind], TRUTH_FILE);
+	return EXIT_SUCCESS;
+}
+
+void show_usage(const char * exe) {
+	printf("Usage: %s [-s <width>x<height>] [-S <seed>] [options] <directory> <count>\n", exe);
+	printf("  -s <size>         image size, 64x64 by default\n");
+	printf("  -S <seed>         seed of the first image, 1 by default\n");
+	show_synthetic_usage();
+}
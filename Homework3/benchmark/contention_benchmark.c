@@ -0,0 +1,118 @@
+// Measures the cost of counting allocations from many threads: a fixed number
+// of 64 byte safe_malloc/safe_free pairs split across 1 to 64 threads, in ns
+// per pair, against the mutex protected counter safe_malloc used to update on
+// every call. Build from Homework3/benchmark with:
+//   gcc -O2 -o contention_benchmark contention_benchmark.c ../utility.c ../logger.c -lpthread
+// Usage: contention_benchmark [pairs], 4000000 by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../utility.h"
+
+#define CHUNK_SIZE (64)
+#define MAX_THREADS (64)
+
+typedef struct {
+	const char * name;
+	void * (*allocate)(size_t size);
+	void (*release)(void * chunk);
+} counting;
+
+static pthread_mutex_t chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long allocated_chunks = 0;
+static long pairs_per_thread;
+static const counting * current;
+
+// The former safe_malloc and safe_free, counting chunks under a mutex
+static void * mutex_malloc(size_t size) {
+	void * chunk = malloc(size);
+	if (chunk == NULL) {
+		printf("ERROR: memory allocation failed, exit\n");
+		exit(1);
+	}
+	pthread_mutex_lock(&chunks_mutex);
+	allocated_chunks++;
+	pthread_mutex_unlock(&chunks_mutex);
+	memset(chunk, 0, size);
+	return chunk;
+}
+
+static void mutex_free(void * chunk) {
+	if (chunk != NULL) {
+		free(chunk);
+		pthread_mutex_lock(&chunks_mutex);
+		allocated_chunks--;
+		pthread_mutex_unlock(&chunks_mutex);
+	}
+}
+
+static const counting countings[] = {
+	{ "mutex", mutex_malloc, mutex_free },
+	{ "sharded", safe_malloc, safe_free },
+};
+#define COUNTINGS (sizeof(countings) / sizeof(countings[0]))
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void * run_pairs(void * arg) {
+	long i;
+	void * chunk;
+
+	for (i = 0; i < pairs_per_thread; i++) {
+		chunk = current->allocate(CHUNK_SIZE);
+		// Keeps the pair from being optimized away
+		*(volatile char *)chunk = 1;
+		current->release(chunk);
+	}
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	pthread_t threads[MAX_THREADS];
+	long pairs = 4000000;
+	double start, elapsed;
+	int count, i;
+	uint j;
+
+	if (argc > 2 || (argc == 2 && (pairs = atol(argv[1])) < MAX_THREADS)) {
+		printf("Usage: %s [pairs], at least %d\n", argv[0], MAX_THREADS);
+		return 1;
+	}
+
+	printf("%ld pairs, ns per pair\nthreads  ", pairs);
+	for (count = 1; count <= MAX_THREADS; count *= 2) {
+		printf("%5d", count);
+	}
+	printf("\n");
+
+	for (j = 0; j < COUNTINGS; j++) {
+		current = &countings[j];
+		printf("%-9s", current->name);
+		for (count = 1; count <= MAX_THREADS; count *= 2) {
+			pairs_per_thread = pairs / count;
+			start = now();
+			for (i = 0; i < count; i++) {
+				safe_pthread_create(&threads[i], NULL, run_pairs, NULL);
+			}
+			for (i = 0; i < count; i++) {
+				pthread_join(threads[i], NULL);
+			}
+			elapsed = now() - start;
+			printf("%5.0f", elapsed * 1e9 / (pairs_per_thread * count));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	if (allocated_chunks != 0 || get_memory_stats().chunks != 0) {
+		printf("ERROR: %ld and %ld chunks leaked\n", allocated_chunks, get_memory_stats().chunks);
+		return 1;
+	}
+	return 0;
+}
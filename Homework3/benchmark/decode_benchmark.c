@@ -0,0 +1,280 @@
+// Measures load_bmp on the same picture written in every supported format,
+// in MPixel/s including the pixel buffer allocation, and checks every decoded
+// pixel. Then checks that crafted headers are rejected instead of allocated. Build from Homework3/benchmark with:
+//   gcc -O2 -o decode_benchmark decode_benchmark.c ../bmp.c ../logger.c ../utility.c -lpthread
+// Usage: decode_benchmark [<width>x<height>] [loads], 2048x2048 and 5 loads by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../bmp.h"
+
+#define FILE_HEADER_SIZE (14)
+#define INFO_HEADER_SIZE (40)
+#define MAX_COLORS (16)
+// Pixels of a run before the color changes, so RLE streams have runs to encode
+#define RUN (7)
+
+typedef struct {
+	const char * name;
+	int bit_count;
+	int compression;
+	bool top_down;
+} format;
+
+static const format formats[] = {
+	{ "24-bit", 24, BI_RGB, false },
+	{ "24-bit top-down", 24, BI_RGB, true },
+	{ "32-bit", 32, BI_RGB, false },
+	{ "32-bit masks", 32, BI_BITFIELDS, false },
+	{ "8-bit palette", 8, BI_RGB, false },
+	{ "4-bit palette", 4, BI_RGB, false },
+	{ "1-bit palette", 1, BI_RGB, false },
+	{ "RLE8", 8, BI_RLE8, false },
+	{ "RLE4", 4, BI_RLE4, false },
+};
+#define FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+typedef struct {
+	const char * name;
+	int bit_count;
+	uint width;
+	uint height;
+} crafted_header;
+
+// Headers load_bmp must reject without reading any pixel
+static const crafted_header crafted_headers[] = {
+	{ "zero width", 24, 0, 16 },
+	{ "negative width", 24, (uint)-16, 16 },
+	{ "smallest height", 24, 16, 0x80000000 },
+	{ "2 GiB of pixels", 32, 1 << 15, 1 << 14 },
+	// Pixels fit in 1 GiB, but not with the row buffer
+	{ "1 GiB row", 32, 1 << 28, 1 },
+};
+#define CRAFTED_HEADERS (sizeof(crafted_headers) / sizeof(crafted_headers[0]))
+
+// 10 bits per channel, so the decoder has to shift every mask. Stored red,
+// green, blue as in the file.
+static const uint masks[3] = { 0x3FF00000, 0x000FFC00, 0x000003FF };
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Colors of the picture, 0BGR like the analyzer's pixels
+static pixel color(int index) {
+	return ((pixel)(index * 15) << 16) | ((pixel)(255 - index * 13) << 8) | (pixel)(index * 37 % 256);
+}
+
+// Palette index of a pixel: runs of RUN pixels shifted on every row
+static int color_index(int x, int y, int colors) {
+	return (x / RUN + y * 3) % colors;
+}
+
+static int colors_of(const format * format) {
+	return format->bit_count < 8 ? 1 << format->bit_count : MAX_COLORS;
+}
+
+// Writes the row-th row of the file, as stored, to stream. Returns false on errors.
+static bool write_row(FILE * stream, const format * format, int width, int y, byte * row, size_t row_size) {
+	int colors = colors_of(format), x, index, run;
+	size_t length = 0;
+	uint value;
+	pixel p;
+
+	if (format->compression == BI_RLE8 || format->compression == BI_RLE4) {
+		// Encoded runs only, then an end of line
+		for (x = 0; x < width; x += run) {
+			index = color_index(x, y, colors);
+			for (run = 1; x + run < width && run < 255 && color_index(x + run, y, colors) == index; run++);
+			row[length++] = run;
+			row[length++] = format->compression == BI_RLE4 ? index << 4 | index : index;
+		}
+		row[length++] = 0;
+		row[length++] = 0;
+		return fwrite(row, length, 1, stream) == 1;
+	}
+
+	memset(row, 0, row_size);
+	for (x = 0; x < width; x++) {
+		index = color_index(x, y, colors);
+		p = color(index);
+		switch (format->bit_count) {
+		case 1:
+		case 4:
+		case 8:
+			row[x * format->bit_count / 8] |= index << (8 - format->bit_count - x * format->bit_count % 8);
+			break;
+		case 24:
+			row[3 * x] = p >> 16;
+			row[3 * x + 1] = p >> 8;
+			row[3 * x + 2] = p;
+			break;
+		case 32:
+			if (format->compression == BI_BITFIELDS) {
+				value = (uint)(p & 0xFF) << 22 | (uint)(p >> 8 & 0xFF) << 12 | (uint)(p >> 16 & 0xFF) << 2;
+			} else {
+				value = (uint)(p >> 16 & 0xFF) | (uint)(p >> 8 & 0xFF) << 8 | (uint)(p & 0xFF) << 16;
+			}
+			memcpy(&row[4 * x], &value, sizeof(value));
+			break;
+		}
+	}
+	return fwrite(row, row_size, 1, stream) == 1;
+}
+
+// Writes the picture in format to path, returns false on errors
+static bool write_bmp(const char * path, const format * format, int width, int height) {
+	FILE * stream = fopen(path, "wb");
+	size_t row_size = (((size_t)format->bit_count * width + 31) / 32) * 4;
+	byte * row = malloc(row_size > (size_t)width * 2 + 2 ? row_size : (size_t)width * 2 + 2);
+	int palette_colors = format->bit_count <= 8 ? colors_of(format) : 0, i, y;
+	byte entry[4] = { 0 };
+	bmp_header header;
+	bool written;
+	pixel p;
+
+	memset(&header, 0, sizeof(header));
+	header.type = 0x4D42;
+	header.header_size = INFO_HEADER_SIZE;
+	header.pixels_address = FILE_HEADER_SIZE + INFO_HEADER_SIZE + 4 * palette_colors +
+		(format->compression == BI_BITFIELDS ? sizeof(masks) : 0);
+	header.width = width;
+	header.height = format->top_down ? (uint)-height : (uint)height;
+	header.planes = 1;
+	header.bit_count = format->bit_count;
+	header.compression = format->compression;
+	header.colors = palette_colors;
+
+	written = stream != NULL && row != NULL && fwrite(&header, sizeof(header), 1, stream) == 1;
+	if (written && format->compression == BI_BITFIELDS) {
+		written = fwrite(masks, sizeof(masks), 1, stream) == 1;
+	}
+	for (i = 0; written && i < palette_colors; i++) {
+		p = color(i);
+		entry[0] = p >> 16;
+		entry[1] = p >> 8;
+		entry[2] = p;
+		written = fwrite(entry, sizeof(entry), 1, stream) == 1;
+	}
+	// Rows are stored bottom-up unless the image is top-down
+	for (i = 0; written && i < height; i++) {
+		y = format->top_down ? i : height - 1 - i;
+		written = write_row(stream, format, width, y, row, row_size);
+	}
+	if (written && (format->compression == BI_RLE8 || format->compression == BI_RLE4)) {
+		// End of bitmap
+		entry[0] = 0;
+		entry[1] = 1;
+		written = fwrite(entry, 2, 1, stream) == 1;
+	}
+
+	free(row);
+	return stream != NULL && fclose(stream) == 0 && written;
+}
+
+// Writes only the header of crafted to path, returns false on errors
+static bool write_crafted_header(const char * path, const crafted_header * crafted) {
+	FILE * stream = fopen(path, "wb");
+	bmp_header header;
+	bool written;
+
+	memset(&header, 0, sizeof(header));
+	header.type = 0x4D42;
+	header.header_size = INFO_HEADER_SIZE;
+	header.pixels_address = FILE_HEADER_SIZE + INFO_HEADER_SIZE;
+	header.width = crafted->width;
+	header.height = crafted->height;
+	header.planes = 1;
+	header.bit_count = crafted->bit_count;
+	header.compression = BI_RGB;
+
+	written = stream != NULL && fwrite(&header, sizeof(header), 1, stream) == 1;
+	return stream != NULL && fclose(stream) == 0 && written;
+}
+
+// Returns how many pixels of image differ from the picture
+static long count_errors(const bmp * image, const format * format, int width, int height) {
+	int colors = colors_of(format), x, y;
+	pixel expected;
+	long errors = 0;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			// The 10 bits mask channels scale back to the 8 bits written
+			expected = color(color_index(x, y, colors));
+			errors += image->pixels[(size_t)y * width + x] != expected;
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char * argv[]) {
+	char directory[] = "/tmp/decode_benchmarkXXXXXX", path[sizeof(directory) + 16];
+	int width = 2048, height = 2048, loads = 5, i, j;
+	double start, elapsed;
+	long errors, total_errors = 0;
+	bool rejected;
+	bmp image;
+
+	if (argc > 3 || (argc > 1 && (sscanf(argv[1], "%dx%d", &width, &height) != 2 || width < 1 || height < 1)) ||
+		(argc > 2 && (loads = atoi(argv[2])) < 1)) {
+		printf("Usage: %s [<width>x<height>] [loads]\n", argv[0]);
+		return 1;
+	}
+	if (mkdtemp(directory) == NULL) {
+		printf("ERROR: creating a directory at %s\n", directory);
+		return 1;
+	}
+
+	printf("%dx%d pixels, mean of %d loads\n", width, height, loads);
+	for (i = 0; i < (int)FORMATS; i++) {
+		snprintf(path, sizeof(path), "%s/%d.bmp", directory, i);
+		if (!write_bmp(path, &formats[i], width, height)) {
+			printf("ERROR: writing file at %s\n", path);
+			return 1;
+		}
+
+		elapsed = 0;
+		errors = 0;
+		for (j = 0; j < loads; j++) {
+			start = now();
+			if (!load_bmp(path, &image)) {
+				printf("ERROR: loading file at %s\n", path);
+				return 1;
+			}
+			elapsed += now() - start;
+			// Checked after the timing, once is enough
+			if (j == 0) {
+				errors = count_errors(&image, &formats[i], width, height);
+			}
+			free_bmp(&image);
+		}
+
+		printf("%-16s %7.1f MPixel/s   %ld wrong pixels\n", formats[i].name,
+			   (double)width * height * loads / elapsed / 1e6, errors);
+		total_errors += errors;
+		unlink(path);
+	}
+
+	for (i = 0; i < (int)CRAFTED_HEADERS; i++) {
+		snprintf(path, sizeof(path), "%s/crafted%d.bmp", directory, i);
+		if (!write_crafted_header(path, &crafted_headers[i])) {
+			printf("ERROR: writing file at %s\n", path);
+			return 1;
+		}
+		rejected = !load_bmp(path, &image);
+		if (!rejected) {
+			free_bmp(&image);
+		}
+		printf("%-16s %s\n", crafted_headers[i].name, rejected ? "rejected" : "NOT rejected");
+		total_errors += !rejected;
+		unlink(path);
+	}
+
+	rmdir(directory);
+	return total_errors > 0;
+}
@@ -0,0 +1,153 @@
+// Measures the logger: messages per second with 1 and 4 threads logging as
+// fast as they can, and the latency of a call at a rate the writer keeps up
+// with, against the former logger that took a mutex and opened log.txt for
+// every message. Runs in a temporary directory, which is removed afterwards.
+// Build from Homework3/benchmark with:
+//   gcc -O2 -o logger_benchmark logger_benchmark.c ../logger.c ../utility.c -lpthread
+// Usage: logger_benchmark [messages per thread], 50000 by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "../utility.h"
+
+#define MAX_THREADS (4)
+#define OLD_LOG_FILE "old_log.txt"
+#define OLD_LOG_LINE (512)
+// Pause between calls of the latency runs, 20000 messages/s
+#define LATENCY_PAUSE_NS (50000)
+#define LATENCY_SAMPLES (20000)
+
+typedef struct {
+	const char * name;
+	void (*log)(const char * func, int value);
+} logger;
+
+static pthread_mutex_t old_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const logger * current;
+static int messages;
+static double latencies[LATENCY_SAMPLES];
+
+// The former write_log1: format on the stack, then append under a mutex
+static void old_write_log(const char * func, const char * format, ...) {
+	char message[OLD_LOG_LINE], line[2 * OLD_LOG_LINE];
+	va_list format_args;
+	FILE * stream;
+
+	va_start(format_args, format);
+	vsnprintf(message, sizeof(message), format, format_args);
+	va_end(format_args);
+	snprintf(line, sizeof(line), "[%s] %s\n", func, message);
+
+	pthread_mutex_lock(&old_log_mutex);
+	stream = safe_fopen(OLD_LOG_FILE, "a");
+	fputs(line, stream);
+	fclose(stream);
+	pthread_mutex_unlock(&old_log_mutex);
+}
+
+static void log_old(const char * func, int value) {
+	old_write_log(func, "image %d loaded, %d pixels", value, value * 64);
+}
+
+static void log_new(const char * func, int value) {
+	write_log(LOG_LEVEL_DEBUG, func, "image %d loaded, %d pixels", value, value * 64);
+}
+
+static const logger loggers[] = {
+	{ "old", log_old },
+	{ "new", log_new },
+};
+#define LOGGERS (sizeof(loggers) / sizeof(loggers[0]))
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void * log_messages(void * arg) {
+	int i;
+
+	for (i = 0; i < messages; i++) {
+		current->log(__FUNCTION__, i);
+	}
+	return NULL;
+}
+
+static int compare_latencies(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Logs messages as fast as possible from threads threads, prints messages/s
+static void run_throughput(int threads) {
+	pthread_t ids[MAX_THREADS];
+	long long dropped = get_log_stats().dropped;
+	double start, elapsed;
+	int i;
+
+	start = now();
+	for (i = 0; i < threads; i++) {
+		safe_pthread_create(&ids[i], NULL, log_messages, NULL);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	elapsed = now() - start;
+	printf("%s, %d thread(s): %8.0f msgs/s", current->name, threads, (double)messages * threads / elapsed);
+	if (current->log == log_new) {
+		printf(", %lld dropped", get_log_stats().dropped - dropped);
+	}
+	printf("\n");
+}
+
+// Logs one message every LATENCY_PAUSE_NS, prints the median and 99th
+// percentile time spent in the call
+static void run_latency() {
+	struct timespec pause = { 0, LATENCY_PAUSE_NS };
+	double start;
+	int i;
+
+	for (i = 0; i < LATENCY_SAMPLES; i++) {
+		start = now();
+		current->log(__FUNCTION__, i);
+		latencies[i] = now() - start;
+		nanosleep(&pause, NULL);
+	}
+	qsort(latencies, LATENCY_SAMPLES, sizeof(double), compare_latencies);
+	printf("%s, latency: median %.2f us, p99 %.2f us\n", current->name,
+		   latencies[LATENCY_SAMPLES / 2] * 1e6, latencies[LATENCY_SAMPLES * 99 / 100] * 1e6);
+}
+
+int main(int argc, char * argv[]) {
+	char directory[] = "/tmp/logger_benchmarkXXXXXX";
+	uint i;
+
+	messages = argc > 1 ? atoi(argv[1]) : 50000;
+	if (argc > 2 || messages < 1) {
+		printf("Usage: %s [messages per thread]\n", argv[0]);
+		return 1;
+	}
+	if (mkdtemp(directory) == NULL || chdir(directory) != 0) {
+		printf("ERROR: creating a directory at %s\n", directory);
+		return 1;
+	}
+
+	for (i = 0; i < LOGGERS; i++) {
+		current = &loggers[i];
+		run_throughput(1);
+		run_throughput(MAX_THREADS);
+		run_latency();
+	}
+	// Stops the writer so log.txt is complete before it's removed
+	flush_log();
+
+	unlink(LOG_FILE);
+	unlink(OLD_LOG_FILE);
+	rmdir(directory);
+	return 0;
+}
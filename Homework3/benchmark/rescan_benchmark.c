@@ -0,0 +1,165 @@
+// Measures rescanning a cached image after an edit: a full get_max_rectangle
+// against analyze_bmp_incremental given the tile summary of the image before
+// the edit, for a square patch and for scattered pixels, on synthetic images
+// with a noisy background and on images of large uniform regions. Every
+// incremental result is checked against the full scan. Build from
+// Homework3/benchmark with:
+//   gcc -O2 -o rescan_benchmark rescan_benchmark.c synthetic_bmp.c ../analyzer.c ../bmp.c
+//       ../cache.c ../metrics.c ../logger.c ../utility.c -lpthread -lm
+// Usage: rescan_benchmark [-i images] [-p changed %] [-n repeats] [-S <width>x<height>]
+// 8 images of each kind, 1% of the pixels changed, best of 7 runs and
+// 2048x2048 by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "synthetic_bmp.h"
+#include "../bmp.h"
+
+// Color of the edited pixels, not one the generator uses for neighbors
+#define EDIT_COLOR (0x123456)
+
+typedef enum {
+	PATCH_EDIT,
+	SCATTERED_EDIT
+} edit_kind;
+
+static const char * edit_names[] = { "one square patch", "scattered pixels" };
+static const char * layout_names[] = { "noisy background", "uniform regions" };
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Changes share of the pixels of image, seeded by seed
+static void edit_image(bmp * image, edit_kind kind, double share, unsigned int seed) {
+	int width = image->header.width, height = image->header.height, side, x, y, i, count;
+
+	srand(seed);
+	if (kind == PATCH_EDIT) {
+		side = (int)(sqrt(share * width * height) + 0.5);
+		side = side < 1 ? 1 : side > width ? width : side > height ? height : side;
+		x = rand() % (width - side + 1);
+		y = rand() % (height - side + 1);
+		for (i = 0; i < side * side; i++) {
+			image->pixels[(size_t)(y + i / side) * width + x + i % side] = EDIT_COLOR;
+		}
+	} else {
+		count = (int)(share * width * height + 0.5);
+		for (i = 0; i < count; i++) {
+			image->pixels[((size_t)rand() * RAND_MAX + rand()) % ((size_t)width * height)] = EDIT_COLOR;
+		}
+	}
+}
+
+static bool same_rectangle(const image_info * a, const image_info * b) {
+	return a->top_left_x == b->top_left_x && a->top_left_y == b->top_left_y &&
+		   a->bottom_right_x == b->bottom_right_x && a->bottom_right_y == b->bottom_right_y;
+}
+
+int main(int argc, char * argv[]) {
+	char directory[] = "/tmp/rescan_benchmarkXXXXXX", path[sizeof(directory) + 16];
+	int images = 8, repeats = 7, option, layout, kind, i, j, mismatches;
+	double share = 0.01, start, elapsed, best_full, best_incremental, full_time, incremental_time;
+	long long rows_scanned, rows;
+	tile_summary * before, * after;
+	image_info truth, full, incremental;
+	synthetic_options options;
+	bmp original, edited;
+
+	default_synthetic_options(&options);
+	options.width = options.height = 2048;
+	while ((option = getopt(argc, argv, "i:p:n:S:")) != -1) {
+		switch (option) {
+		case 'i':
+			images = atoi(optarg);
+			break;
+		case 'p':
+			share = atof(optarg) / 100;
+			break;
+		case 'n':
+			repeats = atoi(optarg);
+			break;
+		case 'S':
+			if (!parse_size(optarg, &options.width, &options.height)) {
+				images = 0;
+			}
+			break;
+		default:
+			images = 0;
+			break;
+		}
+	}
+	if (optind != argc || images < 1 || repeats < 1 || share <= 0 || share > 1) {
+		printf("Usage: %s [-i images] [-p changed %%] [-n repeats] [-S <width>x<height>]\n", argv[0]);
+		return 1;
+	}
+	if (mkdtemp(directory) == NULL) {
+		printf("ERROR: creating a directory at %s\n", directory);
+		return 1;
+	}
+
+	printf("%dx%d, %g%% of the pixels changed, best of %d runs per image\n",
+		   options.width, options.height, share * 100, repeats);
+	for (layout = RANDOM_LAYOUT; layout <= GRID_LAYOUT; layout++) {
+		options.layout = layout;
+		// The grid fills most of the image with uniform rectangles
+		options.rectangles = layout == GRID_LAYOUT ? 16 : 4;
+		for (kind = PATCH_EDIT; kind <= SCATTERED_EDIT; kind++) {
+			full_time = incremental_time = 0;
+			rows_scanned = rows = 0;
+			mismatches = 0;
+			for (i = 0; i < images; i++) {
+				snprintf(path, sizeof(path), "%s/%d.bmp", directory, i);
+				if (!write_synthetic_bmp(path, &options, i + 1, &truth) || !load_bmp(path, &original)) {
+					printf("ERROR: writing file at %s\n", path);
+					return 1;
+				}
+				unlink(path);
+
+				// The cached version of the image, before the edit
+				analyze_bmp_incremental(&original, NULL, &before);
+				edited = original;
+				edited.pixels = safe_malloc_uninitialized((size_t)options.width * options.height * sizeof(pixel));
+				memcpy(edited.pixels, original.pixels, (size_t)options.width * options.height * sizeof(pixel));
+				edit_image(&edited, kind, share, i + 1);
+
+				best_full = best_incremental = HUGE_VAL;
+				for (j = 0; j < repeats; j++) {
+					start = now();
+					full = get_max_rectangle(&edited);
+					elapsed = now() - start;
+					best_full = elapsed < best_full ? elapsed : best_full;
+
+					start = now();
+					incremental = analyze_bmp_incremental(&edited, before, &after);
+					elapsed = now() - start;
+					best_incremental = elapsed < best_incremental ? elapsed : best_incremental;
+					if (j < repeats - 1) {
+						free_tile_summary(after);
+					}
+				}
+				full_time += best_full;
+				incremental_time += best_incremental;
+				rows_scanned += after->rows_scanned;
+				rows += options.height;
+				mismatches += !same_rectangle(&full, &incremental);
+
+				free_tile_summary(after);
+				free_tile_summary(before);
+				safe_free(edited.pixels);
+				free_bmp(&original);
+			}
+			printf("%-16s %-16s full %8.1f ms  incremental %8.1f ms  %5.2fx  %5.1f%% of rows scanned  %d mismatches\n",
+				   layout_names[layout], edit_names[kind], full_time * 1e3, incremental_time * 1e3,
+				   full_time / incremental_time, 100.0 * rows_scanned / rows, mismatches);
+		}
+	}
+
+	rmdir(directory);
+	return 0;
+}
@@ -0,0 +1,121 @@
+// Measures the recursive directory scan on a large tree of files, with image
+// loading stubbed out so only listing, queueing and handing the paths to the
+// analyzers are timed. Build from Homework3/benchmark with:
+//   gcc -O2 -o scan_benchmark scan_benchmark.c ../analyzer.c ../cache.c ../metrics.c
+//       ../logger.c ../utility.c -lpthread -lm
+// Usage: scan_benchmark [-f files] [-d directories] [-t analyzer threads] <tree>
+// The tree, 1000000 empty .bmp files spread over 1000 directories by default,
+// is created when it doesn't exist and kept for the next runs. For cold cache
+// numbers drop the page cache between runs, as root:
+//   sync; echo 3 > /proc/sys/vm/drop_caches
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../analyzer.h"
+#include "../bmp.h"
+
+static const int scan_threads[] = { 1, 2, 4, 8 };
+#define SCAN_THREAD_COUNTS (sizeof(scan_threads) / sizeof(scan_threads[0]))
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Stands in for the decoder: every file is a single pixel image, so the
+// analyzers only pay for taking the path off the queue
+bool load_bmp(const char * file, bmp * image) {
+	memset(image, 0, sizeof(*image));
+	image->path = safe_strdup(file);
+	image->pixels = safe_malloc(sizeof(pixel));
+	image->header.width = 1;
+	image->header.height = 1;
+	return true;
+}
+
+void free_bmp(bmp * image) {
+	safe_free(image->path);
+	safe_free(image->pixels);
+}
+
+static void count_result(const image_info * result, void * context) {
+	(*(int *)context)++;
+}
+
+// Creates files empty .bmp files spread over directories subdirectories of tree
+static void create_tree(const char * tree, int files, int directories) {
+	char path[PATH_MAX];
+	int i, fd;
+
+	if (mkdir(tree, 0755) != 0) {
+		printf("ERROR: creating directory %s: %s\n", tree, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < directories; i++) {
+		snprintf(path, sizeof(path), "%s/%d", tree, i);
+		if (mkdir(path, 0755) != 0) {
+			printf("ERROR: creating directory %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/%d/%d.bmp", tree, i % directories, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+			printf("ERROR: creating file %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+	}
+}
+
+int main(int argc, char * argv[]) {
+	int files = 1000000, directories = 1000, analyzers = 4, option, found;
+	double start, elapsed;
+	struct stat info;
+	uint i;
+
+	while ((option = getopt(argc, argv, "f:d:t:")) != -1) {
+		switch (option) {
+		case 'f':
+			files = atoi(optarg);
+			break;
+		case 'd':
+			directories = atoi(optarg);
+			break;
+		case 't':
+			analyzers = atoi(optarg);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1 || files < 1 || directories < 1 || analyzers < 1) {
+		printf("Usage: %s [-f files] [-d directories] [-t analyzer threads] <tree>\n", argv[0]);
+		return 1;
+	}
+
+	if (stat(argv[optind], &info) != 0) {
+		printf("Creating %d files in %d directories under %s\n", files, directories, argv[optind]);
+		create_tree(argv[optind], files, directories);
+	}
+
+	recursive_scan = true;
+	printf("scan threads   seconds   files/s      files\n");
+	for (i = 0; i < SCAN_THREAD_COUNTS; i++) {
+		scan_thread_limit = scan_threads[i];
+		found = 0;
+		start = now();
+		analyze_images_streaming(analyzers, argv[optind], false, count_result, &found);
+		elapsed = now() - start;
+		printf("%-14d %7.2f   %9.0f   %d\n", scan_thread_limit, elapsed, found / elapsed, found);
+	}
+	return 0;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "synthetic_bmp.h"
+#include "../bmp.h"
+
+#define FILE_HEADER_SIZE (14)
+#define INFO_HEADER_SIZE (40)
+#define PIXELS_PER_METER (2835)
+#define MAX_PALETTE_COLORS (256)
+#define PLACEMENT_ATTEMPTS (64)
+// Odd multiplier, spreads color indexes over distinct 24 bit colors
+#define COLOR_SPREAD (0x9E3779B1u)
+
+typedef struct {
+	int x, y, width, height;
+} rectangle;
+
+// xorshift32, deterministic for a given seed
+static unsigned int next_random(unsigned int * state) {
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static double random_fraction(unsigned int * state) {
+	return (next_random(state) >> 8) / (double)(1 << 24);
+}
+
+// Distinct 0BGR color for every index
+static pixel index_color(int index) {
+	return (index * COLOR_SPREAD) & 0xFFFFFF;
+}
+
+static bool overlaps(const rectangle * a, const rectangle * b) {
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		   a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+// Picks width and height close to area with a random aspect ratio that fit the image
+static rectangle random_shape(const synthetic_options * options, double area, unsigned int * state) {
+	rectangle shape;
+	double aspect = 0.5 + 1.5 * random_fraction(state);
+
+	shape.width = (int)(sqrt(area * aspect) + 0.5);
+	shape.width = shape.width < 1 ? 1 : shape.width > options->width ? options->width : shape.width;
+	shape.height = (int)(area / shape.width + 0.5);
+	shape.height = shape.height < 1 ? 1 : shape.height > options->height ? options->height : shape.height;
+	return shape;
+}
+
+// Places the rectangles, the first strictly larger than the others. Returns
+// the number of rectangles placed, rectangles that don't fit are left out.
+static int plant_rectangles(const synthetic_options * options, rectangle * planted, unsigned int * state) {
+	int i, j, attempt, count = 1, grid, cell_width, cell_height, largest;
+	rectangle candidate;
+
+	if (options->layout == GRID_LAYOUT) {
+		grid = (int)ceil(sqrt(options->rectangles));
+		cell_width = options->width / grid;
+		cell_height = options->height / grid;
+		largest = cell_width * cell_height;
+		for (i = 0; i < options->rectangles; i++) {
+			// Shrink every following rectangle a bit more inside its cell
+			candidate.width = cell_width * (options->rectangles - i) / options->rectangles;
+			candidate.height = cell_height;
+			if (candidate.width < 1) {
+				candidate.width = 1;
+			}
+			while (i > 0 && candidate.width * candidate.height >= largest && candidate.height > 1) {
+				candidate.height--;
+			}
+			if (i > 0 && candidate.width * candidate.height >= largest) {
+				break;
+			}
+			candidate.x = (i % grid) * cell_width;
+			candidate.y = (i / grid) * cell_height;
+			planted[i] = candidate;
+		}
+		return i;
+	}
+
+	planted[0] = random_shape(options, options->coverage * options->width * options->height, state);
+	if (planted[0].width * planted[0].height < 2) {
+		// A single pixel would tie with the background
+		planted[0].width = options->width >= 2 ? 2 : 1;
+		planted[0].height = options->width >= 2 ? 1 : 2;
+	}
+	planted[0].x = next_random(state) % (options->width - planted[0].width + 1);
+	planted[0].y = next_random(state) % (options->height - planted[0].height + 1);
+	largest = planted[0].width * planted[0].height;
+
+	for (i = 1; i < options->rectangles; i++) {
+		candidate = random_shape(options, largest * (0.2 + 0.6 * random_fraction(state)), state);
+		while (candidate.width * candidate.height >= largest) {
+			if (candidate.width > 1) {
+				candidate.width--;
+			} else {
+				candidate.height--;
+			}
+		}
+
+		for (attempt = 0; attempt < PLACEMENT_ATTEMPTS; attempt++) {
+			candidate.x = next_random(state) % (options->width - candidate.width + 1);
+			candidate.y = next_random(state) % (options->height - candidate.height + 1);
+			for (j = 0; j < count && !overlaps(&candidate, &planted[j]); j++);
+			if (j == count) {
+				planted[count++] = candidate;
+				break;
+			}
+		}
+	}
+
+	return count;
+}
+
+void default_synthetic_options(synthetic_options * options) {
+	options->width = 64;
+	options->height = 64;
+	options->colors = 16;
+	options->rectangles = 4;
+	options->coverage = 0.25;
+	options->layout = RANDOM_LAYOUT;
+	options->bit_count = 24;
+}
+
+bool parse_synthetic_option(int option, const char * value, synthetic_options * options) {
+	char * end;
+
+	switch (option) {
+	case 'b':
+		options->bit_count = strtol(value, &end, 10);
+		return *end == '\0';
+	case 'c':
+		options->colors = strtol(value, &end, 10);
+		return *end == '\0';
+	case 'f':
+		options->coverage = strtod(value, &end);
+		return *end == '\0';
+	case 'l':
+		if (strcmp(value, "random") == 0) {
+			options->layout = RANDOM_LAYOUT;
+		} else if (strcmp(value, "grid") == 0) {
+			options->layout = GRID_LAYOUT;
+		} else {
+			return false;
+		}
+		return true;
+	case 'r':
+		options->rectangles = strtol(value, &end, 10);
+		return *end == '\0';
+	}
+
+	return false;
+}
+
+bool parse_size(const char * value, int * width, int * height) {
+	char * end;
+
+	*width = strtol(value, &end, 10);
+	if (*end != 'x') {
+		return false;
+	}
+	*height = strtol(end + 1, &end, 10);
+	return *end == '\0' && *width > 0 && *height > 0;
+}
+
+void show_synthetic_usage() {
+	printf("  -b <bits>         8 (palette) or 24 bits per pixel, 24 by default\n");
+	printf("  -c <colors>       background colors, at least 3, 16 by default\n");
+	printf("  -f <coverage>     share of the image covered by the largest rectangle\n");
+	printf("                    in the random layout, 0.25 by default\n");
+	printf("  -l <layout>       random (default) or grid\n");
+	printf("  -r <rectangles>   planted rectangles, 4 by default\n");
+}
+
+const char * check_synthetic_options(const synthetic_options * options) {
+	int grid;
+
+	if (options->width < 1 || options->height < 1 || options->width * options->height < 2) {
+		return "the image needs at least 2 pixels";
+	}
+	if (options->colors < 3) {
+		return "at least 3 background colors are needed";
+	}
+	if (options->rectangles < 1) {
+		return "at least 1 rectangle is needed";
+	}
+	if (options->bit_count != 8 && options->bit_count != 24) {
+		return "the bit count must be 8 or 24";
+	}
+	if (options->bit_count == 8 && options->colors + options->rectangles > MAX_PALETTE_COLORS) {
+		return "8 bit images have at most 256 colors and rectangles together";
+	}
+	if (options->layout == RANDOM_LAYOUT && (options->coverage <= 0 || options->coverage > 1)) {
+		return "the coverage must be in (0, 1]";
+	}
+	grid = (int)ceil(sqrt(options->rectangles));
+	if (options->layout == GRID_LAYOUT && (options->width / grid) * (options->height / grid) < 2) {
+		return "the grid cells are too small for that many rectangles";
+	}
+
+	return NULL;
+}
+
+bool write_synthetic_bmp(const char * path, const synthetic_options * options, unsigned int seed, image_info * truth) {
+	int width = options->width, height = options->height;
+	int row_size = ((options->bit_count * width + 31) / 32) * 4;
+	int palette_size = options->bit_count == 8 ? (options->colors + options->rectangles) * 4 : 0;
+	int * indexes = safe_malloc(width * height * sizeof(int));
+	rectangle * planted = safe_malloc(options->rectangles * sizeof(rectangle));
+	byte * row = safe_malloc(row_size);
+	unsigned int state = seed == 0 ? 1 : seed;
+	bmp_header header;
+	byte entry[4];
+	int i, x, y, count, index;
+	pixel color;
+	FILE * stream;
+	bool written;
+
+	// Background, every pixel differs from its left and top neighbors
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			do {
+				index = next_random(&state) % options->colors;
+			} while ((x > 0 && indexes[y * width + x - 1] == index) ||
+					 (y > 0 && indexes[(y - 1) * width + x] == index));
+			indexes[y * width + x] = index;
+		}
+	}
+
+	count = plant_rectangles(options, planted, &state);
+	for (i = 0; i < count; i++) {
+		for (y = planted[i].y; y < planted[i].y + planted[i].height; y++) {
+			for (x = planted[i].x; x < planted[i].x + planted[i].width; x++) {
+				indexes[y * width + x] = options->colors + i;
+			}
+		}
+	}
+
+	truth->path = NULL;
+	truth->top_left_x = planted[0].x;
+	truth->top_left_y = planted[0].y;
+	truth->bottom_right_x = planted[0].x + planted[0].width - 1;
+	truth->bottom_right_y = planted[0].y + planted[0].height - 1;
+
+	memset(&header, 0, sizeof(header));
+	header.type = 0x4D42;
+	header.pixels_address = FILE_HEADER_SIZE + INFO_HEADER_SIZE + palette_size;
+	header.size = header.pixels_address + row_size * height;
+	header.header_size = INFO_HEADER_SIZE;
+	header.width = width;
+	header.height = height;
+	header.planes = 1;
+	header.bit_count = options->bit_count;
+	header.compression = BI_RGB;
+	header.image_size = row_size * height;
+	header.x_pixels_per_meter = PIXELS_PER_METER;
+	header.y_pixels_per_meter = PIXELS_PER_METER;
+	header.colors = palette_size / 4;
+
+	stream = fopen(path, "wb");
+	written = stream != NULL && fwrite(&header, sizeof(header), 1, stream) == 1;
+	for (i = 0; written && i < palette_size / 4; i++) {
+		// Palette entries are BGR0 quads, the pixel layout is 0BGR
+		color = index_color(i);
+		entry[0] = color >> 16;
+		entry[1] = color >> 8;
+		entry[2] = color;
+		entry[3] = 0;
+		written = fwrite(entry, sizeof(entry), 1, stream) == 1;
+	}
+
+	// Rows are stored bottom-up
+	memset(row, 0, row_size);
+	for (y = height - 1; written && y >= 0; y--) {
+		for (x = 0; x < width; x++) {
+			index = indexes[y * width + x];
+			if (options->bit_count == 8) {
+				row[x] = index;
+			} else {
+				color = index_color(index);
+				row[3 * x] = color >> 16;
+				row[3 * x + 1] = color >> 8;
+				row[3 * x + 2] = color;
+			}
+		}
+		written = fwrite(row, row_size, 1, stream) == 1;
+	}
+
+	if (stream != NULL && fclose(stream) != 0) {
+		written = false;
+	}
+
+	safe_free(row);
+	safe_free(planted);
+	safe_free(indexes);
+	return written;
+}
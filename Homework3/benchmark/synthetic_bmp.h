@@ -0,0 +1,54 @@
+#ifndef _SYNTHETIC_BMP_H_
+#define _SYNTHETIC_BMP_H_
+
+#include "../analyzer.h"
+
+typedef enum {
+	// Rectangles at random positions, the first covers a given share of the image
+	RANDOM_LAYOUT,
+	// One rectangle per cell of a square grid, each smaller than the previous
+	GRID_LAYOUT
+} synthetic_layout;
+
+// Description of the bitmaps written by write_synthetic_bmp
+typedef struct {
+	int width;
+	int height;
+	// Background colors, at least 3 so neighboring pixels always differ
+	int colors;
+	// Planted rectangles, each with its own color, at least 1
+	int rectangles;
+	// Share of the image covered by the largest rectangle in RANDOM_LAYOUT
+	double coverage;
+	synthetic_layout layout;
+	// 8 (palette) or 24
+	int bit_count;
+} synthetic_options;
+
+// getopt letters of the options shared by the generator and the benchmark
+#define SYNTHETIC_OPTIONS "b:c:f:l:r:"
+
+// Fills options with the defaults: 64x64, 16 colors, 4 rectangles, the
+// largest covering 25% of a random layout, 24 bits.
+void default_synthetic_options(synthetic_options * options);
+
+// Applies one of the SYNTHETIC_OPTIONS, returns false if value is invalid.
+bool parse_synthetic_option(int option, const char * value, synthetic_options * options);
+
+// Parses a size written as <width>x<height>, returns false if it's invalid.
+bool parse_size(const char * value, int * width, int * height);
+
+// Prints the SYNTHETIC_OPTIONS for the usage of a program.
+void show_synthetic_usage();
+
+// Returns NULL if options are valid, otherwise a description of the problem.
+const char * check_synthetic_options(const synthetic_options * options);
+
+// Writes a bitmap whose background has no two equal neighboring pixels, with
+// rectangles of distinct colors planted over it. The first rectangle is
+// strictly larger than the others, so it is the largest uniform rectangle of
+// the image; its coordinates are written to truth (without path). seed
+// selects the random layout and colors. Returns false if path can't be written.
+bool write_synthetic_bmp(const char * path, const synthetic_options * options, unsigned int seed, image_info * truth);
+
+#endif // _SYNTHETIC_BMP_H_
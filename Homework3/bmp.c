@@ -1,68 +1,353 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include "bmp.h"
 
-#define BYTES_PER_PIXEL (3)
-
-void load_bmp(const char * file, bmp * image) {
-	FILE * file_stream = NULL;
-	byte * raw_pixels = NULL;
-	uint i, pixels_count, row_size, padding, padded_row_size;
-	int j, k, index;
-
-	image->path = safe_strdup(file);
-	file_stream = safe_fopen(file, "rb");
-	safe_fread(&image->header, sizeof(bmp_header), file_stream);
-
-	if (image->header.type != 0x4D42)
-	{
-		fclose(file_stream);
-		return;
-	}
-
-	assert(BYTES_PER_PIXEL == image->header.bit_count / 8);
-
-	fseek(file_stream, image->header.pixels_address, SEEK_SET);
-	pixels_count = image->header.width * image->header.height;
-	row_size = image->header.bit_count * image->header.width;
-	padded_row_size = ((row_size + 31) / 32) * 4;
-	row_size /= BITS_PER_BYTE;
-	padding = padded_row_size - row_size;
-	raw_pixels = safe_malloc(image->header.image_size);
-	image->pixels = safe_malloc(pixels_count * sizeof(int));
-	safe_fread(raw_pixels, image->header.image_size, file_stream);
-	for (i = 0, j = pixels_count - image->header.width; j >= 0; j -= image->header.width) {
-		for (k = 0; k < image->header.width; k++, i += 3) {
-			index = j + k;
-			if (index != 0 && index % image->header.width == 0) {
-				// Skip padding bits
-				i += padding;
-			}
+#define BMP_SIGNATURE (0x4D42)
+#define FILE_HEADER_SIZE (14)
+#define MAX_PALETTE_COLORS (256)
+#define BYTES_PER_PALETTE_ENTRY (4)
+#define LOG_ROW_SIZE (256)
+// Largest pixel buffer an image may need, 1 GiB. Larger images are rejected,
+// which also keeps width * height within an int for the analyzers.
+#define MAX_PIXELS_SIZE ((size_t)1 << 30)
+
+// Packs the color channels in the pixel layout used by the analyzer: 0BGR
+#define PACK_PIXEL(blue, green, red) (((pixel)(blue) << 16) | ((pixel)(green) << 8) | (pixel)(red))
+
+// State shared by the row decoders of a single image
+typedef struct {
+	FILE * stream;
+	bmp * image;
+	uint width;
+	uint height;
+	bool top_down;
+	pixel palette[MAX_PALETTE_COLORS];
+	uint masks[3]; // blue, green and red masks for BI_BITFIELDS
+	int shifts[3]; // position of the lowest bit of every mask
+	int widths[3]; // number of bits set in every mask
+} bmp_decoder;
+
+static bool read_palette(bmp_decoder * decoder);
+static bool read_masks(bmp_decoder * decoder);
+static bool decode_rows(bmp_decoder * decoder);
+static bool decode_rle(bmp_decoder * decoder);
+
+bool load_bmp(const char * file, bmp * image) {
+	bmp_decoder decoder;
+	bmp_header * header = &image->header;
+	bool loaded = false, rle;
+	size_t pixels_size, row_size;
+	int width, height;
+
+	image->path = NULL;
+	image->pixels = NULL;
+	image->arena = NULL;
+	image->bytes_read = 0;
+	decoder.stream = safe_fopen(file, "rb");
+	decoder.image = image;
+
+	if (fread(header, sizeof(bmp_header), 1, decoder.stream) != 1 ||
+		header->type != BMP_SIGNATURE || header->header_size < 40 || header->planes != 1) {
+		fclose(decoder.stream);
+		return false;
+	}
+
+	// Negative height means the rows are stored top to bottom
+	width = (int)header->width;
+	height = (int)header->height;
+	if (width <= 0 || height == 0 || height == INT_MIN) {
+		fclose(decoder.stream);
+		return false;
+	}
+	decoder.top_down = height < 0;
+	decoder.width = width;
+	decoder.height = decoder.top_down ? -height : height;
+	header->height = decoder.height;
 
-			assert(i + 2 < image->header.image_size - padding);
+	// Checked before multiplying, so a crafted header can't wrap the sizes
+	if (decoder.height > MAX_PIXELS_SIZE / sizeof(pixel) / decoder.width) {
+		fclose(decoder.stream);
+		return false;
+	}
+	// The row buffer shares the arena with the pixels, so it counts as well
+	pixels_size = (size_t)decoder.width * decoder.height * sizeof(pixel);
+	row_size = (((size_t)header->bit_count * decoder.width + 31) / 32) * 4;
+	if (row_size > MAX_PIXELS_SIZE - pixels_size) {
+		fclose(decoder.stream);
+		return false;
+	}
+
+	switch (header->compression) {
+	case BI_RGB:
+		loaded = header->bit_count == 1 || header->bit_count == 4 || header->bit_count == 8 ||
+				 header->bit_count == 24 || header->bit_count == 32;
+		break;
+	case BI_RLE8:
+		loaded = header->bit_count == 8 && !decoder.top_down;
+		break;
+	case BI_RLE4:
+		loaded = header->bit_count == 4 && !decoder.top_down;
+		break;
+	case BI_BITFIELDS:
+		loaded = header->bit_count == 32;
+		break;
+	}
+
+	if (loaded && header->bit_count <= 8) {
+		loaded = read_palette(&decoder);
+	} else if (loaded && header->compression == BI_BITFIELDS) {
+		loaded = read_masks(&decoder);
+	}
+
+	if (loaded) {
+		// A single arena holds the path, the pixels and the row buffer
+		rle = header->compression == BI_RLE8 || header->compression == BI_RLE4;
+		image->arena = arena_create(pixels_size + row_size + strlen(file) + 64);
+		image->path = arena_strdup(image->arena, file);
+		// Row decoding writes every pixel, only RLE streams can skip some
+		image->pixels = arena_malloc(image->arena, pixels_size, rle);
+		loaded = fseek(decoder.stream, header->pixels_address, SEEK_SET) == 0;
+	}
 
-			image->pixels[index] = raw_pixels[i];
-			image->pixels[index] = (image->pixels[index] << BITS_PER_BYTE) | raw_pixels[i + 1];
-			image->pixels[index] = (image->pixels[index] << BITS_PER_BYTE) | raw_pixels[i + 2];
+	if (loaded) {
+		if (rle) {
+			loaded = decode_rle(&decoder);
+		} else {
+			loaded = decode_rows(&decoder);
 		}
 	}
 
-	assert(i == image->header.image_size - padding);
-	safe_free(raw_pixels);
+	image->bytes_read = ftell(decoder.stream);
+	fclose(decoder.stream);
+
+	if (!loaded) {
+		free_bmp(image);
+	}
+
 	//dump_bmp(image);
+	return loaded;
 }
 
-void dump_bmp(const bmp * image) {
+// Reads the color table that follows the info header of palette based images.
+// Entries are stored as BGR0 quads; missing entries stay black.
+static bool read_palette(bmp_decoder * decoder) {
+	byte entries[MAX_PALETTE_COLORS * BYTES_PER_PALETTE_ENTRY];
+	uint i, count = decoder->image->header.colors;
+
+	if (count == 0 || count > (1u << decoder->image->header.bit_count)) {
+		count = 1u << decoder->image->header.bit_count;
+	}
+
+	for (i = 0; i < MAX_PALETTE_COLORS; i++) {
+		decoder->palette[i] = 0;
+	}
+
+	if (fseek(decoder->stream, FILE_HEADER_SIZE + decoder->image->header.header_size, SEEK_SET) != 0 ||
+		fread(entries, BYTES_PER_PALETTE_ENTRY, count, decoder->stream) != count) {
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		byte * entry = &entries[i * BYTES_PER_PALETTE_ENTRY];
+		decoder->palette[i] = PACK_PIXEL(entry[0], entry[1], entry[2]);
+	}
+
+	return true;
+}
+
+// Reads the red, green and blue masks of BI_BITFIELDS images. They follow a
+// 40 bytes info header and are part of the larger V4/V5 headers.
+static bool read_masks(bmp_decoder * decoder) {
+	uint masks[3];
 	int i;
-	write_log2("\nDumbing image width=%d and height=%d from path %s:\n", image->header.width, image->header.height, image->path);
 
-	for (i = 0; i < image->header.width * image->header.height; i++) {
-		if (i != 0 && i % image->header.width == 0) {
-			write_log2("%d\n", image->pixels[i]);
+	if (fseek(decoder->stream, FILE_HEADER_SIZE + 40, SEEK_SET) != 0 ||
+		fread(masks, sizeof(uint), 3, decoder->stream) != 3) {
+		return false;
+	}
+
+	// The file stores them as red, green, blue
+	for (i = 0; i < 3; i++) {
+		decoder->masks[i] = masks[2 - i];
+		if (decoder->masks[i] == 0) {
+			return false;
+		}
+
+		decoder->shifts[i] = 0;
+		decoder->widths[i] = 0;
+		while (((decoder->masks[i] >> decoder->shifts[i]) & 1) == 0) decoder->shifts[i]++;
+		while (decoder->shifts[i] + decoder->widths[i] < 32 &&
+			   ((decoder->masks[i] >> (decoder->shifts[i] + decoder->widths[i])) & 1)) decoder->widths[i]++;
+	}
+
+	return true;
+}
+
+// Extracts the 8 most significant bits of the index-th BI_BITFIELDS channel
+static byte extract_channel(const bmp_decoder * decoder, uint value, int index) {
+	int width = decoder->widths[index];
+
+	value = (value & decoder->masks[index]) >> decoder->shifts[index];
+	return width >= BITS_PER_BYTE ? value >> (width - BITS_PER_BYTE) : value << (BITS_PER_BYTE - width);
+}
+
+// Returns the destination row in image->pixels for the row-th row in the file
+static pixel * pixels_row(const bmp_decoder * decoder, uint row) {
+	uint index = decoder->top_down ? row : decoder->height - 1 - row;
+	return &decoder->image->pixels[index * decoder->width];
+}
+
+// Decodes uncompressed rows one padded row at a time, so only a single row
+// of raw data is ever held in memory.
+static bool decode_rows(bmp_decoder * decoder) {
+	uint bit_count = decoder->image->header.bit_count;
+	size_t padded_row_size = (((size_t)bit_count * decoder->width + 31) / 32) * 4;
+	uint pixels_per_byte = bit_count < BITS_PER_BYTE ? BITS_PER_BYTE / bit_count : 1;
+	uint index_mask = (1u << (bit_count < BITS_PER_BYTE ? bit_count : BITS_PER_BYTE)) - 1;
+	byte * raw_row = arena_malloc(decoder->image->arena, padded_row_size, false);
+	bool decoded = true;
+	uint row, column, bits;
+	pixel * pixels;
+	byte * raw;
+
+	for (row = 0; row < decoder->height && decoded; row++) {
+		if (fread(raw_row, padded_row_size, 1, decoder->stream) != 1) {
+			decoded = false;
+			break;
+		}
+
+		pixels = pixels_row(decoder, row);
+		switch (bit_count) {
+		case 1:
+		case 4:
+		case 8:
+			for (column = 0; column < decoder->width; column++) {
+				// Indices are packed starting at the most significant bits
+				bits = (pixels_per_byte - 1 - column % pixels_per_byte) * bit_count;
+				pixels[column] = decoder->palette[(raw_row[column / pixels_per_byte] >> bits) & index_mask];
+			}
+			break;
+		case 24:
+			for (column = 0, raw = raw_row; column < decoder->width; column++, raw += 3) {
+				pixels[column] = PACK_PIXEL(raw[0], raw[1], raw[2]);
+			}
+			break;
+		case 32:
+			if (decoder->image->header.compression == BI_RGB) {
+				// The fourth byte is unused or alpha, neither is part of the color
+				for (column = 0, raw = raw_row; column < decoder->width; column++, raw += 4) {
+					pixels[column] = PACK_PIXEL(raw[0], raw[1], raw[2]);
+				}
+			} else {
+				for (column = 0, raw = raw_row; column < decoder->width; column++, raw += 4) {
+					uint value = raw[0] | (raw[1] << 8) | (raw[2] << 16) | ((uint)raw[3] << 24);
+					pixels[column] = PACK_PIXEL(extract_channel(decoder, value, 0),
+												extract_channel(decoder, value, 1),
+												extract_channel(decoder, value, 2));
+				}
+			}
+			break;
+		default:
+			decoded = false;
+		}
+	}
+
+	return decoded;
+}
+
+// Decodes a BI_RLE8 or BI_RLE4 stream straight from the file. Pixels skipped
+// by delta escapes or early end of lines keep the first palette color.
+// The stream is private to this thread, so the unlocked getc is safe.
+static bool decode_rle(bmp_decoder * decoder) {
+	bool rle4 = decoder->image->header.compression == BI_RLE4;
+	uint x = 0, y = 0, i, n;
+	int first, second, value;
+	pixel * pixels;
+
+	if (decoder->palette[0] != 0) {
+		for (i = 0; i < decoder->width * decoder->height; i++) {
+			decoder->image->pixels[i] = decoder->palette[0];
+		}
+	}
+
+	while (y < decoder->height) {
+		if ((first = getc_unlocked(decoder->stream)) == EOF || (second = getc_unlocked(decoder->stream)) == EOF) {
+			return false;
+		}
+
+		pixels = pixels_row(decoder, y);
+		if (first > 0) {
+			// Encoded mode: a run of first pixels with the index(es) in second
+			for (i = 0; i < (uint)first; i++, x++) {
+				value = rle4 ? (i % 2 == 0 ? second >> 4 : second & 0x0F) : second;
+				if (x < decoder->width) pixels[x] = decoder->palette[value];
+			}
+		} else if (second == 0) {
+			// End of line
+			x = 0;
+			y++;
+		} else if (second == 1) {
+			// End of bitmap
+			break;
+		} else if (second == 2) {
+			// Delta: move right and up by the next two bytes
+			if ((first = getc_unlocked(decoder->stream)) == EOF || (second = getc_unlocked(decoder->stream)) == EOF) {
+				return false;
+			}
+			x += first;
+			y += second;
 		} else {
-			write_log2("%d,", image->pixels[i]);
+			// Absolute mode: second literal indices, padded to a 16 bits boundary
+			n = rle4 ? (second + 1) / 2 : second;
+			for (i = 0; i < n; i++) {
+				if ((value = getc_unlocked(decoder->stream)) == EOF) {
+					return false;
+				}
+				if (rle4) {
+					if (x < decoder->width) pixels[x] = decoder->palette[value >> 4];
+					x++;
+					if (2 * i + 1 < (uint)second) {
+						if (x < decoder->width) pixels[x] = decoder->palette[value & 0x0F];
+						x++;
+					}
+				} else {
+					if (x < decoder->width) pixels[x] = decoder->palette[value];
+					x++;
+				}
+			}
+			if (n % 2 == 1 && getc_unlocked(decoder->stream) == EOF) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void free_bmp(bmp * image) {
+	arena_destroy(image->arena);
+	image->arena = NULL;
+	image->path = NULL;
+	image->pixels = NULL;
+}
+
+void dump_bmp(const bmp * image) {
+	char row[LOG_ROW_SIZE];
+	int i, j, length;
+
+	LOG_DEBUG("Dumping image width=%d and height=%d from path %s", image->header.width, image->header.height, image->path);
+
+	// One record per row, long rows are truncated by the logger
+	for (i = 0; i < image->header.height; i++) {
+		row[0] = '\0';
+		length = 0;
+		for (j = 0; j < image->header.width && length < LOG_ROW_SIZE - 13; j++) {
+			length += sprintf(row + length, j == 0 ? "%d" : ",%d", image->pixels[i * image->header.width + j]);
 		}
+		LOG_DEBUG("%s", row);
 	}
 }
 
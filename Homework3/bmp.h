@@ -3,18 +3,24 @@
 
 #include "utility.h"
 
+// Supported values of bmp_header.compression
+#define BI_RGB (0)
+#define BI_RLE8 (1)
+#define BI_RLE4 (2)
+#define BI_BITFIELDS (3)
+
 #pragma pack(push, 1)
 typedef struct {
 	ushort type;
 	uint size;
 	uint reserved;
 	uint pixels_address;
-	uint header_size; // must be 40
+	uint header_size; // at least 40
 	uint width;
-	uint height;
+	uint height; // negative in the file for top-down images, always positive after loading
 	ushort planes; // must be 1
-	ushort bit_count; // in this assignment must be 1
-	uint compression; // in this assignment must be 0
+	ushort bit_count; // 1, 4 or 8 with a palette, 24 or 32 without one
+	uint compression; // BI_RGB, BI_RLE8 (8 bits), BI_RLE4 (4 bits) or BI_BITFIELDS (32 bits)
 	uint image_size; //
 	uint x_pixels_per_meter;
 	uint y_pixels_per_meter;
@@ -35,11 +41,22 @@ struct bmp_t {
 	// an integer 1 byte for every color in this order with a padded
 	// zero at the most significant byte: 0BGR
 	pixel * pixels;
+	// Number of bytes read from the file while loading
+	long long bytes_read;
+	// Holds the path and the pixels, released at once by free_bmp
+	arena * arena;
 };
 
 typedef struct bmp_t bmp;
 
-void load_bmp(const char * file, bmp * image);
+// Loads the bitmap at file into image, decoding one row at a time straight
+// into image->pixels. Returns false and leaves nothing allocated when the
+// file is not a bitmap, is truncated, has no pixels or too many, or uses an
+// unsupported format.
+bool load_bmp(const char * file, bmp * image);
+
+// Releases the path and the pixels of a loaded image
+void free_bmp(bmp * image);
 
 void dump_bmp(const bmp * image);
 
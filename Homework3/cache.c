@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define CACHE_HEADER "# analyzer cache v2\n"
+// Version 1 files have no tiles, their results are still valid
+#define CACHE_HEADER_V1 "# analyzer cache v1\n"
+#define INITIAL_CAPACITY (1024)
+#define HASH_BUFFER_SIZE (64 * 1024)
+#define FNV_OFFSET_BASIS (14695981039346656037ULL)
+#define FNV_PRIME (1099511628211ULL)
+
+// One cached result, the key is (path, size, mtime, hash)
+typedef struct {
+	char * path;
+	long long size;
+	long long mtime; // in nanoseconds
+	unsigned long long hash;
+	// Becomes true once a result was stored for the current key
+	bool valid;
+	image_info result;
+	long long analysis_time;
+	// Tiles of the last analyzed version, kept when the content changes
+	tile_summary * tiles;
+} cache_entry;
+
+static char * cache_file_path = NULL;
+// Open addressing table of entries indexed by the hash of their path
+static cache_entry ** entries = NULL;
+static int capacity = 0;
+static int count = 0;
+static cache_stats stats;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long hash_bytes(unsigned long long hash, const byte * data, size_t length) {
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+// Hashes the whole content of the file at path, returns 0 if it can't be read
+static unsigned long long hash_file(const char * path) {
+	byte * buffer;
+	size_t length;
+	unsigned long long hash = FNV_OFFSET_BASIS;
+	FILE * stream = fopen(path, "rb");
+
+	if (stream == NULL) {
+		return 0;
+	}
+
+	buffer = safe_malloc(HASH_BUFFER_SIZE);
+	while ((length = fread(buffer, 1, HASH_BUFFER_SIZE, stream)) > 0) {
+		hash = hash_bytes(hash, buffer, length);
+	}
+
+	safe_free(buffer);
+	fclose(stream);
+	return hash;
+}
+
+// Returns the slot holding path or the empty slot where it should be inserted
+static cache_entry ** find_slot(const char * path) {
+	unsigned long long hash = hash_bytes(FNV_OFFSET_BASIS, (const byte *)path, strlen(path));
+	int i = hash & (capacity - 1);
+
+	while (entries[i] != NULL && strcmp(entries[i]->path, path) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+
+	return &entries[i];
+}
+
+static cache_entry * find_entry(const char * path) {
+	return capacity == 0 ? NULL : *find_slot(path);
+}
+
+// Inserts entry, doubling the table when it becomes half full
+static void insert_entry(cache_entry * entry) {
+	cache_entry ** old_entries = entries;
+	int i, old_capacity = capacity;
+
+	if (2 * (count + 1) > capacity) {
+		capacity = capacity == 0 ? INITIAL_CAPACITY : 2 * capacity;
+		entries = safe_malloc(capacity * sizeof(cache_entry *));
+		for (i = 0; i < old_capacity; i++) {
+			if (old_entries[i] != NULL) {
+				*find_slot(old_entries[i]->path) = old_entries[i];
+			}
+		}
+		safe_free(old_entries);
+	}
+
+	*find_slot(entry->path) = entry;
+	count++;
+}
+
+static cache_entry * create_entry(const char * path) {
+	cache_entry * entry = safe_malloc(sizeof(cache_entry));
+	entry->path = safe_strdup(path);
+	entry->tiles = NULL;
+	return entry;
+}
+
+static bool parse_int(char ** cursor, int * value) {
+	char * end;
+	*value = strtol(*cursor, &end, 10);
+	if (end == *cursor) {
+		return false;
+	}
+	*cursor = end;
+	return true;
+}
+
+static bool parse_hash(char ** cursor, unsigned long long * value) {
+	char * end;
+	*value = strtoull(*cursor, &end, 16);
+	if (end == *cursor) {
+		return false;
+	}
+	*cursor = end;
+	return true;
+}
+
+// Parses the line following an entry:
+//   tiles <tile size> <width> <height> then for every band
+//   <heights hash> <left> <top> <right> <bottom> <color> <area>
+//   then the hash of every tile. Returns NULL if it is malformed.
+static tile_summary * parse_tiles(char * line) {
+	tile_summary * tiles;
+	color_rectangle * largest;
+	int i, tile_size, width, height;
+	char * cursor = line + strlen("tiles ");
+	bool valid;
+
+	if (!parse_int(&cursor, &tile_size) || !parse_int(&cursor, &width) || !parse_int(&cursor, &height) ||
+		tile_size != TILE_SIZE || width < 0 || height < 0) {
+		return NULL;
+	}
+
+	tiles = create_tile_summary(width, height);
+	valid = true;
+	for (i = 0; valid && i < tiles->bands_count; i++) {
+		largest = &tiles->bands[i].largest;
+		valid = parse_hash(&cursor, &tiles->bands[i].heights_hash) &&
+				parse_int(&cursor, &largest->top_left_x) && parse_int(&cursor, &largest->top_left_y) &&
+				parse_int(&cursor, &largest->bottom_right_x) && parse_int(&cursor, &largest->bottom_right_y) &&
+				parse_int(&cursor, &largest->color) && parse_int(&cursor, &largest->area);
+	}
+	for (i = 0; valid && i < tiles->bands_count * tiles->tiles_per_band; i++) {
+		valid = parse_hash(&cursor, &tiles->tile_hashes[i]);
+	}
+
+	if (!valid) {
+		free_tile_summary(tiles);
+		return NULL;
+	}
+	return tiles;
+}
+
+static void write_tiles(FILE * stream, const tile_summary * tiles) {
+	const color_rectangle * largest;
+	int i;
+
+	fprintf(stream, "tiles %d %d %d", TILE_SIZE, tiles->width, tiles->height);
+	for (i = 0; i < tiles->bands_count; i++) {
+		largest = &tiles->bands[i].largest;
+		fprintf(stream, " %llx %d %d %d %d %d %d", tiles->bands[i].heights_hash,
+				largest->top_left_x, largest->top_left_y, largest->bottom_right_x, largest->bottom_right_y,
+				largest->color, largest->area);
+	}
+	for (i = 0; i < tiles->bands_count * tiles->tiles_per_band; i++) {
+		fprintf(stream, " %llx", tiles->tile_hashes[i]);
+	}
+	fputc('\n', stream);
+}
+
+static void load_entries(FILE * stream) {
+	char * line = NULL;
+	size_t line_capacity = 0;
+	char path[PATH_MAX + 1];
+	cache_entry entry;
+	cache_entry * loaded = NULL;
+	int length;
+
+	// Tiles lines can be long, they hold a hash per tile
+	if (getline(&line, &line_capacity, stream) < 0 ||
+		(strcmp(line, CACHE_HEADER) != 0 && strcmp(line, CACHE_HEADER_V1) != 0)) {
+		// Unknown format, start with an empty cache
+		free(line);
+		return;
+	}
+
+	while (getline(&line, &line_capacity, stream) >= 0) {
+		if (strncmp(line, "tiles ", strlen("tiles ")) == 0) {
+			// Belongs to the entry loaded right before
+			if (loaded != NULL && loaded->tiles == NULL) {
+				loaded->tiles = parse_tiles(line);
+			}
+			continue;
+		}
+
+		loaded = NULL;
+		if (sscanf(line, "%llx %lld %lld %d %d %d %d %lld %n",
+				   &entry.hash, &entry.size, &entry.mtime,
+				   &entry.result.top_left_x, &entry.result.top_left_y,
+				   &entry.result.bottom_right_x, &entry.result.bottom_right_y,
+				   &entry.analysis_time, &length) != 8) {
+			continue;
+		}
+
+		strncpy(path, line + length, PATH_MAX);
+		path[PATH_MAX] = '\0';
+		path[strcspn(path, "\n")] = '\0';
+		if (path[0] == '\0' || find_entry(path) != NULL) {
+			continue;
+		}
+
+		loaded = create_entry(path);
+		entry.path = loaded->path;
+		entry.valid = true;
+		entry.result.path = NULL;
+		entry.result.analysis = NULL;
+		entry.tiles = NULL;
+		*loaded = entry;
+		insert_entry(loaded);
+	}
+
+	free(line);
+}
+
+void cache_open(const char * cache_file) {
+	FILE * stream;
+
+	cache_file_path = safe_strdup(cache_file);
+	memset(&stats, 0, sizeof(stats));
+	stream = fopen(cache_file, "r");
+	if (stream != NULL) {
+		load_entries(stream);
+		fclose(stream);
+	}
+
+	LOG_MSG("Loaded %d cached result(s) from %s", count, cache_file);
+}
+
+void cache_close() {
+	char * temp_path;
+	FILE * stream;
+	int i;
+
+	if (cache_file_path == NULL) {
+		return;
+	}
+
+	// Write to a temporary file first so an interrupted run keeps the old cache
+	temp_path = safe_malloc(strlen(cache_file_path) + 5);
+	sprintf(temp_path, "%s.tmp", cache_file_path);
+	stream = fopen(temp_path, "w");
+	if (stream == NULL) {
+		fprintf(stderr, "WARNING: unable to write cache file %s\n", temp_path);
+	} else {
+		fputs(CACHE_HEADER, stream);
+		for (i = 0; i < capacity; i++) {
+			cache_entry * entry = entries[i];
+			if (entry != NULL && entry->valid && strchr(entry->path, '\n') == NULL) {
+				fprintf(stream, "%llx %lld %lld %d %d %d %d %lld %s\n",
+						entry->hash, entry->size, entry->mtime,
+						entry->result.top_left_x, entry->result.top_left_y,
+						entry->result.bottom_right_x, entry->result.bottom_right_y,
+						entry->analysis_time, entry->path);
+				if (entry->tiles != NULL) {
+					write_tiles(stream, entry->tiles);
+				}
+			}
+		}
+
+		if (fclose(stream) != 0 || rename(temp_path, cache_file_path) != 0) {
+			fprintf(stderr, "WARNING: unable to write cache file %s\n", cache_file_path);
+		}
+	}
+
+	for (i = 0; i < capacity; i++) {
+		if (entries[i] != NULL) {
+			free_tile_summary(entries[i]->tiles);
+			safe_free(entries[i]->path);
+			safe_free(entries[i]);
+		}
+	}
+
+	safe_free(entries);
+	safe_free(temp_path);
+	safe_free(cache_file_path);
+	entries = NULL;
+	cache_file_path = NULL;
+	capacity = 0;
+	count = 0;
+}
+
+bool cache_enabled() {
+	return cache_file_path != NULL;
+}
+
+bool cache_lookup(const char * path, image_info * result) {
+	struct stat file_stat;
+	cache_entry * entry;
+	long long size, mtime, start = time_us();
+	unsigned long long hash = 0;
+	bool hit = false, hashed = false;
+
+	if (cache_file_path == NULL || stat(path, &file_stat) != 0) {
+		return false;
+	}
+
+	size = file_stat.st_size;
+	mtime = (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+
+	pthread_mutex_lock(&cache_mutex);
+	entry = find_entry(path);
+	if (entry != NULL && entry->valid && entry->size == size && entry->mtime == mtime) {
+		hit = true;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	if (!hit) {
+		// Size or modification time changed, the content may still be the same
+		hash = hash_file(path);
+		hashed = true;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	entry = find_entry(path);
+	if (hashed) {
+		if (entry == NULL) {
+			entry = create_entry(path);
+			insert_entry(entry);
+		}
+
+		hit = entry->valid && entry->size == size && entry->hash == hash;
+		if (!hit) {
+			// Remember the new key, the result is filled by cache_store
+			entry->valid = false;
+			entry->hash = hash;
+			entry->size = size;
+		}
+		entry->mtime = mtime;
+	}
+
+	if (hit) {
+		*result = entry->result;
+		stats.hits++;
+		stats.hash_hits += hashed;
+		stats.saved_time += entry->analysis_time;
+	} else {
+		stats.misses++;
+	}
+	stats.lookup_time += time_us() - start;
+	pthread_mutex_unlock(&cache_mutex);
+
+	return hit;
+}
+
+tile_summary * cache_take_tiles(const char * path) {
+	tile_summary * tiles = NULL;
+	cache_entry * entry;
+
+	if (cache_file_path == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	entry = find_entry(path);
+	if (entry != NULL && entry->tiles != NULL) {
+		tiles = entry->tiles;
+		entry->tiles = NULL;
+		stats.incremental++;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	return tiles;
+}
+
+void cache_store(const char * path, const image_info * result, long long analysis_time, tile_summary * tiles) {
+	cache_entry * entry;
+
+	if (cache_file_path == NULL) {
+		free_tile_summary(tiles);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	entry = find_entry(path);
+	if (entry != NULL) {
+		entry->result = *result;
+		entry->result.path = NULL;
+		entry->result.analysis = NULL;
+		entry->analysis_time = analysis_time;
+		entry->valid = true;
+		if (tiles != NULL) {
+			stats.rows_scanned += tiles->rows_scanned;
+			stats.rows_total += tiles->height;
+			free_tile_summary(entry->tiles);
+			entry->tiles = tiles;
+			tiles = NULL;
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	free_tile_summary(tiles);
+}
+
+cache_stats cache_get_stats() {
+	cache_stats current;
+	pthread_mutex_lock(&cache_mutex);
+	current = stats;
+	pthread_mutex_unlock(&cache_mutex);
+	return current;
+}
@@ -0,0 +1,52 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "analyzer.h"
+
+// Statistics collected by the result cache during a run
+typedef struct {
+	// Lookups answered from the cache, either because size and modification
+	// time matched or because the content hash still matched
+	int hits;
+	// Hits that needed the content to be hashed
+	int hash_hits;
+	// Lookups that required the image to be analyzed
+	int misses;
+	// Analysis time recorded for the results served from the cache, in microseconds
+	long long saved_time;
+	// Time spent in lookups (stat and content hashing), in microseconds
+	long long lookup_time;
+	// Misses re-analyzed from the tiles of the previous version of the image
+	int incremental;
+	// Pixel rows scanned by the analyses stored with tiles, and rows they had
+	long long rows_scanned;
+	long long rows_total;
+} cache_stats;
+
+// Opens the on-disk cache at cache_file, loading its entries if it already
+// exists. Until this is called every lookup misses and stores are ignored.
+void cache_open(const char * cache_file);
+
+// Writes the cache back to disk and releases it.
+void cache_close();
+
+// Returns true if the cache was opened.
+bool cache_enabled();
+
+// Looks up the result for the image at path, keyed by path, size, modification
+// time and content hash. Returns true and fills result (without its path) on a
+// hit. On a miss the new key is remembered for the following cache_store.
+bool cache_lookup(const char * path, image_info * result);
+
+// Returns the tile summary kept with the last result of path, or NULL. The
+// caller owns it, a later cache_store gives the cache a new one.
+tile_summary * cache_take_tiles(const char * path);
+
+// Records the result computed for path, along with the time it took to
+// compute it in microseconds. Takes ownership of tiles, which may be NULL.
+void cache_store(const char * path, const image_info * result, long long analysis_time, tile_summary * tiles);
+
+// Returns the statistics collected since the cache was opened.
+cache_stats cache_get_stats();
+
+#endif // _CACHE_H_
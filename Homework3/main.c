@@ -1,19 +1,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 #include "utility.h"
 #include "analyzer.h"
+#include "cache.h"
+#include "metrics.h"
+
+// Formats of the results printed on stdout
+typedef enum {
+	TEXT_OUTPUT,
+	// One JSON object per line
+	JSON_OUTPUT
+} output_format;
 
 void show_usage(const char* exe);
 
+void print_result(const image_info * result, void * format);
+
+void show_cache_stats();
+
 int main(int argc, char* argv[]) {
 	int thread_limit;
+	int option;
+	char * end;
+	const char * cache_file = NULL;
+	const char * metrics_file = NULL;
+	bool metrics = false;
+	bool ordered = false;
+	output_format format = TEXT_OUTPUT;
+	const memory_allocator * allocator = &caching_allocator;
 
 	// Process command-line arguments.
-	if (argc == 3) {
-		char * end;
-		thread_limit = strtol(argv[1], &end, 10);
+	if (argc == 2 && strcmp(argv[1], "--help") == 0) {
+		show_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	while ((option = getopt(argc, argv, "a:c:Ck:mM:o:Ors:")) != -1) {
+		switch (option) {
+		case 'a':
+			allocator = find_memory_allocator(optarg);
+			if (allocator == NULL) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'C':
+			color_statistics = true;
+			break;
+		case 'k':
+			top_rectangles = strtol(optarg, &end, 10);
+			if (*end != 0 || top_rectangles < 1) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			metrics = true;
+			break;
+		case 'M':
+			metrics = true;
+			metrics_file = optarg;
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0) {
+				format = TEXT_OUTPUT;
+			} else if (strcmp(optarg, "json") == 0) {
+				format = JSON_OUTPUT;
+			} else {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'O':
+			ordered = true;
+			break;
+		case 'r':
+			recursive_scan = true;
+			break;
+		case 's':
+			scan_thread_limit = atoi(optarg);
+			if (scan_thread_limit < 1) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind == 2) {
+		thread_limit = strtol(argv[optind], &end, 10);
 		if (*end != 0) {
 			show_usage(argv[0]);
 			return EXIT_FAILURE;
@@ -24,26 +108,127 @@ int main(int argc, char* argv[]) {
 		}
 	} else {
 		show_usage(argv[0]);
-		return (argc == 2 && strcmp(argv[1], "--help") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+		return EXIT_FAILURE;
 	}
 
-	// Ready to start retrieving and analyzing images.
-	int images;
-	image_info * results = analyze_images_in_directory(thread_limit, argv[2], &images);
-	printf("%d image(s) analyzed.\n", images);
-	int i;
-	for (i = 0; i < images; i++) {
-		printf("%s  (%d,%d)-(%d,%d)\n", results[i].path, results[i].top_left_x, results[i].top_left_y, results[i].bottom_right_x, results[i].bottom_right_y);
-		safe_free(results[i].path);
+	set_memory_allocator(allocator);
+
+	if (cache_file != NULL) {
+		cache_open(cache_file);
+	}
+
+	if (metrics) {
+		metrics_open(metrics_file);
+	}
+
+	// Ready to start retrieving and analyzing images, results are printed
+	// as soon as they are known.
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	int images = analyze_images_streaming(thread_limit, argv[optind + 1], ordered, print_result, &format);
+	if (format == TEXT_OUTPUT) {
+		printf("%d image(s) analyzed.\n", images);
+	}
+
+	metrics_close();
+
+	if (cache_enabled()) {
+		show_cache_stats();
+		cache_close();
 	}
-	safe_free(results);
 
 	// Verify that all allocated memory has been freed ahead
-	assert(allocated_chunks == 0);
+	assert(get_memory_stats().chunks == 0);
 
 	return EXIT_SUCCESS;
 }
 
 void show_usage(const char* exe) {
-	printf("Usage: %s <thread-limit> <directory>\n", exe);
+	printf("Usage: %s [-a <allocator>] [-c <cache-file>] [-C] [-k <count>] [-m | -M <metrics-file>] [-o <format>] [-O] [-r] [-s <scan-threads>] <thread-limit> <directory>\n", exe);
+	printf("  -a <allocator>    caching (default) or system\n");
+	printf("  -c <cache-file>   reuse results of unchanged images from cache-file and update it,\n");
+	printf("                    modified images only get their changed tiles rescanned\n");
+	printf("  -C                print the pixels and largest rectangle of every color\n");
+	printf("  -k <count>        print the count largest non-overlapping rectangles\n");
+	printf("  -m                print per-stage timings, thread usage and queue depth\n");
+	printf("  -M <metrics-file> same as -m and write per-image metrics to metrics-file,\n");
+	printf("                    as JSON with threads and queue depth if it ends with .json,\n");
+	printf("                    as CSV otherwise\n");
+	printf("  -o <format>       text (default) or json, one JSON object per line\n");
+	printf("  -O                print results in the order the images were found\n");
+	printf("  -r                analyze images in subdirectories too\n");
+	printf("  -s <scan-threads> number of threads scanning directories, 4 by default\n");
+}
+
+// Prints a 0BGR color as #rrggbb, quoted for JSON
+static void print_color(int color, bool quoted) {
+	printf(quoted ? "\"#%02x%02x%02x\"" : "#%02x%02x%02x", color & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF);
+}
+
+static void print_json_analysis(const image_analysis * analysis) {
+	int i;
+
+	printf(", \"rectangles\": [");
+	for (i = 0; i < analysis->rectangles_count; i++) {
+		const color_rectangle * rectangle = &analysis->rectangles[i];
+		printf("%s{\"top_left\": [%d, %d], \"bottom_right\": [%d, %d], \"area\": %d, \"color\": ", i == 0 ? "" : ", ",
+			   rectangle->top_left_x, rectangle->top_left_y, rectangle->bottom_right_x, rectangle->bottom_right_y, rectangle->area);
+		print_color(rectangle->color, true);
+		printf("}");
+	}
+
+	printf("], \"colors\": [");
+	for (i = 0; i < analysis->colors_count; i++) {
+		printf("%s{\"color\": ", i == 0 ? "" : ", ");
+		print_color(analysis->colors[i].color, true);
+		printf(", \"pixels\": %d, \"largest_area\": %d}", analysis->colors[i].pixels, analysis->colors[i].largest_area);
+	}
+	printf("]");
+}
+
+static void print_text_analysis(const image_analysis * analysis) {
+	int i;
+
+	for (i = 0; i < analysis->rectangles_count; i++) {
+		const color_rectangle * rectangle = &analysis->rectangles[i];
+		printf("  rectangle %d  (%d,%d)-(%d,%d)  area %d  color ", i + 1, rectangle->top_left_x, rectangle->top_left_y,
+			   rectangle->bottom_right_x, rectangle->bottom_right_y, rectangle->area);
+		print_color(rectangle->color, false);
+		printf("\n");
+	}
+
+	for (i = 0; i < analysis->colors_count; i++) {
+		printf("  color ");
+		print_color(analysis->colors[i].color, false);
+		printf("  %d pixel(s)  largest rectangle %d\n", analysis->colors[i].pixels, analysis->colors[i].largest_area);
+	}
+}
+
+void print_result(const image_info * result, void * format) {
+	if (*(output_format *)format == JSON_OUTPUT) {
+		printf("{\"path\": ");
+		write_json_string(stdout, result->path);
+		printf(", \"top_left\": [%d, %d], \"bottom_right\": [%d, %d]",
+			   result->top_left_x, result->top_left_y, result->bottom_right_x, result->bottom_right_y);
+		if (result->analysis != NULL) {
+			print_json_analysis(result->analysis);
+		}
+		printf("}\n");
+	} else {
+		printf("%s  (%d,%d)-(%d,%d)\n", result->path, result->top_left_x, result->top_left_y, result->bottom_right_x, result->bottom_right_y);
+		if (result->analysis != NULL) {
+			print_text_analysis(result->analysis);
+		}
+	}
+}
+
+void show_cache_stats() {
+	cache_stats stats = cache_get_stats();
+	int lookups = stats.hits + stats.misses;
+
+	fprintf(stderr, "cache: %d hit(s) (%d by content hash), %d miss(es), %.1f%% hit rate\n",
+			stats.hits, stats.hash_hits, stats.misses, lookups == 0 ? 0.0 : 100.0 * stats.hits / lookups);
+	fprintf(stderr, "cache: %.3f s of analysis saved, %.3f s spent in lookups\n",
+			stats.saved_time / 1e6, stats.lookup_time / 1e6);
+	fprintf(stderr, "cache: %d image(s) re-analyzed from their tiles, %lld of %lld pixel row(s) scanned\n",
+			stats.incremental, stats.rows_scanned, stats.rows_total);
 }
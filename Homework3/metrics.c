@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "metrics.h"
+
+#define QUEUE_SAMPLE_INTERVAL (1000) // microseconds between queue depth samples
+
+typedef enum {
+	SCAN_STAGE,
+	QUEUE_STAGE,
+	LOAD_STAGE,
+	ANALYSIS_STAGE,
+	STAGE_COUNT
+} stage;
+
+typedef struct {
+	thread_role role;
+	int id;
+	long long busy_time;
+	long long idle_time;
+	int items;
+} thread_metrics;
+
+typedef struct {
+	long long time;
+	int depth;
+} queue_sample;
+
+static const char * stage_names[STAGE_COUNT] = { "scan", "queue wait", "load", "analysis" };
+static const char * role_names[] = { "scanner", "analyzer" };
+
+static bool enabled = false;
+static char * dump_file_path = NULL;
+static long long start_time;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static image_metrics * images = NULL;
+static int images_count = 0;
+static int images_capacity = 0;
+static thread_metrics * threads = NULL;
+static int threads_count = 0;
+static int threads_capacity = 0;
+
+// Only touched with the analysis queue locked
+static queue_sample * queue_samples = NULL;
+static int queue_samples_count = 0;
+static int queue_samples_capacity = 0;
+static int max_queue_depth = 0;
+
+// Makes room for one more element in an array of element_size bytes
+static void * grow_array(void * array, int count, int * capacity, int element_size) {
+	void * old_array = array;
+
+	if (count < *capacity) {
+		return array;
+	}
+
+	*capacity = *capacity == 0 ? 64 : 2 * *capacity;
+	array = safe_malloc(*capacity * element_size);
+	if (old_array != NULL) {
+		memcpy(array, old_array, count * element_size);
+		safe_free(old_array);
+	}
+
+	return array;
+}
+
+void metrics_open(const char * dump_file) {
+	enabled = true;
+	dump_file_path = dump_file == NULL ? NULL : safe_strdup(dump_file);
+	start_time = time_us();
+}
+
+bool metrics_enabled() {
+	return enabled;
+}
+
+long long metrics_now() {
+	return enabled ? time_us() : 0;
+}
+
+void metrics_record_image(const image_metrics * image) {
+	if (!enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&metrics_mutex);
+	images = grow_array(images, images_count, &images_capacity, sizeof(image_metrics));
+	images[images_count] = *image;
+	images[images_count].path = safe_strdup(image->path);
+	images[images_count].discovered -= start_time;
+	images_count++;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+void metrics_record_thread(thread_role role, int id, long long busy_time, long long idle_time, int items) {
+	if (!enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&metrics_mutex);
+	threads = grow_array(threads, threads_count, &threads_capacity, sizeof(thread_metrics));
+	threads[threads_count].role = role;
+	threads[threads_count].id = id;
+	threads[threads_count].busy_time = busy_time;
+	threads[threads_count].idle_time = idle_time;
+	threads[threads_count].items = items;
+	threads_count++;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+void metrics_queue_depth(int depth) {
+	long long now;
+
+	if (!enabled) {
+		return;
+	}
+
+	if (depth > max_queue_depth) {
+		max_queue_depth = depth;
+	}
+
+	now = time_us() - start_time;
+	if (queue_samples_count > 0 && now - queue_samples[queue_samples_count - 1].time < QUEUE_SAMPLE_INTERVAL) {
+		return;
+	}
+
+	queue_samples = grow_array(queue_samples, queue_samples_count, &queue_samples_capacity, sizeof(queue_sample));
+	queue_samples[queue_samples_count].time = now;
+	queue_samples[queue_samples_count].depth = depth;
+	queue_samples_count++;
+}
+
+static long long stage_time(const image_metrics * image, stage s) {
+	switch (s) {
+	case SCAN_STAGE:
+		return image->scan_time;
+	case QUEUE_STAGE:
+		return image->queue_time;
+	case LOAD_STAGE:
+		return image->load_time;
+	default:
+		return image->analysis_time;
+	}
+}
+
+static int compare_times(const void * left, const void * right) {
+	long long l = *(const long long *)left, r = *(const long long *)right;
+	return l < r ? -1 : l > r;
+}
+
+static void show_summary(long long wall_time) {
+	long long * times = safe_malloc((images_count + 1) * sizeof(long long));
+	long long totals[STAGE_COUNT], bytes_read = 0, busy[2] = { 0, 0 }, idle[2] = { 0, 0 };
+	long long depth_sum = 0;
+	int i, s, cached = 0, failed = 0, bound;
+
+	fprintf(stderr, "metrics: %d image(s) in %.3f s\n", images_count, wall_time / 1e6);
+	fprintf(stderr, "metrics: %-10s %10s %10s %10s %10s\n", "stage", "total s", "mean ms", "p95 ms", "max ms");
+	for (s = 0; s < STAGE_COUNT; s++) {
+		totals[s] = 0;
+		for (i = 0; i < images_count; i++) {
+			times[i] = stage_time(&images[i], s);
+			totals[s] += times[i];
+		}
+
+		qsort(times, images_count, sizeof(long long), compare_times);
+		fprintf(stderr, "metrics: %-10s %10.3f %10.3f %10.3f %10.3f\n", stage_names[s], totals[s] / 1e6,
+				images_count == 0 ? 0.0 : totals[s] / 1e3 / images_count,
+				images_count == 0 ? 0.0 : times[images_count * 95 / 100] / 1e3,
+				images_count == 0 ? 0.0 : times[images_count - 1] / 1e3);
+	}
+
+	for (i = 0; i < images_count; i++) {
+		bytes_read += images[i].bytes_read;
+		cached += images[i].cached;
+		failed += !images[i].analyzed;
+	}
+
+	fprintf(stderr, "metrics: %d cached, %d unsupported, %.1f MB read (%.1f MB/s while loading)\n",
+			cached, failed, bytes_read / 1e6, totals[LOAD_STAGE] == 0 ? 0.0 : (double)bytes_read / totals[LOAD_STAGE]);
+
+	for (i = 0; i < queue_samples_count; i++) {
+		depth_sum += queue_samples[i].depth;
+	}
+	fprintf(stderr, "metrics: queue depth max %d, mean %.1f over %d sample(s)\n", max_queue_depth,
+			queue_samples_count == 0 ? 0.0 : (double)depth_sum / queue_samples_count, queue_samples_count);
+
+	for (i = 0; i < threads_count; i++) {
+		long long lifetime = threads[i].busy_time + threads[i].idle_time;
+		fprintf(stderr, "metrics: %s %d busy %.3f s, idle %.3f s (%.0f%% busy), %d item(s)\n",
+				role_names[threads[i].role], threads[i].id, threads[i].busy_time / 1e6, threads[i].idle_time / 1e6,
+				lifetime == 0 ? 0.0 : 100.0 * threads[i].busy_time / lifetime, threads[i].items);
+		busy[threads[i].role] += threads[i].busy_time;
+		idle[threads[i].role] += threads[i].idle_time;
+	}
+
+	// Analyzers mostly waiting for images means the scanners can't keep up,
+	// otherwise the slower of the two analyzer stages is the limit
+	if (idle[ANALYZER_THREAD] > busy[ANALYZER_THREAD]) {
+		bound = SCAN_STAGE;
+	} else {
+		bound = totals[LOAD_STAGE] > totals[ANALYSIS_STAGE] ? LOAD_STAGE : ANALYSIS_STAGE;
+	}
+	fprintf(stderr, "metrics: analyzers %.0f%% busy, scanners %.0f%% busy, bound by %s\n",
+			busy[ANALYZER_THREAD] + idle[ANALYZER_THREAD] == 0 ? 0.0 :
+			100.0 * busy[ANALYZER_THREAD] / (busy[ANALYZER_THREAD] + idle[ANALYZER_THREAD]),
+			busy[SCANNER_THREAD] + idle[SCANNER_THREAD] == 0 ? 0.0 :
+			100.0 * busy[SCANNER_THREAD] / (busy[SCANNER_THREAD] + idle[SCANNER_THREAD]),
+			stage_names[bound]);
+
+	safe_free(times);
+}
+
+void write_json_string(FILE * stream, const char * str) {
+	fputc('"', stream);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(stream, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(stream, "\\u%04x", *str);
+		} else {
+			fputc(*str, stream);
+		}
+	}
+	fputc('"', stream);
+}
+
+static void write_json(FILE * stream, long long wall_time) {
+	int i;
+
+	fprintf(stream, "{\n\"wall_time_us\": %lld,\n\"max_queue_depth\": %d,\n\"images\": [", wall_time, max_queue_depth);
+	for (i = 0; i < images_count; i++) {
+		fprintf(stream, "%s\n{\"path\": ", i == 0 ? "" : ",");
+		write_json_string(stream, images[i].path);
+		fprintf(stream, ", \"thread\": %d, \"discovered_us\": %lld, \"scan_us\": %lld, \"queue_us\": %lld, "
+				"\"load_us\": %lld, \"analysis_us\": %lld, \"bytes_read\": %lld, \"cached\": %s, \"analyzed\": %s}",
+				images[i].thread, images[i].discovered, images[i].scan_time, images[i].queue_time,
+				images[i].load_time, images[i].analysis_time, images[i].bytes_read,
+				images[i].cached ? "true" : "false", images[i].analyzed ? "true" : "false");
+	}
+
+	fprintf(stream, "\n],\n\"threads\": [");
+	for (i = 0; i < threads_count; i++) {
+		fprintf(stream, "%s\n{\"role\": \"%s\", \"id\": %d, \"busy_us\": %lld, \"idle_us\": %lld, \"items\": %d}",
+				i == 0 ? "" : ",", role_names[threads[i].role], threads[i].id,
+				threads[i].busy_time, threads[i].idle_time, threads[i].items);
+	}
+
+	fprintf(stream, "\n],\n\"queue_depth\": [");
+	for (i = 0; i < queue_samples_count; i++) {
+		fprintf(stream, "%s[%lld, %d]", i == 0 ? "" : ", ", queue_samples[i].time, queue_samples[i].depth);
+	}
+	fprintf(stream, "]\n}\n");
+}
+
+static void write_csv(FILE * stream) {
+	const char * c;
+	int i;
+
+	fprintf(stream, "path,thread,discovered_us,scan_us,queue_us,load_us,analysis_us,bytes_read,cached,analyzed\n");
+	for (i = 0; i < images_count; i++) {
+		fputc('"', stream);
+		for (c = images[i].path; *c != '\0'; c++) {
+			if (*c == '"') {
+				fputc('"', stream);
+			}
+			fputc(*c, stream);
+		}
+		fprintf(stream, "\",%d,%lld,%lld,%lld,%lld,%lld,%lld,%d,%d\n", images[i].thread, images[i].discovered,
+				images[i].scan_time, images[i].queue_time, images[i].load_time, images[i].analysis_time,
+				images[i].bytes_read, images[i].cached, images[i].analyzed);
+	}
+}
+
+void metrics_close() {
+	long long wall_time = time_us() - start_time;
+	size_t length;
+	FILE * stream;
+	int i;
+
+	if (!enabled) {
+		return;
+	}
+
+	show_summary(wall_time);
+
+	if (dump_file_path != NULL) {
+		stream = fopen(dump_file_path, "w");
+		if (stream == NULL) {
+			fprintf(stderr, "WARNING: unable to write metrics file %s\n", dump_file_path);
+		} else {
+			length = strlen(dump_file_path);
+			if (length >= 5 && strcmp(dump_file_path + length - 5, ".json") == 0) {
+				write_json(stream, wall_time);
+			} else {
+				write_csv(stream);
+			}
+			fclose(stream);
+		}
+	}
+
+	for (i = 0; i < images_count; i++) {
+		safe_free((char *)images[i].path);
+	}
+
+	safe_free(images);
+	safe_free(threads);
+	safe_free(queue_samples);
+	safe_free(dump_file_path);
+	images = NULL;
+	threads = NULL;
+	queue_samples = NULL;
+	dump_file_path = NULL;
+	images_count = images_capacity = 0;
+	threads_count = threads_capacity = 0;
+	queue_samples_count = queue_samples_capacity = 0;
+	max_queue_depth = 0;
+	enabled = false;
+}
@@ -0,0 +1,61 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "utility.h"
+
+// Timings of one image through the pipeline, in microseconds
+typedef struct {
+	const char * path;
+	// Analyzer thread that processed the image
+	int thread;
+	// When the scanner queued the image, since the metrics were opened
+	long long discovered;
+	// Time the scanner spent listing the directory up to this image
+	long long scan_time;
+	// Time between being queued and being taken by an analyzer
+	long long queue_time;
+	// Cache lookup and load_bmp
+	long long load_time;
+	// get_max_rectangle, 0 for cached results
+	long long analysis_time;
+	long long bytes_read;
+	bool cached;
+	// False when the image couldn't be loaded
+	bool analyzed;
+} image_metrics;
+
+typedef enum {
+	SCANNER_THREAD,
+	ANALYZER_THREAD
+} thread_role;
+
+// Starts collecting metrics, every other call is ignored until then. When
+// dump_file is not NULL, metrics_close writes the collected data there as
+// JSON if its name ends with .json and as CSV, one line per image, otherwise.
+void metrics_open(const char * dump_file);
+
+// Prints the end-of-run summary to stderr, writes the dump file and releases
+// the collected data.
+void metrics_close();
+
+// Returns true if metrics_open was called.
+bool metrics_enabled();
+
+// Returns time_us() while collecting metrics and 0 otherwise, so the callers
+// skip reading the clock when metrics are disabled.
+long long metrics_now();
+
+// Records the timings of an image, the path is copied.
+void metrics_record_image(const image_metrics * image);
+
+// Records how long a thread worked and waited, and how many items it handled.
+void metrics_record_thread(thread_role role, int id, long long busy_time, long long idle_time, int items);
+
+// Records the number of images waiting in the analysis queue, called with the
+// queue locked on every change. Samples are kept at most once per millisecond.
+void metrics_queue_depth(int depth);
+
+// Writes str to stream as a JSON string, quoted and escaped.
+void write_json_string(FILE * stream, const char * str);
+
+#endif // _METRICS_H_
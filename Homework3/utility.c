@@ -2,38 +2,351 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <sys/mman.h>
 #include "utility.h"
 
-#define MAX_LOG_LINE (512)
-#define ENABLE_LOG false
+// Allocation counters are split in per-thread shards. Every shard has a
+// single writer, its thread, so counting needs neither a lock nor atomic
+// read-modify-write instructions; readers add up all the shards. Shards of
+// exited threads are handed to new threads with their counts. Peak usage
+// is sampled on large allocations and on every PEAK_SAMPLE_INTERVAL-th
+// allocation of a thread.
+#define CACHE_LINE_SIZE (64)
+#define PEAK_SAMPLE_SIZE (4096)
+#define PEAK_SAMPLE_INTERVAL (64)
 
-int allocated_chunks = 0;
-bool logging_enabled;
-bool init = false;
-pthread_mutex_t memory_mutex;
-pthread_mutex_t logging_mutex;
+typedef struct memory_shard {
+	atomic_long chunks;
+	atomic_long bytes;
+	atomic_long total_chunks;
+	atomic_long total_bytes;
+	// List of every shard ever created, only ever prepended to
+	struct memory_shard * next;
+	// List of shards released by exited threads
+	struct memory_shard * next_free;
+} __attribute__((aligned(CACHE_LINE_SIZE))) memory_shard;
 
-void * safe_malloc(int size) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
+// Every chunk starts with its size so safe_free can account for its bytes,
+// padded to the strictest alignment malloc guarantees
+typedef union {
+	size_t size;
+	long long integer_alignment;
+	long double float_alignment;
+	void * pointer_alignment;
+} chunk_header;
+
+static _Atomic(memory_shard *) memory_shards = NULL;
+static memory_shard * free_memory_shards = NULL;
+static pthread_mutex_t memory_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t memory_shards_once = PTHREAD_ONCE_INIT;
+static pthread_key_t memory_shard_key;
+static __thread memory_shard * thread_shard = NULL;
+static atomic_long peak_bytes = 0;
+
+static void release_shard(void * shard) {
+	pthread_mutex_lock(&memory_shards_mutex);
+	((memory_shard *)shard)->next_free = free_memory_shards;
+	free_memory_shards = shard;
+	pthread_mutex_unlock(&memory_shards_mutex);
+	thread_shard = NULL;
+}
+
+static void create_shard_key() {
+	pthread_key_create(&memory_shard_key, release_shard);
+}
+
+static memory_shard * get_thread_shard() {
+	memory_shard * shard = thread_shard;
+
+	if (shard == NULL) {
+		pthread_once(&memory_shards_once, create_shard_key);
+		pthread_mutex_lock(&memory_shards_mutex);
+		if (free_memory_shards != NULL) {
+			shard = free_memory_shards;
+			free_memory_shards = shard->next_free;
+		} else {
+			if (posix_memalign((void **)&shard, CACHE_LINE_SIZE, sizeof(memory_shard)) != 0) {
+				printf("ERROR: memory allocation failed, exit\n");
+				exit(1);
+			}
+			memset(shard, 0, sizeof(memory_shard));
+			shard->next = atomic_load_explicit(&memory_shards, memory_order_relaxed);
+			atomic_store_explicit(&memory_shards, shard, memory_order_release);
+		}
+		pthread_mutex_unlock(&memory_shards_mutex);
+
+		pthread_setspecific(memory_shard_key, shard);
+		thread_shard = shard;
+	}
+
+	return shard;
+}
+
+// Only the owning thread writes its shard, a plain load and store is enough
+static void shard_add(atomic_long * counter, long value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void sum_shards(memory_stats * stats) {
+	memory_shard * shard = atomic_load_explicit(&memory_shards, memory_order_acquire);
+
+	memset(stats, 0, sizeof(memory_stats));
+	for (; shard != NULL; shard = shard->next) {
+		stats->chunks += atomic_load_explicit(&shard->chunks, memory_order_relaxed);
+		stats->bytes += atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+		stats->total_chunks += atomic_load_explicit(&shard->total_chunks, memory_order_relaxed);
+		stats->total_bytes += atomic_load_explicit(&shard->total_bytes, memory_order_relaxed);
+	}
+}
+
+static void sample_peak() {
+	memory_stats stats;
+	long peak = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
+
+	sum_shards(&stats);
+	while (stats.bytes > peak && !atomic_compare_exchange_weak_explicit(&peak_bytes, &peak, stats.bytes, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void account_allocation(memory_shard * shard, long size) {
+	long chunks = atomic_load_explicit(&shard->total_chunks, memory_order_relaxed);
+
+	shard_add(&shard->chunks, 1);
+	shard_add(&shard->bytes, size);
+	shard_add(&shard->total_chunks, 1);
+	shard_add(&shard->total_bytes, size);
+
+	if (size >= PEAK_SAMPLE_SIZE || chunks % PEAK_SAMPLE_INTERVAL == 0) {
+		sample_peak();
+	}
+}
+
+// Size classes of the caching allocator are powers of two from
+// MIN_CLASS_SIZE to MIN_CLASS_SIZE << (SIZE_CLASSES - 1), that is 32 KB.
+// A thread keeps up to THREAD_CACHE_LIMIT free blocks per class and trades
+// batches of DEPOT_BATCH blocks with the shared depot beyond that. Chunks of
+// MAPPED_CHUNK_SIZE or more, like image arenas, are mapped directly in
+// multiples of MAPPED_CHUNK_SIZE. A thread keeps its last released mapping
+// for the next chunk of the same rounded size and unmaps the others, so
+// images of similar size reuse memory without piling up free heap.
+#define SIZE_CLASSES (12)
+#define MAPPED_CHUNK_SIZE (1024 * 1024)
+#define MIN_CLASS_SIZE (16)
+#define THREAD_CACHE_LIMIT (64)
+#define DEPOT_BATCH (32)
+#define ARENA_ALIGNMENT (sizeof(chunk_header))
+
+typedef struct free_block {
+	struct free_block * next;
+} free_block;
+
+typedef struct {
+	free_block * blocks[SIZE_CLASSES];
+	int counts[SIZE_CLASSES];
+	void * mapped_chunk;
+	size_t mapped_size;
+} thread_cache;
+
+struct arena_t {
+	// Current block, every block starts with a pointer to the previous one
+	byte * block;
+	size_t used;
+	size_t size;
+};
+
+static void * system_allocate(size_t size);
+static void system_release(void * memory, size_t size);
+static void * caching_allocate(size_t size);
+static void caching_release(void * memory, size_t size);
+
+const memory_allocator system_allocator = {"system", system_allocate, system_release};
+const memory_allocator caching_allocator = {"caching", caching_allocate, caching_release};
+static const memory_allocator * allocator = &system_allocator;
+
+static free_block * depot_blocks[SIZE_CLASSES];
+static int depot_counts[SIZE_CLASSES];
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cache_key;
+static __thread thread_cache * current_cache = NULL;
+
+void set_memory_allocator(const memory_allocator * new_allocator) {
+	allocator = new_allocator;
+}
+
+const memory_allocator * find_memory_allocator(const char * name) {
+	if (strcmp(name, system_allocator.name) == 0) return &system_allocator;
+	if (strcmp(name, caching_allocator.name) == 0) return &caching_allocator;
+	return NULL;
+}
+
+static void * system_allocate(size_t size) {
+	return malloc(size);
+}
+
+static void system_release(void * memory, size_t size) {
+	free(memory);
+}
+
+// Returns the smallest class holding size bytes or SIZE_CLASSES if none does
+static int size_class(size_t size) {
+	int class = 0;
+	while (class < SIZE_CLASSES && ((size_t)MIN_CLASS_SIZE << class) < size) class++;
+	return class;
+}
+
+// Moves up to count blocks of a class from the list at from to the list at to
+static int move_blocks(free_block ** from, free_block ** to, int count) {
+	free_block * block;
+	int moved = 0;
+
+	while (moved < count && *from != NULL) {
+		block = *from;
+		*from = block->next;
+		block->next = *to;
+		*to = block;
+		moved++;
+	}
+
+	return moved;
+}
+
+// Hands the blocks of an exiting thread to the depot
+static void release_thread_cache(void * memory) {
+	thread_cache * cache = memory;
+	int class;
+
+	pthread_mutex_lock(&depot_mutex);
+	for (class = 0; class < SIZE_CLASSES; class++) {
+		depot_counts[class] += move_blocks(&cache->blocks[class], &depot_blocks[class], cache->counts[class]);
+	}
+	pthread_mutex_unlock(&depot_mutex);
+
+	if (cache->mapped_chunk != NULL) {
+		munmap(cache->mapped_chunk, cache->mapped_size);
+	}
+
+	free(cache);
+	current_cache = NULL;
+}
+
+static void create_thread_cache_key() {
+	pthread_key_create(&thread_cache_key, release_thread_cache);
+}
+
+static thread_cache * get_thread_cache() {
+	if (current_cache == NULL) {
+		pthread_once(&thread_cache_once, create_thread_cache_key);
+		current_cache = calloc(1, sizeof(thread_cache));
+		if (current_cache == NULL) {
+			printf("ERROR: memory allocation failed, exit\n");
+			exit(1);
+		}
+		pthread_setspecific(thread_cache_key, current_cache);
+	}
+
+	return current_cache;
+}
+
+static size_t mapped_size(size_t size) {
+	return (size + MAPPED_CHUNK_SIZE - 1) / MAPPED_CHUNK_SIZE * MAPPED_CHUNK_SIZE;
+}
+
+static void * caching_allocate(size_t size) {
+	int class = size_class(size);
+	thread_cache * cache;
+	free_block * block;
+	void * chunk;
+
+	if (class == SIZE_CLASSES && size < MAPPED_CHUNK_SIZE) {
+		return malloc(size);
+	}
+
+	cache = get_thread_cache();
+	if (size >= MAPPED_CHUNK_SIZE) {
+		size = mapped_size(size);
+		if (cache->mapped_chunk != NULL && cache->mapped_size == size) {
+			chunk = cache->mapped_chunk;
+			cache->mapped_chunk = NULL;
+			return chunk;
+		}
+
+		chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return chunk == MAP_FAILED ? NULL : chunk;
+	}
+
+	if (cache->blocks[class] == NULL) {
+		// Refill from the depot, blocks freed by other threads end up there
+		pthread_mutex_lock(&depot_mutex);
+		if (depot_counts[class] > 0) {
+			cache->counts[class] = move_blocks(&depot_blocks[class], &cache->blocks[class], DEPOT_BATCH);
+			depot_counts[class] -= cache->counts[class];
+		}
+		pthread_mutex_unlock(&depot_mutex);
+
+		if (cache->blocks[class] == NULL) {
+			return malloc((size_t)MIN_CLASS_SIZE << class);
+		}
 	}
 
-	void * chunk = malloc(size);
+	block = cache->blocks[class];
+	cache->blocks[class] = block->next;
+	cache->counts[class]--;
+	return block;
+}
+
+static void caching_release(void * memory, size_t size) {
+	int class = size_class(size);
+	thread_cache * cache;
+	free_block * block = memory;
+
+	if (class == SIZE_CLASSES && size < MAPPED_CHUNK_SIZE) {
+		free(memory);
+		return;
+	}
+
+	cache = get_thread_cache();
+	if (size >= MAPPED_CHUNK_SIZE) {
+		if (cache->mapped_chunk != NULL) {
+			munmap(cache->mapped_chunk, cache->mapped_size);
+		}
+
+		cache->mapped_chunk = memory;
+		cache->mapped_size = mapped_size(size);
+		return;
+	}
+
+	block->next = cache->blocks[class];
+	cache->blocks[class] = block;
+	cache->counts[class]++;
+
+	if (cache->counts[class] > THREAD_CACHE_LIMIT) {
+		pthread_mutex_lock(&depot_mutex);
+		depot_counts[class] += move_blocks(&cache->blocks[class], &depot_blocks[class], DEPOT_BATCH);
+		pthread_mutex_unlock(&depot_mutex);
+		cache->counts[class] -= DEPOT_BATCH;
+	}
+}
+
+void * safe_malloc_uninitialized(size_t size) {
+	// A size the header can't be added to fails like any other allocation
+	chunk_header * chunk = size <= SIZE_MAX - sizeof(chunk_header) ? allocator->allocate(sizeof(chunk_header) + size) : NULL;
 	if (chunk == NULL) {
 		printf("ERROR: memory allocation failed, exit\n");
 		exit(1);
 	}
 
-	// increment number of created chunks
-	pthread_mutex_lock(&memory_mutex);
-	allocated_chunks++;
-	pthread_mutex_unlock(&memory_mutex);
+	chunk->size = size;
+	account_allocation(get_thread_shard(), size);
+
+	return chunk + 1;
+}
 
+void * safe_malloc(size_t size) {
+	void * chunk = safe_malloc_uninitialized(size);
 
 	// Set the memory chunk values to 0;
 	memset(chunk, 0, size);
@@ -42,22 +355,86 @@ void * safe_malloc(int size) {
 }
 
 void safe_free(void * chunk) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
+	chunk_header * header;
+	memory_shard * shard;
 
 	if (chunk != NULL) {
-		free(chunk);
-		chunk = NULL;
+		header = (chunk_header *)chunk - 1;
+		shard = get_thread_shard();
+
+		// decrement number of created chunks, the shard of the allocating
+		// thread may differ but only the sum of the shards matters
+		shard_add(&shard->chunks, -1);
+		shard_add(&shard->bytes, -(long)header->size);
+		allocator->release(header, sizeof(chunk_header) + header->size);
+	}
+}
+
+// Returns a + b, or SIZE_MAX when the sum wraps, which no allocation can get
+static size_t saturating_add(size_t a, size_t b) {
+	return a <= SIZE_MAX - b ? a + b : SIZE_MAX;
+}
+
+arena * arena_create(size_t size) {
+	arena * new_arena = safe_malloc(sizeof(arena));
+	new_arena->size = saturating_add(ARENA_ALIGNMENT, size);
+	new_arena->block = safe_malloc_uninitialized(new_arena->size);
+	*(byte **)new_arena->block = NULL;
+	new_arena->used = ARENA_ALIGNMENT;
+	return new_arena;
+}
+
+void * arena_malloc(arena * arena, size_t size, bool zero) {
+	size_t aligned_size = saturating_add(size, ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+	byte * chunk, * block;
+
+	if (aligned_size > arena->size - arena->used) {
+		// Chain a new block at least as large as the previous one
+		arena->size = saturating_add(ARENA_ALIGNMENT, aligned_size > arena->size ? aligned_size : arena->size);
+		block = safe_malloc_uninitialized(arena->size);
+		*(byte **)block = arena->block;
+		arena->block = block;
+		arena->used = ARENA_ALIGNMENT;
+	}
+
+	chunk = arena->block + arena->used;
+	arena->used += aligned_size;
+	if (zero) {
+		memset(chunk, 0, size);
+	}
+
+	return chunk;
+}
 
-		// decrement number of created chunks
-		pthread_mutex_lock(&memory_mutex);
-		allocated_chunks--;
-		pthread_mutex_unlock(&memory_mutex);
+char * arena_strdup(arena * arena, const char * str) {
+	size_t length = strlen(str) + 1;
+	char * dup = arena_malloc(arena, length, false);
+	memcpy(dup, str, length);
+	return dup;
+}
+
+void arena_destroy(arena * arena) {
+	byte * block, * previous;
+
+	if (arena == NULL) {
+		return;
 	}
+
+	for (block = arena->block; block != NULL; block = previous) {
+		previous = *(byte **)block;
+		safe_free(block);
+	}
+
+	safe_free(arena);
+}
+
+memory_stats get_memory_stats() {
+	memory_stats stats;
+
+	sample_peak();
+	sum_shards(&stats);
+	stats.peak_bytes = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
+	return stats;
 }
 
 FILE * safe_fopen(const char * file_name, const char * mode) {
@@ -79,24 +456,9 @@ void safe_fread(void * buffer, int size, FILE * stream) {
 }
 
 char * safe_strdup(const char * str) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	char * dup = strdup(str);
-	if (dup == NULL) {
-		printf("ERROR: duplicating string %s\n", str);
-		exit(1);
-	}
-
-	// increment number of created chunks
-	pthread_mutex_lock(&memory_mutex);
-	allocated_chunks++;
-	pthread_mutex_unlock(&memory_mutex);
-
+	size_t length = strlen(str) + 1;
+	char * dup = safe_malloc_uninitialized(length);
+	memcpy(dup, str, length);
 	return dup;
 }
 
@@ -108,62 +470,8 @@ void safe_pthread_create(pthread_t * thread, const pthread_attr_t * attr, void *
 	}
 }
 
-void write_log2(const char * msg, ...) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	if (!logging_enabled) {
-		return;
-	}
-
-	char buffer[MAX_LOG_LINE];
-	va_list format_args;
-	FILE * file_stream;
-
-	// Format input message
-	va_start(format_args, msg);
-	vsprintf(buffer, msg, format_args);
-	va_end(format_args);
-
-	pthread_mutex_lock(&logging_mutex);
-	file_stream = safe_fopen("log.txt", "a");
-	fprintf(file_stream, buffer);
-	fclose(file_stream);
-	pthread_mutex_unlock(&logging_mutex);
-}
-
-void write_log1(const char * func, const char * msg, ...) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	if (!logging_enabled) {
-		return;
-	}
-
-	char buffer1[MAX_LOG_LINE];
-	char buffer2[MAX_LOG_LINE];
-	va_list format_args;
-	FILE * file_stream;
-
-	// Format input message
-	va_start(format_args, msg);
-	vsprintf(buffer1, msg, format_args);
-	va_end(format_args);
-
-	// Format time
-	sprintf(buffer2, "[%s] %s\n", func, buffer1);
-
-	pthread_mutex_lock(&logging_mutex);
-	file_stream = safe_fopen("log.txt", "a");
-	fprintf(file_stream, buffer2);
-	fclose(file_stream);
-	pthread_mutex_unlock(&logging_mutex);
+long long time_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
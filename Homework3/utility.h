@@ -1,6 +1,8 @@
 #ifndef _UTILITY_H_
 #define _UTILITY_H_
 
+#include "logger.h"
+
 #define true (1)
 #define false (0)
 #define BITS_PER_BYTE (8)
@@ -8,14 +10,61 @@
 typedef int bool;
 typedef unsigned char byte;
 
-extern int allocated_chunks;
+// Allocation statistics kept by safe_malloc, safe_free and safe_strdup
+typedef struct {
+	long chunks;       // chunks currently allocated
+	long bytes;        // bytes currently allocated
+	long peak_bytes;   // highest number of bytes allocated at once, sampled
+	long total_chunks; // chunks allocated since the start
+	long total_bytes;  // bytes allocated since the start
+} memory_stats;
+
+// Backend used by safe_malloc and safe_free to get raw memory. release
+// receives the same size that was passed to allocate.
+typedef struct {
+	const char * name;
+	void * (*allocate)(size_t size);
+	void (*release)(void * memory, size_t size);
+} memory_allocator;
+
+// Bump allocator whose chunks are all released at once by arena_destroy
+typedef struct arena_t arena;
 
 /* MEMORY MANAGEMENT APIs */
 
-void * safe_malloc(int size);
+// Plain malloc and free
+extern const memory_allocator system_allocator;
+
+// Per-thread caches of power of two size classes up to 32 KB, backed by a
+// shared depot, malloc for larger sizes and mmap from 1 MB on
+extern const memory_allocator caching_allocator;
+
+// Selects the allocator used by safe_malloc, must be called before the first allocation
+void set_memory_allocator(const memory_allocator * allocator);
+
+// Returns the allocator with the given name or NULL
+const memory_allocator * find_memory_allocator(const char * name);
+
+void * safe_malloc(size_t size);
+
+// Same as safe_malloc without zeroing the chunk, for buffers that are fully written
+void * safe_malloc_uninitialized(size_t size);
 
 void safe_free(void * chunk);
 
+memory_stats get_memory_stats();
+
+// Creates an arena whose first block holds size bytes
+arena * arena_create(size_t size);
+
+// Allocates size bytes from the arena, zeroed unless zero is false
+void * arena_malloc(arena * arena, size_t size, bool zero);
+
+char * arena_strdup(arena * arena, const char * str);
+
+// Releases every chunk allocated from the arena and the arena itself
+void arena_destroy(arena * arena);
+
 /* DISK MANAGEMENT APIs */
 
 FILE * safe_fopen(const char * file_name, const char * mode);
@@ -28,12 +77,9 @@ char * safe_strdup(const char * str);
 
 void safe_pthread_create(pthread_t * thread, const pthread_attr_t * attr, void * (*start_routine) (void *), void *arg);
 
-/* LOGGING MANAGEMENT APIs */
-
-void write_log1(const char * func, const char * msg, ...);
-
-void write_log2(const char * msg, ...);
+/* TIME MANAGEMENT APIs */
 
-#define LOG_MSG(format, ...) write_log1(__FUNCTION__, format, __VA_ARGS__)
+// Returns a monotonic timestamp in microseconds
+long long time_us();
 
 #endif // _UTILITY_H_
@@ -0,0 +1,112 @@
+// Measures how many virtual addresses per second are split into page number
+// and offset by the original pow() based get_bits, by the shift based
+// get_bits and by page_offset and page_number. Build from Homework4/benchmark with:
+//   gcc -O2 -o decode_benchmark decode_benchmark.c ../page_manager.c ../replacement_policies.c
+//       ../tlb.c ../logger.c ../utility.c -lpthread -lm
+// Add -DFIXED_PAGE_SIZE=<bytes> to measure the constant decoder, only that
+// page size is then measured.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "../page_manager.h"
+
+#define ADDRESSES (1 << 20)
+#define ROUNDS (5)
+
+typedef unsigned int (*decoder)(unsigned int virtual_address, unsigned int * offset);
+
+static unsigned int addresses[ADDRESSES];
+
+// Page manager whose decoding is measured
+static os_memory_info * info;
+
+// get_bits as it was, one bit and one pow() call at a time
+static unsigned int pow_get_bits(unsigned int n, unsigned int start, unsigned count) {
+	unsigned int result = 0;
+	int k = start;
+	int i;
+	for (i = 0; i < count; i++, k++) {
+		result += ((n >> k)  & 1) * pow(2, i);
+	}
+
+	return result;
+}
+
+static unsigned int decode_pow(unsigned int virtual_address, unsigned int * offset) {
+	*offset = pow_get_bits(virtual_address, 0, info->offset_bits_count);
+	return pow_get_bits(virtual_address, info->offset_bits_count, info->virtual_page_number_bits_count);
+}
+
+static unsigned int decode_get_bits(unsigned int virtual_address, unsigned int * offset) {
+	*offset = get_bits(virtual_address, 0, info->offset_bits_count);
+	return get_bits(virtual_address, info->offset_bits_count, info->virtual_page_number_bits_count);
+}
+
+static unsigned int decode_masks(unsigned int virtual_address, unsigned int * offset) {
+	*offset = page_offset(info, virtual_address);
+	return page_number(info, virtual_address);
+}
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Returns the best rate of ROUNDS decodings of every address, in addresses/s,
+// and adds the decoded values to checksum. Inlined with its decoder so the
+// loop measures the decoding, not the call.
+static inline __attribute__((always_inline)) double measure(decoder decode, unsigned long long * checksum) {
+	double best = 0, start, rate;
+	unsigned int offset;
+	int round, i;
+
+	for (round = 0; round < ROUNDS; round++) {
+		start = now();
+		for (i = 0; i < ADDRESSES; i++) {
+			*checksum += decode(addresses[i], &offset) ^ offset;
+		}
+		rate = ADDRESSES / (now() - start);
+		best = rate > best ? rate : best;
+	}
+
+	return best;
+}
+
+int main(int argc, char * argv[]) {
+#ifdef FIXED_PAGE_SIZE
+	unsigned int page_sizes[] = { FIXED_PAGE_SIZE };
+#else
+	unsigned int page_sizes[] = { 512, 2048, 4096, 65536 };
+#endif
+	unsigned int seed = 1;
+	unsigned long long checksums[3];
+	double rates[3];
+	int s, i;
+
+	for (i = 0; i < ADDRESSES; i++) {
+		seed = seed * 1103515245 + 12345;
+		addresses[i] = seed;
+	}
+
+	printf("%9s %16s %16s %16s\n", "page size", "pow get_bits/s", "get_bits/s", "masks/s");
+	for (s = 0; s < sizeof(page_sizes) / sizeof(page_sizes[0]); s++) {
+		info = initialize_page_manager((memory_config){ 24, 32, page_sizes[s], 1 });
+
+		checksums[0] = checksums[1] = checksums[2] = 0;
+		rates[0] = measure(decode_pow, &checksums[0]);
+		rates[1] = measure(decode_get_bits, &checksums[1]);
+		rates[2] = measure(decode_masks, &checksums[2]);
+
+		printf("%9u %16.0f %16.0f %16.0f\n", page_sizes[s], rates[0], rates[1], rates[2]);
+		if (checksums[0] != checksums[1] || checksums[0] != checksums[2]) {
+			printf("ERROR: the decoders disagree.\n");
+			return EXIT_FAILURE;
+		}
+
+		destroy_page_manager(info);
+	}
+
+	return EXIT_SUCCESS;
+}
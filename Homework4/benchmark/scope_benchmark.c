@@ -0,0 +1,95 @@
+// Replays a trace of four processes with different behaviors under local
+// replacement with every frame allocation and under global replacement, and
+// prints the fault rate and mean frames of every process. Build from
+// Homework4/benchmark with:
+//   gcc -O2 -o scope_benchmark scope_benchmark.c ../page_manager.c ../replacement_policies.c
+//       ../tlb.c ../logger.c ../utility.c -lpthread
+// and run with an optional policy name, lru by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include "../page_manager.h"
+
+#define PROCESSES (4)
+#define ACCESSES (4000000)
+// Accesses a process makes before the next one runs
+#define QUANTUM (1000)
+#define PAGE_SIZE (4096)
+// 4096 frames
+#define PHYSICAL_BITS (24)
+
+static memory_access trace[ACCESSES];
+
+// Returns the next virtual page of process pid, whose i-th access it is.
+// Processes 0 and 1 swap their needs halfway.
+static unsigned int next_page(unsigned int pid, unsigned int i, unsigned int * seed) {
+	bool second_half = i >= ACCESSES / PROCESSES / 2;
+
+	*seed = *seed * 1103515245 + 12345;
+	switch (pid) {
+	case 0:
+		// Loops over 1536 pages, then over 128
+		return i % (second_half ? 128 : 1536);
+	case 1:
+		// Loops over 256 pages, then random pages among 1536
+		return second_half ? (*seed >> 8) % 1536 : i % 256;
+	case 2:
+		// Random pages among 1024
+		return (*seed >> 8) % 1024;
+	default:
+		// Scans pages it never comes back to
+		return i;
+	}
+}
+
+int main(int argc, char * argv[]) {
+	const replacement_policy * policy = argc > 1 ? find_replacement_policy(argv[1]) : &lru_policy;
+	memory_config configs[] = {
+		{ PHYSICAL_BITS, 32, PAGE_SIZE, PROCESSES, policy, 0, 0, true, LOCAL_REPLACEMENT, ALLOCATE_ON_DEMAND },
+		{ PHYSICAL_BITS, 32, PAGE_SIZE, PROCESSES, policy, 0, 0, true, LOCAL_REPLACEMENT, ALLOCATE_WORKING_SET },
+		{ PHYSICAL_BITS, 32, PAGE_SIZE, PROCESSES, policy, 0, 0, true, LOCAL_REPLACEMENT, ALLOCATE_FAULT_FREQUENCY },
+		{ PHYSICAL_BITS, 32, PAGE_SIZE, PROCESSES, policy, 0, 0, true, GLOBAL_REPLACEMENT, ALLOCATE_ON_DEMAND },
+	};
+	const char * names[] = { "local, demand", "local, ws", "local, pff", "global" };
+	unsigned int accesses[PROCESSES] = { 0 }, seed = 1, pid, i, c;
+	os_memory_info * info;
+	long long start;
+
+	if (policy == NULL) {
+		printf("ERROR: unknown policy %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ACCESSES; i++) {
+		pid = i / QUANTUM % PROCESSES;
+		trace[i].pid = pid;
+		trace[i].virtual_address = next_page(pid, accesses[pid]++, &seed) * PAGE_SIZE;
+	}
+
+	printf("%s, %d processes sharing %d frames, %d accesses\n", policy->name, PROCESSES, (1 << PHYSICAL_BITS) / PAGE_SIZE, ACCESSES);
+	printf("%-14s %11s", "scope", "fault rate");
+	for (pid = 0; pid < PROCESSES; pid++) {
+		printf("  %3u faults/frames", pid);
+	}
+	printf(" %9s\n", "seconds");
+
+	for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		info = initialize_page_manager(configs[c]);
+		set_future_accesses(info, trace, ACCESSES);
+
+		start = time_ns();
+		for (i = 0; i < ACCESSES; i++) {
+			access_memory(info, trace[i].pid, trace[i].virtual_address, false);
+		}
+
+		printf("%-14s %10.2f%%", names[c], 100.0 * info->page_faults / ACCESSES);
+		for (pid = 0; pid < PROCESSES; pid++) {
+			printf(" %9.2f%% %7.0f", 100.0 * info->processes[pid].page_faults / info->processes[pid].accesses,
+				   (double)info->processes[pid].resident_sum / info->processes[pid].accesses);
+		}
+		printf(" %9.3f\n", (time_ns() - start) / 1e9);
+
+		destroy_page_manager(info);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+// Measures how the recency of a page is recorded: the original time_now,
+// which read CLOCK_MONOTONIC and time() on every access, against the access
+// counters that replaced it. Stamps the pages of the access4 pattern of
+// main.c and scans a page table for its oldest page, with the original
+// smaller_than for the clock stamps. Build from Homework4/benchmark with:
+//   gcc -O2 -o stamp_benchmark stamp_benchmark.c ../logger.c ../utility.c -lpthread
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../utility.h"
+
+#define PROCESSES (2)
+// Pages of every process of access4, 24 bits spaces of 2048 byte pages
+#define PAGES (8192)
+#define PAGE_SIZE (2048)
+#define ACCESSES (1 << 22)
+#define SCANS (256)
+#define ROUNDS (5)
+
+// The former stamp of a page
+typedef struct {
+	time_t time;
+	struct timespec sec;
+} time_spec;
+
+// Virtual page number of every access, made by process i % PROCESSES
+static unsigned int pages[ACCESSES];
+static time_spec clock_stamps[PROCESSES][PAGES];
+static unsigned long long counter_stamps[PROCESSES][PAGES];
+static unsigned long long counters[PROCESSES];
+// Victims of the scans, so they aren't optimized away
+static volatile unsigned int victims;
+
+// time_now as it was
+static void time_now(time_spec * time_var) {
+	clock_gettime(CLOCK_MONOTONIC, &time_var->sec);
+	time(&time_var->time);
+}
+
+// smaller_than as it was, true when any of the fields is smaller
+static bool smaller_than(time_spec left, time_spec right) {
+	double time_diff, sec_diff, nano_diff;
+	time_diff = difftime(left.time, right.time);
+	sec_diff = difftime(left.sec.tv_sec, right.sec.tv_sec);
+	nano_diff = left.sec.tv_nsec - right.sec.tv_nsec;
+
+	return time_diff < 0 ||
+		   sec_diff < 0 ||
+		   nano_diff < 0;
+}
+
+static void stamp_clock(unsigned int i) {
+	time_now(&clock_stamps[i % PROCESSES][pages[i]]);
+}
+
+static void stamp_counter(unsigned int i) {
+	counter_stamps[i % PROCESSES][pages[i]] = counters[i % PROCESSES]++;
+}
+
+static unsigned int oldest_clock(unsigned int pid) {
+	unsigned int oldest = 0, vpn;
+
+	for (vpn = 1; vpn < PAGES; vpn++) {
+		if (smaller_than(clock_stamps[pid][vpn], clock_stamps[pid][oldest])) {
+			oldest = vpn;
+		}
+	}
+	return oldest;
+}
+
+static unsigned int oldest_counter(unsigned int pid) {
+	unsigned int oldest = 0, vpn;
+
+	for (vpn = 1; vpn < PAGES; vpn++) {
+		if (counter_stamps[pid][vpn] < counter_stamps[pid][oldest]) {
+			oldest = vpn;
+		}
+	}
+	return oldest;
+}
+
+// Returns the best time of ROUNDS stampings of every access, in ns per stamp
+static double measure_stamps(void (*stamp)(unsigned int)) {
+	long long start, elapsed, best = 0;
+	unsigned int i;
+	int round;
+
+	for (round = 0; round < ROUNDS; round++) {
+		start = time_ns();
+		for (i = 0; i < ACCESSES; i++) {
+			stamp(i);
+		}
+		elapsed = time_ns() - start;
+		best = round == 0 || elapsed < best ? elapsed : best;
+	}
+
+	return (double)best / ACCESSES;
+}
+
+// Returns the best time of ROUNDS runs of SCANS scans, in ns per scan
+static double measure_scans(unsigned int (*oldest)(unsigned int)) {
+	long long start, elapsed, best = 0;
+	int round, i;
+
+	for (round = 0; round < ROUNDS; round++) {
+		start = time_ns();
+		for (i = 0; i < SCANS; i++) {
+			victims += oldest(i % PROCESSES);
+		}
+		elapsed = time_ns() - start;
+		best = round == 0 || elapsed < best ? elapsed : best;
+	}
+
+	return (double)best / SCANS;
+}
+
+int main() {
+	unsigned int i;
+
+	// The addresses of access4, unsigned so the product wraps modulo 2^32,
+	// a multiple of the space
+	for (i = 0; i < ACCESSES; i++) {
+		pages[i] = i * (i % 2 + 1) * 512 % (PAGES * PAGE_SIZE) / PAGE_SIZE;
+	}
+
+	printf("access4 pattern, %d processes of %d pages, %d accesses\n", PROCESSES, PAGES, ACCESSES);
+	printf("%-8s %10s %10s\n", "stamps", "ns/stamp", "ns/scan");
+	printf("%-8s %10.1f %10.0f\n", "clock", measure_stamps(stamp_clock), measure_scans(oldest_clock));
+	printf("%-8s %10.1f %10.0f\n", "counter", measure_stamps(stamp_counter), measure_scans(oldest_counter));
+
+	return EXIT_SUCCESS;
+}
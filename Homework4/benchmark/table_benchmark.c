@@ -0,0 +1,135 @@
+// Replays a dense, a clustered and a sparse random trace of two processes
+// and prints the memory taken by the page tables and the best time per access
+// of 3 replays.
+// Build from Homework4/benchmark with:
+//   gcc -O2 -o table_benchmark table_benchmark.c ../page_manager.c ../replacement_policies.c
+//       ../tlb.c ../logger.c ../utility.c -lpthread
+// for radix page tables, and add -DFLAT_PAGE_TABLES for one flat table per
+// process to compare with.
+#include <stdio.h>
+#include <stdlib.h>
+#include "../page_manager.h"
+
+#define PROCESSES (2)
+#define ACCESSES (2000000)
+// Accesses a process makes before the other one runs
+#define QUANTUM (1000)
+// Contiguous runs of pages of every process in the clustered trace
+#define CLUSTERS (32)
+#define CLUSTER_PAGES (64)
+// Pages of every process in the random trace
+#define RANDOM_PAGES (4096)
+// Replays of every trace, the fastest is reported
+#define REPEATS (3)
+
+typedef enum {
+	DENSE_TRACE,
+	CLUSTERED_TRACE,
+	RANDOM_TRACE
+} trace_kind;
+
+typedef struct {
+	const char * name;
+	trace_kind kind;
+	unsigned int physical_bits;
+	unsigned int virtual_bits;
+	unsigned int page_size;
+} trace_config;
+
+static const trace_config traces[] = {
+	{ "dense", DENSE_TRACE, 24, 24, 2048 },
+	{ "clustered", CLUSTERED_TRACE, 24, 31, 512 },
+	{ "random", RANDOM_TRACE, 24, 31, 512 },
+};
+#define TRACES (sizeof(traces) / sizeof(traces[0]))
+
+static memory_access trace[ACCESSES];
+// First page of every cluster, or every page of the random trace, per process
+static unsigned int bases[PROCESSES][RANDOM_PAGES];
+
+static unsigned int next_random(unsigned int * seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+// Fills trace with the accesses of kind in a virtual space of pages pages
+static void generate_trace(trace_kind kind, unsigned int pages, unsigned int page_size) {
+	unsigned int seed = 1, pid, i, page;
+
+	for (pid = 0; pid < PROCESSES; pid++) {
+		for (i = 0; i < RANDOM_PAGES; i++) {
+			// Clusters start at a multiple of their size, so they don't overlap
+			bases[pid][i] = kind == CLUSTERED_TRACE ? next_random(&seed) % (pages / CLUSTER_PAGES) * CLUSTER_PAGES
+												   : (next_random(&seed) << 8 ^ next_random(&seed)) % pages;
+		}
+	}
+
+	for (i = 0; i < ACCESSES; i++) {
+		pid = i / QUANTUM % PROCESSES;
+		switch (kind) {
+		case DENSE_TRACE:
+			// Any page of the whole space
+			page = next_random(&seed) % pages;
+			break;
+		case CLUSTERED_TRACE:
+			page = bases[pid][next_random(&seed) % CLUSTERS] + next_random(&seed) % CLUSTER_PAGES;
+			break;
+		default:
+			page = bases[pid][next_random(&seed) % RANDOM_PAGES];
+			break;
+		}
+		trace[i].pid = pid;
+		trace[i].virtual_address = page * page_size + next_random(&seed) % page_size;
+		trace[i].write = false;
+	}
+}
+
+int main() {
+	memory_config config = { 0 };
+	os_memory_info * info;
+	long long start, elapsed, best;
+	unsigned int t, i, r, pid;
+
+#ifdef FLAT_PAGE_TABLES
+	printf("Flat page tables, ");
+#else
+	printf("Radix page tables, ");
+#endif
+	printf("%d processes, %d accesses, LRU\n", PROCESSES, ACCESSES);
+	printf("%-10s %9s %10s %6s %10s %12s %10s\n", "trace", "phys bits", "virt bits", "levels", "page size", "table MB", "ns/access");
+
+	for (t = 0; t < TRACES; t++) {
+		config.physical_address_space = traces[t].physical_bits;
+		config.virtual_address_space = traces[t].virtual_bits;
+		config.page_size = traces[t].page_size;
+		config.processes = PROCESSES;
+		generate_trace(traces[t].kind, (1u << traces[t].virtual_bits) / traces[t].page_size, traces[t].page_size);
+
+		best = 0;
+		for (r = 0; r < REPEATS; r++) {
+			info = initialize_page_manager(config);
+			// Untimed, so a flat table is allocated and zeroed before the
+			// replay like it used to be at initialization
+			for (pid = 0; pid < PROCESSES; pid++) {
+				access_memory(info, pid, 0, false);
+			}
+
+			start = time_ns();
+			for (i = 0; i < ACCESSES; i++) {
+				access_memory(info, trace[i].pid, trace[i].virtual_address, trace[i].write);
+			}
+			elapsed = time_ns() - start;
+			best = r == 0 || elapsed < best ? elapsed : best;
+
+			if (r < REPEATS - 1) {
+				destroy_page_manager(info);
+			}
+		}
+
+		printf("%-10s %9u %10u %6u %10u %12.1f %10.1f\n", traces[t].name, traces[t].physical_bits, traces[t].virtual_bits,
+			   info->page_table_levels, traces[t].page_size, info->page_table_bytes / (1024.0 * 1024.0), (double)best / ACCESSES);
+		destroy_page_manager(info);
+	}
+
+	return EXIT_SUCCESS;
+}
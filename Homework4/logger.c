@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "utility.h"
+
+// Every thread formats its records into its own ring buffer, which has a
+// single producer (the thread) and a single consumer (the writer thread),
+// so logging takes no lock and does no I/O. Rings are kept on a list that
+// is only ever prepended to; rings of exited threads are reused with the
+// records they still hold. When a ring is full the thread waits a few writer
+// passes for room and drops the record if it still doesn't fit.
+#define CACHE_LINE_SIZE (64)
+#define LOG_RING_SIZE (1024) // records per thread, a power of two
+#define LOG_TEXT_SIZE (232)
+#define LOG_LINE_SIZE (LOG_TEXT_SIZE + 128)
+#define WRITE_BUFFER_SIZE (64 * 1024)
+#define WRITER_IDLE_NS (200000)
+#define FULL_RING_RETRIES (16)
+
+typedef struct {
+	struct timespec time;
+	const char * func;
+	int level;
+	int thread_id;
+	char text[LOG_TEXT_SIZE];
+} log_record;
+
+typedef struct log_ring {
+	// Next record to fill, only written by the owner thread
+	atomic_ulong head __attribute__((aligned(CACHE_LINE_SIZE)));
+	// Next record to write out, only written by the writer thread
+	atomic_ulong tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	atomic_int in_use;
+	// List of every ring ever created
+	struct log_ring * next;
+	log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static const char * level_names[] = { "NONE", "ERROR", "WARNING", "INFO", "DEBUG" };
+
+static _Atomic(log_ring *) log_rings = NULL;
+static __thread log_ring * thread_ring = NULL;
+static __thread int thread_id = 0;
+static atomic_int thread_count = 0;
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static pthread_t writer_thread;
+static atomic_int stopping = false;
+static atomic_llong written = 0;
+static atomic_llong dropped = 0;
+static int log_fd = -1;
+
+static void release_ring(void * ring) {
+	atomic_store_explicit(&((log_ring *)ring)->in_use, false, memory_order_release);
+	thread_ring = NULL;
+}
+
+// Takes over a ring released by an exited thread or creates a new one
+static log_ring * acquire_ring() {
+	log_ring * ring;
+	int unused;
+
+	for (ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+		unused = false;
+		if (atomic_compare_exchange_strong(&ring->in_use, &unused, true)) {
+			break;
+		}
+	}
+
+	if (ring == NULL) {
+		// Allocated outside of safe_malloc so logging doesn't show in the memory statistics
+		ring = calloc(1, sizeof(log_ring));
+		if (ring == NULL) {
+			return NULL;
+		}
+
+		ring->in_use = true;
+		ring->next = atomic_load(&log_rings);
+		while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+	}
+
+	thread_id = atomic_fetch_add(&thread_count, 1) + 1;
+	pthread_setspecific(log_ring_key, ring);
+	return ring;
+}
+
+// Formats the pending records of ring into buffer, writing it out when full.
+// Returns the number of records drained.
+static int drain_ring(log_ring * ring, char * buffer, int * length) {
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	int count = head - tail, line_length;
+
+	for (; tail != head; tail++) {
+		log_record * record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+
+		if (*length + LOG_LINE_SIZE > WRITE_BUFFER_SIZE) {
+			if (write(log_fd, buffer, *length) < 0) {
+				perror("WARNING: unable to write log file");
+			}
+			*length = 0;
+		}
+
+		line_length = snprintf(buffer + *length, LOG_LINE_SIZE, "%ld.%06ld T%d %s [%s] %s\n",
+							   (long)record->time.tv_sec, record->time.tv_nsec / 1000, record->thread_id,
+							   level_names[record->level], record->func, record->text);
+		if (line_length < 0) {
+			// Nothing usable was written, the record is lost
+			continue;
+		}
+		if (line_length >= LOG_LINE_SIZE) {
+			// Truncated by a very long function name, keep what fits and end the line
+			line_length = LOG_LINE_SIZE - 1;
+			buffer[*length + line_length - 1] = '\n';
+		}
+		*length += line_length;
+	}
+
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	return count;
+}
+
+static void * write_records(void * arg) {
+	static char buffer[WRITE_BUFFER_SIZE];
+	struct timespec idle = { 0, WRITER_IDLE_NS };
+	log_ring * ring;
+	int count, length;
+
+	while (true) {
+		bool stop = atomic_load(&stopping);
+
+		count = 0;
+		length = 0;
+		for (ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+			count += drain_ring(ring, buffer, &length);
+		}
+
+		if (length > 0 && write(log_fd, buffer, length) < 0) {
+			perror("WARNING: unable to write log file");
+		}
+		atomic_fetch_add(&written, count);
+
+		if (count == 0) {
+			// Records logged before stopping was seen are drained by this last pass
+			if (stop) {
+				break;
+			}
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static void start_logger() {
+	int rv;
+
+	log_fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (log_fd < 0) {
+		printf("ERROR: unable to open file %s.\n", LOG_FILE);
+		exit(1);
+	}
+
+	pthread_key_create(&log_ring_key, release_ring);
+	rv = pthread_create(&writer_thread, NULL, write_records, NULL);
+	if (rv != 0) {
+		printf("ERROR: unable to create new thread.\n");
+		exit(1);
+	}
+
+	atexit(flush_log);
+}
+
+void write_log(int level, const char * func, const char * format, ...) {
+	log_record * record;
+	unsigned long head;
+	struct timespec wait = { 0, WRITER_IDLE_NS };
+	int retries;
+	va_list format_args;
+
+	pthread_once(&logger_once, start_logger);
+
+	if (thread_ring == NULL) {
+		thread_ring = acquire_ring();
+	}
+
+	if (thread_ring == NULL || atomic_load_explicit(&stopping, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	head = atomic_load_explicit(&thread_ring->head, memory_order_relaxed);
+	for (retries = 0; head - atomic_load_explicit(&thread_ring->tail, memory_order_acquire) == LOG_RING_SIZE; retries++) {
+		if (retries == FULL_RING_RETRIES) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+		nanosleep(&wait, NULL);
+	}
+
+	record = &thread_ring->records[head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->func = func;
+	record->level = level;
+	record->thread_id = thread_id;
+
+	// Messages longer than a record are truncated
+	va_start(format_args, format);
+	vsnprintf(record->text, LOG_TEXT_SIZE, format, format_args);
+	va_end(format_args);
+
+	atomic_store_explicit(&thread_ring->head, head + 1, memory_order_release);
+}
+
+void flush_log() {
+	int not_stopped = false;
+
+	// Only the first call stops the writer, the logger is never started again
+	if (log_fd < 0 || !atomic_compare_exchange_strong(&stopping, &not_stopped, true)) {
+		return;
+	}
+
+	pthread_join(writer_thread, NULL);
+	close(log_fd);
+
+	if (atomic_load(&dropped) > 0) {
+		fprintf(stderr, "WARNING: %lld log record(s) dropped, the thread buffers were full\n", (long long)atomic_load(&dropped));
+	}
+}
+
+log_stats get_log_stats() {
+	log_stats stats;
+	stats.written = atomic_load(&written);
+	stats.dropped = atomic_load(&dropped);
+	return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+// Log levels, a message is kept when its level is at most LOG_LEVEL
+#define LOG_LEVEL_NONE (0)
+#define LOG_LEVEL_ERROR (1)
+#define LOG_LEVEL_WARNING (2)
+#define LOG_LEVEL_INFO (3)
+#define LOG_LEVEL_DEBUG (4)
+
+// Compile with -DLOG_LEVEL=LOG_LEVEL_DEBUG to enable logging. Calls above
+// the level are dead code the compiler removes, their arguments are never
+// evaluated but are still type checked.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_NONE
+#endif
+
+// File the background writer appends to
+#define LOG_FILE "log.txt"
+
+// Statistics of the logger since the start
+typedef struct {
+	long long written;  // records written to the log file
+	long long dropped;  // records lost because the thread ring was full
+} log_stats;
+
+// Formats a record into the ring buffer of the calling thread without
+// locking, blocking or doing any I/O. The first call starts the writer thread.
+void write_log(int level, const char * func, const char * format, ...) __attribute__((format(printf, 3, 4)));
+
+// Writes every pending record and stops the writer thread, also registered
+// with atexit.
+void flush_log();
+
+log_stats get_log_stats();
+
+#define LOG_AT(level, format, ...) \
+	do { \
+		if ((level) <= LOG_LEVEL) write_log((level), __FUNCTION__, format, ##__VA_ARGS__); \
+	} while (0)
+
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARNING(format, ...) LOG_AT(LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+// Tracing of the hot paths
+#define LOG_MSG(format, ...) LOG_DEBUG(format, ##__VA_ARGS__)
+
+#endif // _LOGGER_H_
@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
 #include "page_manager.h"
+#include "trace.h"
+#include "sweep.h"
+#include "miss_ratio.h"
 #include "utility.h"
 
 struct access {
@@ -9,70 +15,799 @@ struct access {
 	unsigned int virtual_address;
 };
 
-struct access access1();
-struct access access2();
-struct access access3();
-struct access access4();
+// Every access function returns the i-th access of its trace
+struct access access1(int i);
+struct access access2(int i);
+struct access access3(int i);
+struct access access4(int i);
 
 static struct sim {
 	memory_config config;
-	struct access (*access_func)();
+	struct access (*access_func)(int i);
 } simulations[] = {{{12, 16, 512, 1}, access1},
                    {{14, 10, 128, 1}, access2},
                    {{10, 16, 64, 2}, access3},
-                   {{24, 24, 2048, 2}, access4}};
+                   {{24, 24, 2048, 2}, access4},
+                   // access4 with every replacement policy
+                   {{24, 24, 2048, 2, &clock_policy}, access4},
+                   {{24, 24, 2048, 2, &second_chance_policy}, access4},
+                   {{24, 24, 2048, 2, &two_queue_policy}, access4},
+                   {{24, 24, 2048, 2, &arc_policy}, access4},
+                   {{24, 24, 2048, 2, &lfu_policy}, access4},
+                   {{24, 24, 2048, 2, &opt_policy}, access4},
+                   // TLBs in front of the page tables
+                   {{10, 16, 64, 2, NULL, 8, 0, true}, access3},
+                   {{24, 24, 2048, 2, NULL, 64, 4, true}, access4},
+                   {{24, 24, 2048, 2, NULL, 64, 4, false}, access4}};
 
+#define SIMULATIONS_COUNT (sizeof(simulations) / sizeof(simulations[0]))
+
+// Simulations 0 to ASSIGNMENT_SIMULATIONS - 1 come with the assignment and
+// print only the lines it shows, the others their whole configuration and a summary
+#define ASSIGNMENT_SIMULATIONS (4)
+
+// Simulations run when no trace file is given, -S overrides them
 #define FIRST_SIMULATION_TO_RUN 0
 #define LAST_SIMULATION_TO_RUN 0
 
-void run_simulation(struct sim simulation) {
+// Values a comma separated option can list
+#define SWEEP_VALUES (32)
+
+// Values of the options swept over, every combination is replayed
+typedef struct {
+	const replacement_policy * policies[SWEEP_VALUES];
+	unsigned int policies_count;
+	unsigned int page_sizes[SWEEP_VALUES];
+	unsigned int page_sizes_count;
+	unsigned int physical_bits[SWEEP_VALUES];
+	unsigned int physical_bits_count;
+} sweep_values;
+
+void show_usage(const char * exe);
+
+void print_address_config(memory_config config);
+void print_scope_config(memory_config config);
+void print_tlb_config(memory_config config);
+void print_io_config(memory_config config);
+void print_huge_page_config(memory_config config);
+void print_huge_page_comparison(const os_memory_info * base, const os_memory_info * huge, unsigned long long count);
+
+void print_config(memory_config config) {
+	print_address_config(config);
+	printf("    Replacement policy: %s\n", config.policy == NULL ? lru_policy.name : config.policy->name);
+	print_scope_config(config);
+	print_tlb_config(config);
+	print_huge_page_config(config);
+	print_io_config(config);
+}
+
+void print_address_config(memory_config config) {
+	printf("Physical address space: %u bits\n", config.physical_address_space);
+	printf(" Virtual address space: %u bits\n", config.virtual_address_space);
+	printf("             Page size: %u bytes\n", config.page_size);
+	printf("             Processes: %u\n", config.processes);
+}
+
+void print_scope_config(memory_config config) {
+	if (config.replacement_scope == GLOBAL_REPLACEMENT) {
+		printf("     Replacement scope: global\n");
+	} else if (config.frame_allocation == ALLOCATE_WORKING_SET) {
+		printf("     Replacement scope: local, frames for a working set window of %u accesses\n",
+			   config.working_set_window == 0 ? WORKING_SET_WINDOW : config.working_set_window);
+	} else if (config.frame_allocation == ALLOCATE_FAULT_FREQUENCY) {
+		printf("     Replacement scope: local, frames for faults between %u and %u accesses apart\n",
+			   config.fault_interval_low == 0 && config.fault_interval_high == 0 ? FAULT_INTERVAL_LOW : config.fault_interval_low,
+			   config.fault_interval_low == 0 && config.fault_interval_high == 0 ? FAULT_INTERVAL_HIGH : config.fault_interval_high);
+	} else {
+		printf("     Replacement scope: local, frames on demand\n");
+	}
+}
+
+void print_tlb_config(memory_config config) {
+	if (config.tlb_entries == 0) {
+		printf("                   TLB: none\n");
+	} else {
+		printf("                   TLB: %u entries, ", config.tlb_entries);
+		if (config.tlb_ways == 0) {
+			printf("fully associative, ");
+		} else {
+			printf("%u-way set associative, ", config.tlb_ways);
+		}
+		printf("%s\n", config.tlb_asid ? "tagged with the pid" : "flushed on process switch");
+	}
+}
+
+void print_huge_page_config(memory_config config) {
+	unsigned int size = config.huge_page_size == 0 ? HUGE_PAGE_SIZE : config.huge_page_size;
+	unsigned int threshold = config.promote_threshold == 0 ? PROMOTE_THRESHOLD(size / config.page_size) : config.promote_threshold;
+
+	if (config.huge_pages == HUGE_PAGES_NEVER) {
+		printf("            Huge pages: none\n");
+		return;
+	}
+
+	printf("            Huge pages: %u bytes, %s", size, config.huge_pages == HUGE_PAGES_ALWAYS ? "on first faults and " : "");
+	printf("promoted at %u pages in memory%s", threshold, config.demote ? ", split when evicted partly unused" : "");
+	if (config.huge_start != 0 || config.huge_end != 0) {
+		printf(", from 0x%x to 0x%x", config.huge_start, config.huge_end);
+	}
+	printf("\n");
+}
+
+void print_io_config(memory_config config) {
+	if (config.prefetch == PREFETCH_SEQUENTIAL) {
+		printf("              Prefetch: the next %u pages on a fault\n", config.prefetch_pages);
+	} else if (config.prefetch == PREFETCH_STRIDE) {
+		printf("              Prefetch: %u pages along a repeated stride on a fault\n", config.prefetch_pages);
+	} else {
+		printf("              Prefetch: none\n");
+	}
+	printf("          Access costs: fault %u ns, transfer %u ns, write back %u ns, memory %u ns\n",
+		   config.cost.fault == 0 ? FAULT_COST_NS : config.cost.fault,
+		   config.cost.transfer == 0 ? TRANSFER_COST_NS : config.cost.transfer,
+		   config.cost.write_back == 0 ? WRITE_BACK_COST_NS : config.cost.write_back,
+		   config.cost.memory == 0 ? MEMORY_COST_NS : config.cost.memory);
+}
+
+void run_simulation(struct sim simulation, bool details) {
+	os_memory_info * info;
+	memory_access * trace;
+	int i, count;
+	long long start, elapsed = 0;
+
 	printf("Running simulation for the following memory configuration...\n");
-	printf("Physical address space: %u bits\n", simulation.config.physical_address_space);
-	printf(" Virtual address space: %u bits\n", simulation.config.virtual_address_space);
-	printf("             Page size: %u bytes\n", simulation.config.page_size);
-	printf("             Processes: %u\n", simulation.config.processes);
+	if (details) {
+		print_config(simulation.config);
+	} else {
+		print_address_config(simulation.config);
+	}
 	printf("(pid, virt addr) -->  phys addr\n");
 
-	initialize_page_manager(simulation.config);
-	while (1) {
-		struct access acc = simulation.access_func();
-		if (acc.done)
-			break;
-		access_result result = access_memory(acc.pid, acc.virtual_address);
-		printf("(%u, %11u) --> %10u  %s\n", acc.pid, acc.virtual_address, result.physical_address, result.page_fault ? "(page fault)" : "");
+	// The whole trace is known up front, OPT looks ahead in it
+	for (count = 0; !simulation.access_func(count).done; count++);
+	trace = safe_malloc(count * sizeof(memory_access));
+	for (i = 0; i < count; i++) {
+		struct access acc = simulation.access_func(i);
+		trace[i].pid = acc.pid;
+		trace[i].virtual_address = acc.virtual_address;
+		trace[i].write = false;
+	}
+
+	info = initialize_page_manager(simulation.config);
+	set_future_accesses(info, trace, count);
+	for (i = 0; i < count; i++) {
+		start = time_ns();
+		access_result result = access_memory(info, trace[i].pid, trace[i].virtual_address, trace[i].write);
+		elapsed += time_ns() - start;
+		printf("(%u, %11u) --> %10u  %s\n", trace[i].pid, trace[i].virtual_address, result.physical_address, result.page_fault ? "(page fault)" : "");
+	}
+
+	if (details) {
+		printf("%llu accesses, %llu page faults (%.2f%%), %llu TLB hits (%.2f%%), %.0f accesses/s in access_memory\n",
+			   info->accesses, info->page_faults, info->accesses == 0 ? 0.0 : 100.0 * info->page_faults / info->accesses,
+			   info->tlb_hits, info->accesses == 0 ? 0.0 : 100.0 * info->tlb_hits / info->accesses,
+			   elapsed == 0 ? 0.0 : info->accesses / (elapsed / 1e9));
+	}
+
+	safe_free(trace);
+	destroy_page_manager(info);
+}
+
+// Prints the faults and the frames held by every process
+void print_process_stats(const os_memory_info * info) {
+	const process * p;
+	unsigned int i;
+
+	printf("\n%6s %12s %12s %10s %10s %12s %10s %10s %13s %12s\n", "pid", "accesses", "page faults", "fault rate", "evicted", "written back",
+		   "resident", "peak", "mean resident", "ns/access");
+	for (i = 0; i < info->config.processes; i++) {
+		p = &info->processes[i];
+		printf("%6u %12llu %12llu %9.2f%% %10llu %12llu %10u %10u %13.1f %12.1f\n", p->id, p->accesses, p->page_faults,
+			   p->accesses == 0 ? 0.0 : 100.0 * p->page_faults / p->accesses, p->evictions, p->write_backs, p->resident, p->peak_resident,
+			   p->accesses == 0 ? 0.0 : (double)p->resident_sum / p->accesses,
+			   p->accesses == 0 ? 0.0 : (double)p->simulated_ns / p->accesses);
+	}
+}
+
+// Replays the trace at path and prints aggregate statistics only. The trace
+// is streamed in batches, except for OPT which needs all of it up front.
+void replay_trace(const char * path, memory_config config) {
+	memory_config base_config = config;
+	os_memory_info * info, * base = NULL;
+	trace_reader * reader;
+	memory_access * batch, * trace = NULL;
+	unsigned long long count = 0, i;
+	unsigned int read, j;
+	long long start;
+	double elapsed;
+
+	printf("Replaying %s with the following memory configuration...\n", path);
+	print_config(config);
+
+	info = initialize_page_manager(config);
+	// The same accesses without huge pages, OPT has none
+	if (config.huge_pages != HUGE_PAGES_NEVER) {
+		base_config.huge_pages = HUGE_PAGES_NEVER;
+		base = initialize_page_manager(base_config);
+	}
+
+	if (info->policy == &opt_policy) {
+		trace = load_trace(path, config.processes, &count);
+		set_future_accesses(info, trace, count);
+
+		start = time_ns();
+		for (i = 0; i < count; i++) {
+			access_memory(info, trace[i].pid, trace[i].virtual_address, trace[i].write);
+		}
+		elapsed = (time_ns() - start) / 1e9;
+		safe_free(trace);
+	} else {
+		batch = safe_malloc(TRACE_BATCH * sizeof(memory_access));
+		start = time_ns();
+		reader = open_trace(path, config.processes);
+		while ((read = read_trace(reader, batch, TRACE_BATCH)) > 0) {
+			for (j = 0; j < read; j++) {
+				access_memory(info, batch[j].pid, batch[j].virtual_address, batch[j].write);
+			}
+			for (j = 0; base != NULL && j < read; j++) {
+				access_memory(base, batch[j].pid, batch[j].virtual_address, batch[j].write);
+			}
+			count += read;
+		}
+		close_trace(reader);
+		elapsed = (time_ns() - start) / 1e9;
+		safe_free(batch);
+	}
+
+	printf("%llu accesses (%llu reads, %llu writes), %llu page faults (%.2f%%), %llu TLB hits (%.2f%%)\n",
+		   count, count - info->writes, info->writes, info->page_faults, count == 0 ? 0.0 : 100.0 * info->page_faults / count,
+		   info->tlb_hits, count == 0 ? 0.0 : 100.0 * info->tlb_hits / count);
+	printf("%llu pages written back, %llu pages prefetched (%llu used), %.3f simulated seconds (%.1f ns per access)\n",
+		   info->write_backs, info->prefetches, info->prefetch_hits, info->simulated_ns / 1e9,
+		   count == 0 ? 0.0 : (double)info->simulated_ns / count);
+	printf("%.3f seconds, %.0f accesses/s%s%s\n", elapsed, elapsed == 0 ? 0.0 : count / elapsed,
+		   info->policy == &opt_policy ? "" : " including reading the trace", base == NULL ? "" : " and replaying it without huge pages");
+	print_process_stats(info);
+
+	if (base != NULL) {
+		print_huge_page_comparison(base, info, count);
+		destroy_page_manager(base);
+	}
+	destroy_page_manager(info);
+}
+
+// Prints how the same count accesses fared with base pages only and with huge pages
+void print_huge_page_comparison(const os_memory_info * base, const os_memory_info * huge, unsigned long long count) {
+	const os_memory_info * runs[] = { base, huge };
+	const char * names[] = { "base pages", "huge pages" };
+	unsigned int i, j, frames;
+
+	printf("\n%llu huge pages mapped on first faults, %llu promoted, %llu split\n", huge->huge_faults, huge->promotions, huge->demotions);
+	printf("%-10s %12s %10s %10s %15s %12s %12s %12s\n", "", "page faults", "fault rate", "TLB hits", "mean TLB reach",
+		   "written back", "frames used", "ns/access");
+	for (i = 0; i < 2; i++) {
+		for (frames = 0, j = 0; j < runs[i]->config.processes; j++) {
+			frames += runs[i]->processes[j].resident;
+		}
+		printf("%-10s %12llu %9.2f%% %9.2f%% %11.0f KiB %12llu %12u %12.1f\n", names[i], runs[i]->page_faults,
+			   count == 0 ? 0.0 : 100.0 * runs[i]->page_faults / count, count == 0 ? 0.0 : 100.0 * runs[i]->tlb_hits / count,
+			   count == 0 ? 0.0 : runs[i]->tlb_reach_sum / 1024.0 / count, runs[i]->write_backs, frames,
+			   count == 0 ? 0.0 : (double)runs[i]->simulated_ns / count);
+	}
+}
+
+// Replays the trace at path with every combination of the policies, page
+// sizes and physical address spaces of config, on threads threads, and prints
+// the fault rate against the physical memory for every policy and page size
+void sweep_trace(const char * path, memory_config config, const sweep_values * values, unsigned int threads) {
+	unsigned int runs_count = values->policies_count * values->page_sizes_count * values->physical_bits_count;
+	sweep_run * runs = safe_malloc(runs_count * sizeof(sweep_run));
+	memory_access * trace;
+	unsigned long long count;
+	unsigned int r, i, j, k;
+	long long start;
+	double elapsed, replaying = 0;
+
+	printf("Sweeping %s with the following memory configuration...\n", path);
+	printf(" Virtual address space: %u bits\n", config.virtual_address_space);
+	printf("             Processes: %u\n", config.processes);
+	config.physical_address_space = values->physical_bits[0];
+	config.page_size = values->page_sizes[0];
+	config.policy = values->policies[0];
+	print_scope_config(config);
+	print_tlb_config(config);
+	print_huge_page_config(config);
+	print_io_config(config);
+
+	trace = load_trace(path, config.processes, &count);
+
+	// Runs of a curve are contiguous, from the smallest physical memory
+	for (r = 0, i = 0; i < values->policies_count; i++) {
+		for (j = 0; j < values->page_sizes_count; j++) {
+			for (k = 0; k < values->physical_bits_count; k++, r++) {
+				runs[r].config = config;
+				runs[r].config.policy = values->policies[i];
+				runs[r].config.page_size = values->page_sizes[j];
+				runs[r].config.physical_address_space = values->physical_bits[k];
+			}
+		}
+	}
+
+	start = time_ns();
+	run_sweep(trace, count, runs, runs_count, threads);
+	elapsed = (time_ns() - start) / 1e9;
+
+	printf("%llu accesses, %u configurations on %u threads\n\n", count, runs_count, threads < runs_count ? threads : runs_count);
+	printf("%-14s %10s %9s %10s %12s %10s %9s %12s %10s %9s\n", "policy", "page size", "phys bits", "frames", "page faults", "fault rate",
+		   "TLB hits", "written back", "ns/access", "seconds");
+	for (r = 0; r < runs_count; r++) {
+		if (r > 0 && r % values->physical_bits_count == 0) {
+			printf("\n");
+		}
+		printf("%-14s %10u %9u %10llu %12llu %9.2f%% %8.2f%% %12llu %10.1f %9.3f\n", runs[r].config.policy->name, runs[r].config.page_size,
+			   runs[r].config.physical_address_space, (1ull << runs[r].config.physical_address_space) / runs[r].config.page_size,
+			   runs[r].page_faults, count == 0 ? 0.0 : 100.0 * runs[r].page_faults / count,
+			   count == 0 ? 0.0 : 100.0 * runs[r].tlb_hits / count, runs[r].write_backs,
+			   count == 0 ? 0.0 : (double)runs[r].simulated_ns / count, runs[r].seconds);
+		replaying += runs[r].seconds;
+	}
+	printf("\nSweep took %.3f seconds, the runs %.3f seconds together\n", elapsed, replaying);
+
+	safe_free(trace);
+	safe_free(runs);
+}
+
+// Prints the miss ratio curve of global LRU replacement (-g) for
+// every page size of values, from one frame to the whole physical address
+// space, computed in a single pass over the trace at path
+void print_miss_ratio_curves(const char * path, memory_config config, const sweep_values * values, double rate) {
+	miss_ratio_curve * curves[SWEEP_VALUES];
+	unsigned int shifts[SWEEP_VALUES];
+	unsigned int vpn_mask = config.virtual_address_space == 32 ? UINT_MAX : (1u << config.virtual_address_space) - 1;
+	memory_access * batch = safe_malloc(TRACE_BATCH * sizeof(memory_access));
+	trace_reader * reader;
+	unsigned long long count = 0, frames, misses;
+	unsigned int read, i, j, bits;
+	long long start;
+	double elapsed;
+
+	printf("Computing the LRU miss ratio curve of %s in one pass, ", path);
+	if (rate == 1) {
+		printf("exact\n");
+	} else {
+		printf("sampling %g%% of the pages\n", 100 * rate);
+	}
+	printf(" Virtual address space: %u bits\n", config.virtual_address_space);
+	printf("             Processes: %u, sharing the frames\n", config.processes);
+
+	for (i = 0; i < values->page_sizes_count; i++) {
+		curves[i] = create_miss_ratio_curve(rate);
+		shifts[i] = __builtin_ctz(values->page_sizes[i]);
 	}
 
-	destroy_page_manager();
+	start = time_ns();
+	reader = open_trace(path, config.processes);
+	while ((read = read_trace(reader, batch, TRACE_BATCH)) > 0) {
+		for (i = 0; i < values->page_sizes_count; i++) {
+			for (j = 0; j < read; j++) {
+				mrc_access(curves[i], batch[j].pid, (batch[j].virtual_address & vpn_mask) >> shifts[i]);
+			}
+		}
+		count += read;
+	}
+	close_trace(reader);
+	elapsed = (time_ns() - start) / 1e9;
+
+	printf("%llu accesses\n\n", count);
+	printf("%10s %9s %10s %12s %10s\n", "page size", "phys bits", "frames", "page faults", "fault rate");
+	for (i = 0; i < values->page_sizes_count; i++) {
+		if (i > 0) {
+			printf("\n");
+		}
+		// Up to the first memory holding every page
+		for (bits = shifts[i]; bits <= 32; bits++) {
+			frames = 1ull << (bits - shifts[i]);
+			misses = mrc_misses(curves[i], frames);
+			printf("%10u %9u %10llu %12llu %9.2f%%\n", values->page_sizes[i], bits, frames, misses,
+				   count == 0 ? 0.0 : 100.0 * misses / count);
+			if (frames >= mrc_pages(curves[i])) {
+				break;
+			}
+		}
+		destroy_miss_ratio_curve(curves[i]);
+	}
+	printf("\n%.3f seconds, %.0f accesses/s including reading the trace\n", elapsed, elapsed == 0 ? 0.0 : count / elapsed);
+
+	safe_free(batch);
+}
+
+// Writes the trace at input in binary format to output
+void convert_trace(const char * input, const char * output) {
+	trace_reader * reader = open_trace(input, TRACE_WRITE_FLAG);
+	memory_access * batch = safe_malloc(TRACE_BATCH * sizeof(memory_access));
+	FILE * stream = create_trace(output);
+	unsigned long long count = 0;
+	unsigned int read;
+
+	while ((read = read_trace(reader, batch, TRACE_BATCH)) > 0) {
+		write_trace(stream, batch, read);
+		count += read;
+	}
+
+	if (fclose(stream) != 0) {
+		printf("ERROR: writing file at %s\n", output);
+		exit(1);
+	}
+	close_trace(reader);
+	safe_free(batch);
+	printf("%llu accesses written to %s\n", count, output);
+}
+
+// Parses a comma separated list of at most SWEEP_VALUES numbers between min
+// and max into values, returns how many or 0 if malformed
+unsigned int parse_numbers(char * text, unsigned int * values, unsigned long min, unsigned long max) {
+	unsigned int count = 0;
+	unsigned long value;
+	char * end;
+
+	do {
+		value = strtoul(text, &end, 10);
+		if (end == text || (*end != 0 && *end != ',') || value < min || value > max || count == SWEEP_VALUES) {
+			return 0;
+		}
+		values[count++] = value;
+		text = end + 1;
+	} while (*end == ',');
+
+	return count;
+}
+
+// Parses demand, ws[:<window>] or pff[:<low>:<high>] into the frame
+// allocation of config, returns false if malformed
+bool parse_allocation(const char * text, memory_config * config) {
+	char * end;
+
+	config->working_set_window = config->fault_interval_low = config->fault_interval_high = 0;
+	if (strcmp(text, "demand") == 0) {
+		config->frame_allocation = ALLOCATE_ON_DEMAND;
+		return true;
+	}
+
+	if (strncmp(text, "ws", 2) == 0) {
+		config->frame_allocation = ALLOCATE_WORKING_SET;
+		if (text[2] == ':') {
+			config->working_set_window = strtoul(text + 3, &end, 10);
+			return *end == 0 && config->working_set_window > 0;
+		}
+		return text[2] == 0;
+	}
+
+	if (strncmp(text, "pff", 3) == 0) {
+		config->frame_allocation = ALLOCATE_FAULT_FREQUENCY;
+		if (text[3] == ':') {
+			config->fault_interval_low = strtoul(text + 4, &end, 10);
+			if (*end != ':') {
+				return false;
+			}
+			config->fault_interval_high = strtoul(end + 1, &end, 10);
+			return *end == 0 && config->fault_interval_low <= config->fault_interval_high && config->fault_interval_high > 0;
+		}
+		return text[3] == 0;
+	}
+
+	return false;
+}
+
+// Parses seq:<pages> or stride:<pages> into the prefetching of config,
+// returns false if malformed
+bool parse_prefetch(const char * text, memory_config * config) {
+	const char * pages;
+	char * end;
+
+	if (strncmp(text, "seq:", 4) == 0) {
+		config->prefetch = PREFETCH_SEQUENTIAL;
+		pages = text + 4;
+	} else if (strncmp(text, "stride:", 7) == 0) {
+		config->prefetch = PREFETCH_STRIDE;
+		pages = text + 7;
+	} else {
+		return false;
+	}
+
+	config->prefetch_pages = strtoul(pages, &end, 10);
+	return end != pages && *end == 0 && config->prefetch_pages > 0;
+}
+
+// Parses always or promote[:<pages>] into the huge pages of config, returns
+// false if malformed
+bool parse_huge_pages(const char * text, memory_config * config) {
+	char * end;
+
+	config->promote_threshold = 0;
+	if (strcmp(text, "always") == 0) {
+		config->huge_pages = HUGE_PAGES_ALWAYS;
+		return true;
+	}
+
+	if (strncmp(text, "promote", 7) == 0) {
+		config->huge_pages = HUGE_PAGES_PROMOTE;
+		if (text[7] == ':') {
+			config->promote_threshold = strtoul(text + 8, &end, 10);
+			return *end == 0 && config->promote_threshold > 0;
+		}
+		return text[7] == 0;
+	}
+
+	return false;
 }
 
 int main(int argc, char* argv[]) {
-	int i;
-	for (i = FIRST_SIMULATION_TO_RUN; i <= LAST_SIMULATION_TO_RUN; i++)
-		run_simulation(simulations[i]);
+	memory_config config = { 24, 32, 4096, 1, NULL, 0, 0, true, LOCAL_REPLACEMENT, ALLOCATE_ON_DEMAND };
+	sweep_values values = { { &lru_policy }, 1, { 4096 }, 1, { 24 }, 1 };
+	int first = FIRST_SIMULATION_TO_RUN, last = LAST_SIMULATION_TO_RUN;
+	const char * binary_output = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double rate = 0;
+	unsigned int costs[SWEEP_VALUES], huge_page_size;
+	int i, option;
+	char * end, * name;
+
+	if (argc == 2 && strcmp(argv[1], "--help") == 0) {
+		show_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	while ((option = getopt(argc, argv, "a:Ab:c:dgH:j:m:n:p:P:r:R:s:S:t:v:Z:")) != -1) {
+		switch (option) {
+		case 'a':
+			if (!parse_allocation(optarg, &config)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'A':
+			config.tlb_asid = false;
+			break;
+		case 'b':
+			binary_output = optarg;
+			break;
+		case 'c':
+			if (parse_numbers(optarg, costs, 1, UINT_MAX) != 4) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			config.cost.fault = costs[0];
+			config.cost.transfer = costs[1];
+			config.cost.write_back = costs[2];
+			config.cost.memory = costs[3];
+			break;
+		case 'd':
+			config.demote = true;
+			break;
+		case 'g':
+			config.replacement_scope = GLOBAL_REPLACEMENT;
+			break;
+		case 'H':
+			if (!parse_huge_pages(optarg, &config)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			threads = strtol(optarg, &end, 10);
+			if (*end != 0 || threads < 1) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			rate = strtod(optarg, &end);
+			if (*end != 0 || !(rate > 0 && rate <= 1)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			config.processes = strtoul(optarg, &end, 10);
+			if (*end != 0 || config.processes < 1) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			values.physical_bits_count = parse_numbers(optarg, values.physical_bits, 2, 32);
+			if (values.physical_bits_count == 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			if (!parse_prefetch(optarg, &config)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			values.policies_count = 0;
+			for (name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+				if (values.policies_count == SWEEP_VALUES || (values.policies[values.policies_count++] = find_replacement_policy(name)) == NULL) {
+					show_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+			}
+			if (values.policies_count == 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			config.huge_start = strtoul(optarg, &end, 0);
+			if (*end != '-') {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			config.huge_end = strtoul(end + 1, &end, 0);
+			if (*end != 0 || config.huge_end <= config.huge_start) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			values.page_sizes_count = parse_numbers(optarg, values.page_sizes, 1, UINT_MAX);
+			for (i = 0; i < values.page_sizes_count; i++) {
+				if ((values.page_sizes[i] & (values.page_sizes[i] - 1)) != 0) {
+					values.page_sizes_count = 0;
+				}
+			}
+			if (values.page_sizes_count == 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			first = last = strtol(optarg, &end, 10);
+			if (*end == '-') {
+				last = strtol(end + 1, &end, 10);
+			}
+			if (*end != 0 || first < 0 || last < first || last >= SIMULATIONS_COUNT) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			config.tlb_entries = strtoul(optarg, &end, 10);
+			config.tlb_ways = 0;
+			if (*end == '/') {
+				config.tlb_ways = strtoul(end + 1, &end, 10);
+			}
+			if (*end != 0 || config.tlb_entries < 1 || config.tlb_ways > config.tlb_entries ||
+				(config.tlb_ways != 0 && config.tlb_entries % config.tlb_ways != 0)) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			config.virtual_address_space = strtoul(optarg, &end, 10);
+			if (*end != 0 || config.virtual_address_space < 2 || config.virtual_address_space > 32) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'Z':
+			config.huge_page_size = strtoul(optarg, &end, 10);
+			if (*end != 0 || config.huge_page_size == 0 || (config.huge_page_size & (config.huge_page_size - 1)) != 0) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind > 1 || ((binary_output != NULL || rate > 0) && argc - optind != 1) ||
+		(config.replacement_scope == GLOBAL_REPLACEMENT && config.frame_allocation != ALLOCATE_ON_DEMAND)) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
 
+	// OPT knows the future accesses of pages, not of the pages loaded along
+	// with them or of huge pages
+	for (i = 0; i < values.policies_count; i++) {
+		if ((config.prefetch != PREFETCH_NONE || config.huge_pages != HUGE_PAGES_NEVER) && values.policies[i] == &opt_policy) {
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Pages, and huge pages of at most a page table level of them, must fit
+	// in both memories with every combination
+	huge_page_size = config.huge_page_size == 0 ? HUGE_PAGE_SIZE : config.huge_page_size;
+	for (i = 0; i < values.page_sizes_count * values.physical_bits_count; i++) {
+		unsigned int page_size = values.page_sizes[i / values.physical_bits_count];
+		if (config.huge_pages != HUGE_PAGES_NEVER) {
+			if (huge_page_size <= page_size || huge_page_size / page_size > 1u << PAGE_TABLE_LEVEL_BITS ||
+				config.promote_threshold > huge_page_size / page_size) {
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			page_size = huge_page_size;
+		}
+		if (page_size > (1ull << config.virtual_address_space) ||
+			page_size > (1ull << values.physical_bits[i % values.physical_bits_count])) {
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (binary_output != NULL) {
+		convert_trace(argv[optind], binary_output);
+	} else if (rate > 0) {
+		print_miss_ratio_curves(argv[optind], config, &values, rate);
+	} else if (argc - optind == 1 && values.policies_count * values.page_sizes_count * values.physical_bits_count > 1) {
+		sweep_trace(argv[optind], config, &values, threads);
+	} else if (argc - optind == 1) {
+		config.policy = values.policies[0];
+		config.page_size = values.page_sizes[0];
+		config.physical_address_space = values.physical_bits[0];
+		replay_trace(argv[optind], config);
+	} else {
+		for (i = first; i <= last; i++)
+			run_simulation(simulations[i], i >= ASSIGNMENT_SIMULATIONS);
+	}
+
+	// Every simulation freed what it allocated
+	assert(get_memory_stats().chunks == 0);
 	return EXIT_SUCCESS;
 }
 
-struct access access1() {
-	static int i = 0;
-	return (struct access){i == 96, 0, i++ * 128};
+void show_usage(const char * exe) {
+	printf("Usage: %s [-S <first>[-<last>]]\n", exe);
+	printf("       %s [options] <trace-file>\n", exe);
+	printf("       %s -b <binary-file> <trace-file>\n", exe);
+	printf("Without a trace file the built-in simulations are run and every access is printed.\n");
+	printf("Trace files are binary or have one \"<pid> <virtual address> [R|W]\" access per line.\n");
+	printf("-p, -r and -s take comma separated lists, every combination is then replayed in a sweep.\n");
+	printf("  -a <allocation>       frames of every process with local replacement: demand (default),\n");
+	printf("                        ws[:<window>] for its working set or pff[:<low>:<high>] from its page fault frequency\n");
+	printf("  -A                    flush the TLB on process switches instead of tagging entries with the pid\n");
+	printf("  -b <binary-file>      convert the trace to binary-file instead of replaying it\n");
+	printf("  -c <fault>,<transfer>,<write back>,<memory>\n");
+	printf("                        nanoseconds a fault, a prefetched page, a write-back and a memory access cost,\n");
+	printf("                        %u,%u,%u,%u by default\n", FAULT_COST_NS, TRANSFER_COST_NS, WRITE_BACK_COST_NS, MEMORY_COST_NS);
+	printf("  -d                    split huge pages evicted with pages never accessed, only those leave\n");
+	printf("  -g                    global replacement, the victim of a fault can belong to any process\n");
+	printf("  -H <huge pages>       map regions with huge pages while blocks of frames are free: always, from their first\n");
+	printf("                        fault, or when promote[:<pages>] of their pages are in memory, half by default, not with opt\n");
+	printf("  -j <threads>          threads replaying a sweep, one per processor by default\n");
+	printf("  -m <rate>             print the miss ratio curve of global LRU replacement for every page size in one pass,\n");
+	printf("                        following rate of the pages, 1 for the exact curve\n");
+	printf("  -n <processes>        pids of the trace are below processes, 1 by default\n");
+	printf("  -p <bits>             physical address space, 24 by default\n");
+	printf("  -P <prefetch>         on a fault also load seq:<pages> following pages or stride:<pages> pages along\n");
+	printf("                        the stride of the last accesses, not with opt\n");
+	printf("  -r <policy>           lru (default), clock, second-chance, 2q, arc, lfu or opt\n");
+	printf("  -R <start>-<end>      virtual addresses where huge pages may be, all of them by default\n");
+	printf("  -s <bytes>            page size, a power of 2, 4096 by default\n");
+	printf("  -S <first>[-<last>]   built-in simulations to run, from 0 to %d\n", (int)SIMULATIONS_COUNT - 1);
+	printf("  -t <entries>[/<ways>] TLB size and associativity, fully associative without ways\n");
+	printf("  -v <bits>             virtual address space, 32 by default\n");
+	printf("  -Z <bytes>            huge page size, a power of 2, %u by default\n", HUGE_PAGE_SIZE);
+}
+
+struct access access1(int i) {
+	return (struct access){i == 96, 0, i * 128};
 }
 
-struct access access2() {
-	static int i = 0;
-	return (struct access){i == 32, 0, i++ * 320 % 1024};
+struct access access2(int i) {
+	return (struct access){i == 32, 0, i * 320 % 1024};
 }
 
-struct access access3() {
-	static int i = 0;
-	struct access acc = {i == 32, i / 2 % 2, (i / 4 * 2 + i % 2) * 64 - i % 4 / 3};
-	i++;
-	return acc;
+struct access access3(int i) {
+	return (struct access){i == 32, i / 2 % 2, (i / 4 * 2 + i % 2) * 64 - i % 4 / 3};
 }
 
-struct access access4() {
-	static int i = 0;
-	struct access acc = {i == 16512, i % 2, i * (i % 2 + 1) * 512 % 16777216};
-	i++;
-	return acc;
+struct access access4(int i) {
+	return (struct access){i == 16512, i % 2, i * (i % 2 + 1) * 512 % 16777216};
 }
@@ -0,0 +1,211 @@
+#include "miss_ratio.h"
+#include <limits.h>
+#include <string.h>
+#include <assert.h>
+
+#define NO_NODE (UINT_MAX)
+#define NO_MRC_KEY (ULLONG_MAX)
+
+// Finalizer of splitmix64, every bit of the key changes half the bits
+static unsigned long long mix(unsigned long long key) {
+	key = (key ^ key >> 30) * 0xBF58476D1CE4E5B9ull;
+	key = (key ^ key >> 27) * 0x94D049BB133111EBull;
+	return key ^ key >> 31;
+}
+
+// Returns a copy of the count elements of size bytes at old in a new array of
+// capacity elements, the rest of it zeroed
+static void * grow(void * old, size_t size, size_t count, size_t capacity) {
+	void * new = safe_malloc(capacity * size);
+
+	memcpy(new, old, count * size);
+	memset((char *)new + count * size, 0, (capacity - count) * size);
+	safe_free(old);
+	return new;
+}
+
+miss_ratio_curve * create_miss_ratio_curve(double rate) {
+	miss_ratio_curve * m = safe_malloc(sizeof(miss_ratio_curve));
+
+	assert(rate > 0 && rate <= 1);
+	m->threshold = rate * MRC_SAMPLING_MODULUS;
+	m->threshold = m->threshold == 0 ? 1 : m->threshold;
+	m->rate = (double)m->threshold / MRC_SAMPLING_MODULUS;
+	m->accesses = m->sampled = m->cold = 0;
+
+	m->nodes_capacity = 1024;
+	m->nodes = safe_malloc(m->nodes_capacity * sizeof(treap_node));
+	m->nodes_count = 0;
+	m->root = NO_NODE;
+	m->seed = 2463534242u;
+
+	m->slots_mask = 2 * m->nodes_capacity - 1;
+	m->keys = safe_malloc((m->slots_mask + 1) * sizeof(unsigned long long));
+	m->slots = safe_malloc((m->slots_mask + 1) * sizeof(unsigned int));
+	memset(m->keys, 0xFF, (m->slots_mask + 1) * sizeof(unsigned long long));
+
+	m->histogram_size = 1024;
+	m->histogram = safe_malloc(m->histogram_size * sizeof(unsigned long long));
+	memset(m->histogram, 0, m->histogram_size * sizeof(unsigned long long));
+
+	return m;
+}
+
+void destroy_miss_ratio_curve(miss_ratio_curve * m) {
+	safe_free(m->nodes);
+	safe_free(m->keys);
+	safe_free(m->slots);
+	safe_free(m->histogram);
+	safe_free(m);
+}
+
+static unsigned int subtree_size(const miss_ratio_curve * m, unsigned int node) {
+	return node == NO_NODE ? 0 : m->nodes[node].size;
+}
+
+static void update_size(miss_ratio_curve * m, unsigned int node) {
+	m->nodes[node].size = 1 + subtree_size(m, m->nodes[node].left) + subtree_size(m, m->nodes[node].right);
+}
+
+// Joins two treaps, every time of first being below those of second
+static unsigned int merge(miss_ratio_curve * m, unsigned int first, unsigned int second) {
+	if (first == NO_NODE) {
+		return second;
+	}
+	if (second == NO_NODE) {
+		return first;
+	}
+
+	if (m->nodes[first].priority > m->nodes[second].priority) {
+		m->nodes[first].right = merge(m, m->nodes[first].right, second);
+		update_size(m, first);
+		return first;
+	}
+	m->nodes[second].left = merge(m, first, m->nodes[second].left);
+	update_size(m, second);
+	return second;
+}
+
+// Takes node out of the treap and returns its stack distance, one more than
+// the nodes with a later time. They are counted on the way down to it.
+static unsigned int remove_node(miss_ratio_curve * m, unsigned int node) {
+	unsigned long long time = m->nodes[node].time;
+	unsigned int * link = &m->root, distance = 1;
+
+	while (*link != node) {
+		assert(*link != NO_NODE);
+		m->nodes[*link].size--;
+		if (time < m->nodes[*link].time) {
+			distance += 1 + subtree_size(m, m->nodes[*link].right);
+			link = &m->nodes[*link].left;
+		} else {
+			link = &m->nodes[*link].right;
+		}
+	}
+
+	distance += subtree_size(m, m->nodes[node].right);
+	*link = merge(m, m->nodes[node].left, m->nodes[node].right);
+	return distance;
+}
+
+// Adds node, whose time is later than every other, on the right spine below
+// the nodes of higher priority
+static void insert_last(miss_ratio_curve * m, unsigned int node) {
+	unsigned int * link = &m->root;
+
+	while (*link != NO_NODE && m->nodes[*link].priority > m->nodes[node].priority) {
+		m->nodes[*link].size++;
+		link = &m->nodes[*link].right;
+	}
+
+	m->nodes[node].left = *link;
+	m->nodes[node].right = NO_NODE;
+	m->nodes[node].size = 1 + subtree_size(m, *link);
+	*link = node;
+}
+
+// Doubles the table of the pages followed
+static void grow_slots(miss_ratio_curve * m) {
+	unsigned long long * keys = m->keys;
+	unsigned int * slots = m->slots, old_mask = m->slots_mask, slot, i;
+
+	m->slots_mask = 2 * old_mask + 1;
+	m->keys = safe_malloc((m->slots_mask + 1) * sizeof(unsigned long long));
+	m->slots = safe_malloc((m->slots_mask + 1) * sizeof(unsigned int));
+	memset(m->keys, 0xFF, (m->slots_mask + 1) * sizeof(unsigned long long));
+
+	for (i = 0; i <= old_mask; i++) {
+		if (keys[i] != NO_MRC_KEY) {
+			for (slot = mix(keys[i]) >> 32 & m->slots_mask; m->keys[slot] != NO_MRC_KEY; slot = (slot + 1) & m->slots_mask);
+			m->keys[slot] = keys[i];
+			m->slots[slot] = slots[i];
+		}
+	}
+
+	safe_free(keys);
+	safe_free(slots);
+}
+
+void mrc_access(miss_ratio_curve * m, unsigned int pid, unsigned int vpn) {
+	unsigned long long key = (unsigned long long)pid << 32 | vpn, hash = mix(key);
+	unsigned int slot, node, distance;
+
+	m->accesses++;
+	// The low bits pick the pages followed, the high bits their slot
+	if ((hash & (MRC_SAMPLING_MODULUS - 1)) >= m->threshold) {
+		return;
+	}
+	m->sampled++;
+
+	for (slot = hash >> 32 & m->slots_mask; m->keys[slot] != NO_MRC_KEY && m->keys[slot] != key; slot = (slot + 1) & m->slots_mask);
+
+	if (m->keys[slot] == NO_MRC_KEY) {
+		// First access to the page, a miss whatever the memory
+		m->cold++;
+		if (m->nodes_count == m->nodes_capacity) {
+			m->nodes = grow(m->nodes, sizeof(treap_node), m->nodes_count, 2 * m->nodes_capacity);
+			m->nodes_capacity *= 2;
+		}
+		node = m->nodes_count++;
+		m->keys[slot] = key;
+		m->slots[slot] = node;
+		// At most half full, probes stay short
+		if (2 * m->nodes_count > m->slots_mask + 1) {
+			grow_slots(m);
+		}
+	} else {
+		node = m->slots[slot];
+		distance = remove_node(m, node);
+		if (distance > m->histogram_size) {
+			m->histogram = grow(m->histogram, sizeof(unsigned long long), m->histogram_size, 2 * m->nodes_capacity);
+			m->histogram_size = 2 * m->nodes_capacity;
+		}
+		m->histogram[distance - 1]++;
+	}
+
+	// The page becomes the most recent one, with a random priority
+	m->seed ^= m->seed << 13;
+	m->seed ^= m->seed >> 17;
+	m->seed ^= m->seed << 5;
+	m->nodes[node].time = m->sampled;
+	m->nodes[node].priority = m->seed;
+	insert_last(m, node);
+}
+
+unsigned long long mrc_misses(const miss_ratio_curve * m, unsigned long long frames) {
+	// The page itself and rate of the pages accessed since are followed, the
+	// followed distances of the hits are up to 1 + (frames - 1) * rate
+	unsigned long long hits = 0, misses, limit = 1 + (frames - 1) * m->rate + 0.5, d;
+
+	for (d = 0; d < limit && d < m->histogram_size; d++) {
+		hits += m->histogram[d];
+	}
+	misses = m->sampled - hits;
+
+	// The miss ratio of the accesses followed stands for the one of all
+	return m->sampled == 0 ? 0 : (double)misses / m->sampled * m->accesses + 0.5;
+}
+
+unsigned long long mrc_pages(const miss_ratio_curve * m) {
+	return m->cold / m->rate + 0.5;
+}
@@ -0,0 +1,67 @@
+#ifndef _MISS_RATIO_H_
+#define _MISS_RATIO_H_
+
+#include "utility.h"
+
+// Pages are sampled when the low bits of their hash are below the rate times
+// this modulus, the same pages are sampled all along the trace
+#define MRC_SAMPLING_MODULUS (1u << 24)
+
+// Node of the treap holding the time of the last access of every page
+typedef struct {
+	unsigned long long time;
+	unsigned int left;
+	unsigned int right;
+	// Nodes in the subtree, the node included
+	unsigned int size;
+	unsigned int priority;
+} treap_node;
+
+// Miss ratio curve of an LRU memory shared by every process, for every number
+// of frames at once, computed from the stack distances of the accesses. The
+// stack distance of an access is the number of different pages accessed since
+// the last access to its page, its page included. It is a miss exactly when it
+// is larger than the frames of the memory.
+//
+// Distances are counted in a treap of the last access times of the pages: the
+// pages accessed since are the times above the last one of the page. With a
+// rate below 1 only the pages picked by a hash are followed, like SHARDS, and
+// their distances and counts are scaled by the rate.
+typedef struct {
+	// Pages followed and the hash threshold picking them
+	double rate;
+	unsigned int threshold;
+	unsigned long long accesses;
+	// Accesses to the pages followed and first accesses among them
+	unsigned long long sampled;
+	unsigned long long cold;
+	// Node of every page followed, a page keeps its node
+	treap_node * nodes;
+	unsigned int nodes_count;
+	unsigned int nodes_capacity;
+	unsigned int root;
+	unsigned int seed;
+	// Open addressing table of the pages followed and their nodes
+	unsigned long long * keys;
+	unsigned int * slots;
+	unsigned int slots_mask;
+	// Accesses at every stack distance, distance d at index d - 1
+	unsigned long long * histogram;
+	unsigned int histogram_size;
+} miss_ratio_curve;
+
+// rate is the share of the pages followed, 1 for the exact curve
+miss_ratio_curve * create_miss_ratio_curve(double rate);
+
+void destroy_miss_ratio_curve(miss_ratio_curve * m);
+
+void mrc_access(miss_ratio_curve * m, unsigned int pid, unsigned int vpn);
+
+// Misses of an LRU memory of frames pages over the accesses so far, estimated
+// when sampling
+unsigned long long mrc_misses(const miss_ratio_curve * m, unsigned long long frames);
+
+// Different pages accessed so far, estimated when sampling
+unsigned long long mrc_pages(const miss_ratio_curve * m);
+
+#endif
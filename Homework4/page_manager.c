@@ -1,140 +1,788 @@
 #include "page_manager.h"
-#include <math.h>
+#include <stdlib.h>
 #include <assert.h>
-#include <limits.h>
 
-static memory_config config;
+static void * allocate_level(os_memory_info * info, unsigned int level) {
+	int size = (info->level_mask[level] + 1) * (level + 1 == info->page_table_levels ? sizeof(virtual_page) : sizeof(void *));
+	info->page_table_bytes += size;
+	// safe_malloc zeroes the level: no page is valid, no lower level exists
+	return safe_malloc(size);
+}
+
+// Returns the entry of vpn in the page table of p. Missing levels are
+// allocated when create is true, otherwise NULL is returned.
+static virtual_page * find_page(os_memory_info * info, process * p, unsigned int vpn, bool create) {
+	void ** node = &p->page_table;
+	unsigned int level, last = info->page_table_levels - 1;
+
+	for (level = 0; ; level++) {
+		if (*node == NULL) {
+			if (!create) {
+				return NULL;
+			}
+			*node = allocate_level(info, level);
+		}
+
+		if (level == last) {
+			return &((virtual_page *)*node)[(vpn >> info->level_shift[level]) & info->level_mask[level]];
+		}
+		node = &((void **)*node)[(vpn >> info->level_shift[level]) & info->level_mask[level]];
+	}
+}
+
+static void free_level(const os_memory_info * info, void * node, unsigned int level) {
+	unsigned int i;
+
+	if (node == NULL) {
+		return;
+	}
 
-void initialize_page_manager(memory_config mc) {
-	int i, j;
-	config = mc;
+	if (level + 1 < info->page_table_levels) {
+		for (i = 0; i <= info->level_mask[level]; i++) {
+			free_level(info, ((void **)node)[i], level + 1);
+		}
+	}
+	safe_free(node);
+}
 
-	info.physical_memory = pow(2, mc.physical_address_space);
-	info.virtual_memory = pow(2, mc.virtual_address_space);
-	info.page_size = mc.page_size;
-	info.page_table_count = info.virtual_memory / info.page_size;
-	info.virtual_page_number_bits_count = log2(info.page_table_count);
-	info.offset_bits_count = mc.virtual_address_space - info.virtual_page_number_bits_count;
-	info.free_list_index = 0;
-	info.free_list_count = info.physical_memory / info.page_size;
-	info.free_list = safe_malloc(info.free_list_count * sizeof(physical_page));
+os_memory_info * initialize_page_manager(memory_config mc) {
+	os_memory_info * info = safe_malloc(sizeof(os_memory_info));
+	unsigned int huge_page_size;
+	int i;
+	info->config = mc;
+
+	assert(mc.page_size > 0 && (mc.page_size & (mc.page_size - 1)) == 0);
+#ifdef FIXED_PAGE_SIZE
+	assert(mc.page_size == FIXED_PAGE_SIZE);
+#endif
+	info->physical_memory = 1ull << mc.physical_address_space;
+	info->virtual_memory = 1ull << mc.virtual_address_space;
+	info->page_size = mc.page_size;
+	info->page_table_count = info->virtual_memory / info->page_size;
+	info->offset_bits_count = __builtin_ctz(mc.page_size);
+	assert(info->offset_bits_count <= mc.virtual_address_space);
+	info->virtual_page_number_bits_count = mc.virtual_address_space - info->offset_bits_count;
+	info->offset_mask = mc.page_size - 1;
+	info->virtual_page_number_mask = (unsigned int)(info->page_table_count - 1);
+#ifdef FLAT_PAGE_TABLES
+	info->page_table_levels = 1;
+#else
+	info->page_table_levels = (info->virtual_page_number_bits_count + PAGE_TABLE_LEVEL_BITS - 1) / PAGE_TABLE_LEVEL_BITS;
+	if (info->page_table_levels == 0) {
+		info->page_table_levels = 1;
+	}
+#endif
+	assert(info->page_table_levels <= PAGE_TABLE_MAX_LEVELS);
+	for (i = 0; i < info->page_table_levels; i++) {
+		info->level_shift[i] = (info->page_table_levels - 1 - i) * PAGE_TABLE_LEVEL_BITS;
+		info->level_mask[i] = (1u << (i == 0 ? info->virtual_page_number_bits_count - info->level_shift[0] : PAGE_TABLE_LEVEL_BITS)) - 1;
+	}
+	info->page_table_bytes = 0;
+	info->free_list_index = 0;
+	info->free_list_count = info->physical_memory / info->page_size;
+	info->free_list = safe_malloc(info->free_list_count * sizeof(physical_page));
+	info->frames = safe_malloc(info->free_list_count * sizeof(frame_owner));
+	info->policy = mc.policy == NULL ? &lru_policy : mc.policy;
+	info->accesses = 0;
+	info->page_faults = 0;
+	info->tlb = mc.tlb_entries == 0 ? NULL : create_tlb(mc.tlb_entries, mc.tlb_ways);
+	info->tlb_hits = 0;
+	info->writes = 0;
+	info->write_backs = 0;
+	info->prefetches = 0;
+	info->prefetch_hits = 0;
+	info->simulated_ns = 0;
+	assert(mc.prefetch == PREFETCH_NONE || info->policy != &opt_policy);
+	info->cost.memory = mc.cost.memory == 0 ? MEMORY_COST_NS : mc.cost.memory;
+	info->cost.fault = mc.cost.fault == 0 ? FAULT_COST_NS : mc.cost.fault;
+	info->cost.transfer = mc.cost.transfer == 0 ? TRANSFER_COST_NS : mc.cost.transfer;
+	info->cost.write_back = mc.cost.write_back == 0 ? WRITE_BACK_COST_NS : mc.cost.write_back;
+	assert(mc.huge_pages == HUGE_PAGES_NEVER || info->policy != &opt_policy);
+	info->huge_ratio = 1;
+	info->huge_shift = 0;
+	info->block_used = NULL;
+	if (mc.huge_pages != HUGE_PAGES_NEVER) {
+		huge_page_size = mc.huge_page_size == 0 ? HUGE_PAGE_SIZE : mc.huge_page_size;
+		assert((huge_page_size & (huge_page_size - 1)) == 0 && huge_page_size > mc.page_size);
+		assert(huge_page_size <= info->physical_memory && huge_page_size <= info->virtual_memory);
+		info->huge_shift = __builtin_ctz(huge_page_size) - info->offset_bits_count;
+		info->huge_ratio = 1u << info->huge_shift;
+		// The entries of a huge page are in one last level table
+		assert(info->huge_ratio <= info->level_mask[info->page_table_levels - 1] + 1);
+		info->block_used = safe_malloc((info->free_list_count >> info->huge_shift) * sizeof(unsigned int));
+		for (i = 0; i < info->free_list_count; i++) {
+			info->frames[i].pid = NO_PAGE;
+		}
+		info->free_frames = info->free_list_count;
+		info->free_blocks = info->free_list_count >> info->huge_shift;
+		info->block_cursor = 0;
+		// Whole huge pages between the bounds
+		info->huge_first = ((unsigned long long)mc.huge_start + huge_page_size - 1) / huge_page_size;
+		info->huge_last = (mc.huge_end == 0 ? info->virtual_memory : mc.huge_end) / huge_page_size;
+		info->promote_threshold = mc.promote_threshold == 0 ? PROMOTE_THRESHOLD(info->huge_ratio) : mc.promote_threshold;
+		assert(info->promote_threshold <= info->huge_ratio);
+	}
+	info->huge_faults = 0;
+	info->promotions = 0;
+	info->demotions = 0;
+	info->tlb_reach_sum = 0;
+	info->running_pid = 0;
+	assert(mc.replacement_scope == LOCAL_REPLACEMENT || mc.frame_allocation == ALLOCATE_ON_DEMAND);
+	info->working_set_window = mc.working_set_window == 0 ? WORKING_SET_WINDOW : mc.working_set_window;
+	info->fault_interval_low = mc.fault_interval_low == 0 && mc.fault_interval_high == 0 ? FAULT_INTERVAL_LOW : mc.fault_interval_low;
+	info->fault_interval_high = mc.fault_interval_low == 0 && mc.fault_interval_high == 0 ? FAULT_INTERVAL_HIGH : mc.fault_interval_high;
+	assert(info->fault_interval_low <= info->fault_interval_high);
+	info->next_accesses = NULL;
+	info->future_count = 0;
 
 	// calculate physical address for each physical page
-	for (i = 0; i < info.free_list_count; i++) {
-		info.free_list[i].start_address = i * info.page_size;
-		info.free_list[i].end_address = info.free_list[i].start_address + (info.page_size - 1);
+	for (i = 0; i < info->free_list_count; i++) {
+		info->free_list[i].start_address = i * info->page_size;
+		info->free_list[i].end_address = info->free_list[i].start_address + (info->page_size - 1);
 	}
 
 	// Verify that the physical page address for last page is correct
-	assert(info.free_list[i - 1].end_address == info.physical_memory - 1);
+	assert(info->free_list[i - 1].end_address == info->physical_memory - 1);
 
 	// initialize per process page table
-	info.processes = safe_malloc(mc.processes * sizeof(process));
+	info->processes = safe_malloc(mc.processes * sizeof(process));
 
 	for (i = 0; i < mc.processes; i++) {
-		info.processes[i].id = i;
-		info.processes[i].page_table = safe_malloc(info.page_table_count * sizeof(virtual_page));
-
-		// safe_malloc calls memset with 0, verify that valid member is equal to zero
-		for (j = 0; j < info.page_table_count; j++) assert(info.processes[i].page_table[j].valid == 0);
+		process * p = &info->processes[i];
+		p->id = i;
+		p->page_table = NULL;
+		p->accesses = 0;
+		if (mc.replacement_scope == LOCAL_REPLACEMENT || i == 0) {
+			p->policy_state = info->policy->create(info->free_list_count, info);
+		} else {
+			p->policy_state = info->processes[0].policy_state;
+		}
+		p->page_faults = 0;
+		p->evictions = 0;
+		p->resident = 0;
+		p->peak_resident = 0;
+		p->resident_sum = 0;
+		p->allocation = mc.frame_allocation == ALLOCATE_ON_DEMAND ? UINT_MAX : 0;
+		p->working_set = 0;
+		p->window = NULL;
+		if (mc.frame_allocation == ALLOCATE_WORKING_SET) {
+			p->window = safe_malloc(info->working_set_window * sizeof(virtual_page *));
+		}
+		p->last_fault = 0;
+		p->write_backs = 0;
+		p->simulated_ns = 0;
+		p->last_vpn = 0;
+		p->stride = 0;
+		p->stride_confirmed = false;
 	}
 
-	write_log2("memory config:\n");
+	LOG_DEBUG("memory config:");
 	LOG_MSG("%d physical address space", mc.physical_address_space);
 	LOG_MSG("%d virtual address space", mc.virtual_address_space);
 	LOG_MSG("%d processes", mc.processes);
-	LOG_MSG("%d page size in bytes and %d page size in bits", mc.page_size, info.page_size);
+	LOG_MSG("%s replacement policy", info->policy->name);
+	LOG_MSG("%d TLB entries in sets of %d, address space ids %s", mc.tlb_entries, mc.tlb_ways, mc.tlb_asid ? "on" : "off");
+	LOG_MSG("%s replacement, frame allocation %d", mc.replacement_scope == GLOBAL_REPLACEMENT ? "global" : "local", mc.frame_allocation);
+	LOG_MSG("prefetch %d of %d pages", mc.prefetch, mc.prefetch_pages);
+	LOG_MSG("huge pages %d of %d pages, promoted from %d", mc.huge_pages, info->huge_ratio, info->promote_threshold);
+	LOG_MSG("%d page size in bytes and %d page size in bits", mc.page_size, info->page_size);
+
+	LOG_DEBUG("system info:");
+	LOG_MSG("%llu physical memory", info->physical_memory);
+	LOG_MSG("%llu virtual memory", info->virtual_memory);
+	LOG_MSG("%d free physical pages", info->free_list_count);
+	LOG_MSG("%d current free physical page", info->free_list_index);
+	LOG_MSG("%d offset bits count", info->offset_bits_count);
+	LOG_MSG("%d VPN bits count", info->virtual_page_number_bits_count);
+	LOG_MSG("%llu entries in page table per process in %d level(s)", info->page_table_count, info->page_table_levels);
+
+	return info;
+}
+
+// Marks frame as holding vpn of process pid
+static void claim_frame(os_memory_info * info, unsigned int frame, unsigned int pid, unsigned int vpn) {
+	info->frames[frame].pid = pid;
+	info->frames[frame].virtual_page = vpn;
+	if (info->block_used != NULL) {
+		if (info->block_used[frame >> info->huge_shift]++ == 0) {
+			info->free_blocks--;
+		}
+		info->free_frames--;
+	}
+}
+
+// Without huge pages an evicted frame is taken again at once and never free
+static void free_frame(os_memory_info * info, unsigned int frame) {
+	if (info->block_used != NULL) {
+		info->frames[frame].pid = NO_PAGE;
+		if (--info->block_used[frame >> info->huge_shift] == 0) {
+			info->free_blocks++;
+		}
+		info->free_frames++;
+	}
+}
+
+// Returns the next block from the last one allocated from that is partly in
+// use, or wholly free when partial is false
+static unsigned int find_block(os_memory_info * info, bool partial) {
+	unsigned int blocks = info->free_list_count >> info->huge_shift, block = info->block_cursor, used, i;
+
+	for (i = 0; i < blocks; i++, block = block + 1 == blocks ? 0 : block + 1) {
+		used = info->block_used[block];
+		if (partial ? used > 0 && used < info->huge_ratio : used == 0) {
+			info->block_cursor = block;
+			return block;
+		}
+	}
+
+	assert(false);
+	return NO_PAGE;
+}
+
+// Returns a free frame, from a block partly in use if any so that whole
+// blocks stay free for huge pages
+static unsigned int find_free_frame(os_memory_info * info) {
+	unsigned int frame;
+
+	assert(info->free_frames > 0);
+	frame = find_block(info, info->free_frames > info->free_blocks * info->huge_ratio) << info->huge_shift;
+	while (info->frames[frame].pid != NO_PAGE) {
+		frame++;
+	}
+
+	return frame;
+}
 
-	write_log2("system info:\n");
-	LOG_MSG("%d physical memory", info.physical_memory);
-	LOG_MSG("%d virtual memory", info.virtual_memory);
-	LOG_MSG("%d free physical pages", info.free_list_count);
-	LOG_MSG("%d current free physical page", info.free_list_index);
-	LOG_MSG("%d offset bits count", info.offset_bits_count);
-	LOG_MSG("%d VPN bits count", info.virtual_page_number_bits_count);
-	LOG_MSG("%d entries in page table per process", info.page_table_count);
+// Drops the TLB entry of vpn of process pid, or of its huge page
+static void invalidate_translation(os_memory_info * info, unsigned int pid, unsigned int vpn, bool huge) {
+	// Without address space ids only the running process has entries
+	if (info->tlb != NULL && (info->config.tlb_asid || pid == info->running_pid)) {
+		tlb_invalidate(info->tlb, info->config.tlb_asid ? pid : 0, huge ? vpn >> info->huge_shift : vpn, huge);
+	}
+}
+
+// Takes page, vpn of q, out of memory and returns whether it was dirty
+static bool unmap_page(os_memory_info * info, process * q, unsigned int vpn, virtual_page * page) {
+	bool dirty = page->dirty;
+
+	LOG_MSG("Evicting VPN %d of process %d from physical page %d", vpn, q->id, page->physical_page);
+	if (!page->huge) {
+		invalidate_translation(info, q->id, vpn, false);
+	}
+	free_frame(info, page->physical_page);
+	page->valid = false;
+	page->dirty = false;
+	page->prefetched = false;
+	page->huge = false;
+	q->resident--;
+	q->evictions++;
+
+	return dirty;
+}
+
+// Counts pages of q written back before their frames are reused
+static void write_back(os_memory_info * info, process * q, unsigned int pages, unsigned int * write_backs) {
+	LOG_MSG("%d dirty pages of process %d are written back", pages, q->id);
+	info->write_backs += pages;
+	q->write_backs += pages;
+	*write_backs += pages;
+}
+
+// Evicts the page held by frame, whichever process it belongs to, with the
+// rest of its huge page if it is part of one. With demote a huge page whose
+// pages were not all accessed is split instead: those leave, the others stay
+// as pages of their own. Adds the write-backs needed to write_backs.
+static void evict_frame(os_memory_info * info, unsigned int frame, bool demote, unsigned int * write_backs) {
+	frame_owner * owner = &info->frames[frame];
+	process * q = &info->processes[owner->pid];
+	unsigned int vpn = owner->virtual_page, region, untouched = 0, i;
+	virtual_page * page = find_page(info, q, vpn, false), * first;
+	bool dirty = false;
+
+	assert(page != NULL && page->valid);
+	if (!page->huge) {
+		if (unmap_page(info, q, vpn, page)) {
+			write_back(info, q, 1, write_backs);
+		}
+		return;
+	}
+
+	region = vpn & ~(info->huge_ratio - 1);
+	first = page - (vpn - region);
+	invalidate_translation(info, q->id, region, true);
+	for (i = 0; i < info->huge_ratio; i++) {
+		untouched += first[i].prefetched;
+	}
+
+	if (demote && untouched > 0) {
+		LOG_MSG("Splitting the huge page at VPN %d of process %d, %d pages were not accessed", region, q->id, untouched);
+		info->demotions++;
+		for (i = 0; i < info->huge_ratio; i++) {
+			// Pages never accessed were never written either
+			if (first[i].prefetched) {
+				unmap_page(info, q, region + i, &first[i]);
+			} else {
+				first[i].huge = false;
+				info->policy->access(q->policy_state, first[i].physical_page, page_key(q->id, region + i), true, info->accesses);
+			}
+		}
+		return;
+	}
+
+	// A huge page has a single dirty bit, all of it is written back
+	for (i = 0; i < info->huge_ratio; i++) {
+		dirty |= unmap_page(info, q, region + i, &first[i]);
+	}
+	if (dirty) {
+		write_back(info, q, info->huge_ratio, write_backs);
+	}
+}
+
+// Returns the frames q may hold. With fault frequency allocation a process
+// that did not fault for long spares a frame now rather than at its next
+// fault, which may never come.
+static unsigned int allocation_of(const os_memory_info * info, const process * q) {
+	if (info->config.frame_allocation == ALLOCATE_FAULT_FREQUENCY &&
+		q->accesses - q->last_fault > info->fault_interval_high && q->resident > 1 && q->allocation >= q->resident) {
+		return q->resident - 1;
+	}
+	return q->allocation;
+}
+
+// Returns the process losing a page when p faults with local replacement and
+// no frame is free: the one furthest above its allocation while p is below
+// its own, otherwise p itself, or the process holding the most frames when p
+// holds none
+static process * choose_victim_process(os_memory_info * info, process * p) {
+	process * victim = NULL, * largest = NULL, * q;
+	unsigned int i, allocation, surplus = 0;
+
+	for (i = 0; i < info->config.processes; i++) {
+		q = &info->processes[i];
+		allocation = allocation_of(info, q);
+		if (q != p && q->resident > allocation && (victim == NULL || q->resident - allocation > surplus)) {
+			victim = q;
+			surplus = q->resident - allocation;
+		}
+		if (largest == NULL || q->resident > largest->resident) {
+			largest = q;
+		}
+	}
+
+	if (victim != NULL && p->resident < p->allocation) {
+		return victim;
+	}
+	return p->resident > 0 ? p : largest;
+}
+
+// Returns the frame of the page the replacement scope and frame allocation
+// evict for vpn of p, the policy holding it forgets it
+static unsigned int choose_victim(os_memory_info * info, process * p, unsigned int vpn) {
+	process * victim;
+	unsigned int frame;
+
+	if (info->config.replacement_scope == GLOBAL_REPLACEMENT) {
+		// Every process has the state holding all the frames
+		frame = info->policy->evict(p->policy_state, page_key(p->id, vpn));
+	} else {
+		victim = choose_victim_process(info, p);
+		assert(victim->resident > 0);
+		frame = info->policy->evict(victim->policy_state, page_key(p->id, vpn));
+		assert(info->frames[frame].pid == victim->id);
+	}
+	assert(frame < info->free_list_count);
+
+	return frame;
+}
+
+// Returns the frame that will hold vpn of p, a free one if any, otherwise
+// one freed by evicting pages. Adds the write-backs needed to write_backs.
+static unsigned int take_frame(os_memory_info * info, process * p, unsigned int vpn, unsigned int * write_backs) {
+	unsigned int frame;
+
+	if (info->block_used == NULL) {
+		if (info->free_list_index < info->free_list_count) {
+			return info->free_list_index++;
+		}
+		frame = choose_victim(info, p, vpn);
+		evict_frame(info, frame, false, write_backs);
+		return frame;
+	}
+
+	// Evicting a huge page frees all its frames, splitting it at least one
+	while (info->free_frames == 0) {
+		evict_frame(info, choose_victim(info, p, vpn), info->config.demote, write_backs);
+	}
+	return find_free_frame(info);
 }
 
-access_result access_memory(unsigned int pid, unsigned int virtual_address) {
+// Loads page, vpn of p, into a frame and returns it
+static unsigned int load_page(os_memory_info * info, process * p, unsigned int vpn, virtual_page * page, unsigned int * write_backs) {
+	unsigned int frame = take_frame(info, p, vpn, write_backs);
+
+	page->valid = true;
+	page->dirty = false;
+	page->prefetched = false;
+	page->huge = false;
+	page->physical_page = frame;
+	claim_frame(info, frame, p->id, vpn);
+	if (++p->resident > p->peak_resident) {
+		p->peak_resident = p->resident;
+	}
+	LOG_MSG("VPN %d is allocated and mapped with physical page %d", vpn, frame);
+
+	return frame;
+}
+
+// Returns whether the fault on vpn of p maps its region with a huge page:
+// where they are allowed and a block is free, on the first fault of the
+// region with HUGE_PAGES_ALWAYS or when promote_threshold of its pages are
+// then in memory
+static bool maps_huge(os_memory_info * info, process * p, unsigned int vpn) {
+	unsigned int region = vpn >> info->huge_shift, resident = 0, i;
+	const virtual_page * first;
+
+	if (info->huge_ratio == 1 || info->free_blocks == 0 || region < info->huge_first || region >= info->huge_last) {
+		return false;
+	}
+
+	first = find_page(info, p, region << info->huge_shift, false);
+	for (i = 0; i < info->huge_ratio; i++) {
+		resident += first[i].valid;
+	}
+
+	if (resident == 0 && info->config.huge_pages == HUGE_PAGES_ALWAYS) {
+		return true;
+	}
+	return resident + 1 >= info->promote_threshold;
+}
+
+// Maps the region of vpn of p with a huge page in a free block and returns
+// the frame of vpn. The pages of the region in memory move into it, the
+// others are loaded along with vpn and added to prefetched.
+static unsigned int map_huge(os_memory_info * info, process * p, unsigned int vpn, unsigned int * prefetched) {
+	unsigned int region = vpn & ~(info->huge_ratio - 1), frame = find_block(info, false) << info->huge_shift, moved = 0, loaded = 0, i;
+	virtual_page * first = find_page(info, p, region, false), * page;
+
+	for (i = 0; i < info->huge_ratio; i++, frame++) {
+		page = &first[i];
+		if (page->valid) {
+			// The policy gets the huge page instead
+			info->policy->forget(p->policy_state, page->physical_page);
+			invalidate_translation(info, p->id, region + i, false);
+			free_frame(info, page->physical_page);
+			p->resident--;
+			moved++;
+		} else {
+			page->valid = true;
+			page->dirty = false;
+			page->prefetched = region + i != vpn;
+			loaded += page->prefetched;
+		}
+		page->huge = true;
+		page->physical_page = frame;
+		claim_frame(info, frame, p->id, region + i);
+	}
+
+	p->resident += info->huge_ratio;
+	if (p->resident > p->peak_resident) {
+		p->peak_resident = p->resident;
+	}
+	*prefetched += loaded;
+	info->prefetches += loaded;
+	if (moved > 0) {
+		info->promotions++;
+	} else {
+		info->huge_faults++;
+	}
+	LOG_MSG("VPN %d to %d are mapped with a huge page, %d moved", region, region + info->huge_ratio - 1, moved);
+
+	return first[vpn - region].physical_page;
+}
+
+// Loads up to prefetch_pages pages of p continuing vpn by stride that are not
+// in memory yet and returns how many
+static unsigned int prefetch(os_memory_info * info, process * p, unsigned int vpn, int stride, unsigned int * write_backs) {
+	long long next = vpn;
+	unsigned int loaded = 0, frame, i;
+	virtual_page * page;
+
+	for (i = 0; i < info->config.prefetch_pages; i++) {
+		next += stride;
+		if (next < 0 || next >= info->page_table_count) {
+			break;
+		}
+
+		page = find_page(info, p, next, true);
+		if (!page->valid) {
+			LOG_MSG("Prefetching VPN %lld", next);
+			frame = load_page(info, p, next, page, write_backs);
+			page->prefetched = true;
+			info->policy->access(p->policy_state, frame, page_key(p->id, next), true, info->accesses);
+			loaded++;
+		}
+	}
+
+	info->prefetches += loaded;
+	return loaded;
+}
+
+// Follows the distance between the pages p accesses for stride prefetching
+static void update_stride(process * p, unsigned int vpn) {
+	int stride = (int)(vpn - p->last_vpn);
+
+	if (vpn != p->last_vpn) {
+		p->stride_confirmed = stride == p->stride;
+		p->stride = stride;
+		p->last_vpn = vpn;
+	}
+}
+
+// Counts the pages of p accessed in the last working_set_window accesses,
+// page being accessed now, and makes it the allocation of p
+static void update_working_set(os_memory_info * info, process * p, virtual_page * page, unsigned long long now) {
+	unsigned int window = info->working_set_window, position = now % window;
+	virtual_page * expired = p->window[position];
+
+	// The access made window accesses ago leaves the window, its page too
+	// unless accessed since
+	if (now > window && expired->last_accessed == now - window) {
+		p->working_set--;
+	}
+	if (page->last_accessed == 0 || page->last_accessed + window <= now) {
+		p->working_set++;
+	}
+
+	p->window[position] = page;
+	p->allocation = p->working_set;
+}
+
+// Gives p one more frame when it faults again soon, one less when it faults
+// again late, at least one
+static void update_fault_frequency(os_memory_info * info, process * p, unsigned long long now) {
+	unsigned long long interval = now - p->last_fault;
+
+	if (interval < info->fault_interval_low) {
+		p->allocation = p->resident + 1;
+	} else if (interval > info->fault_interval_high) {
+		p->allocation = p->resident > 1 ? p->resident - 1 : 1;
+	}
+}
+
+access_result access_memory(os_memory_info * info, unsigned int pid, unsigned int virtual_address, bool write) {
 	access_result result;
-	unsigned int i, vpn, offset, lru_vpn;
-	time_spec min_time;
+	unsigned int vpn, offset, asid = info->config.tlb_asid ? pid : 0;
+	virtual_page * page = NULL;
+	unsigned long long now, key;
+	unsigned int frame;
+	process * p;
 
-	assert(pid < config.processes);
-	assert(pid == info.processes[pid].id);
+	assert(pid < info->config.processes);
+	assert(pid == info->processes[pid].id);
+	p = &info->processes[pid];
 
 	LOG_MSG("Accessing virtual address %d for process %d", virtual_address, pid);
 
-	offset = get_bits(virtual_address, 0, info.offset_bits_count);
-	vpn = get_bits(virtual_address, info.offset_bits_count, info.virtual_page_number_bits_count);
+	offset = page_offset(info, virtual_address);
+	vpn = page_number(info, virtual_address);
 
 	LOG_MSG("VPN %d and offset %d", vpn, offset);
 
-	assert(vpn < info.page_table_count);
-	assert(offset < info.page_size);
-	result.page_fault = !info.processes[pid].page_table[vpn].valid;
+	assert(vpn < info->page_table_count);
+	assert(offset < info->page_size);
 
+	if (info->tlb != NULL) {
+		if (!info->config.tlb_asid && pid != info->running_pid) {
+			LOG_MSG("Switching from process %d to %d flushes the TLB", info->running_pid, pid);
+			tlb_flush_all(info->tlb);
+		}
+		page = tlb_lookup(info->tlb, asid, vpn, false);
+		if (page == NULL && info->huge_ratio > 1) {
+			page = tlb_lookup(info->tlb, asid, vpn >> info->huge_shift, true);
+			if (page != NULL) {
+				page += vpn & (info->huge_ratio - 1);
+			}
+		}
+	}
+	info->running_pid = pid;
+	result.tlb_hit = page != NULL;
+
+	// Only valid pages are cached by the TLB
+	if (result.tlb_hit) {
+		LOG_MSG("TLB hit for VPN %d", vpn);
+		info->tlb_hits++;
+		result.page_fault = false;
+	} else {
+		page = find_page(info, p, vpn, true);
+		result.page_fault = !page->valid;
+	}
+
+	now = ++p->accesses;
+	if (info->config.frame_allocation == ALLOCATE_WORKING_SET) {
+		update_working_set(info, p, page, now);
+	}
+	if (info->config.prefetch == PREFETCH_STRIDE) {
+		update_stride(p, vpn);
+	}
+
+	result.prefetched = 0;
+	result.write_backs = 0;
 	if (result.page_fault) {
-		if (info.free_list_index < info.free_list_count) {
-			// a free physical page is available
-			result.physical_page_number = info.free_list_index++;
+		if (info->config.frame_allocation == ALLOCATE_FAULT_FREQUENCY) {
+			update_fault_frequency(info, p, now);
+		}
+		if (maps_huge(info, p, vpn)) {
+			result.physical_page_number = map_huge(info, p, vpn, &result.prefetched);
 		} else {
-			time_now(&min_time);
-			lru_vpn = INT_MAX;
-			LOG_MSG("Finding LUR page for vpn %d with initial time microsec %d-%s", vpn, min_time.tv_nsec, ctime(&min_time.tv_sec));
-
-			for (i = 0; i < info.page_table_count; i++) {
-				if (!info.processes[pid].page_table[i].valid) {
-					continue;
-				}
-
-				if (smaller_than(info.processes[pid].page_table[i].last_accessed, min_time)) {
-					LOG_MSG("Candidate LUR page for vpn %d is %d", vpn, i);
-					lru_vpn = i;
-					min_time = info.processes[pid].page_table[i].last_accessed;
-				}
+			// Prefetched pages are loaded first, their evictions cannot take
+			// the faulting page
+			if (info->config.prefetch == PREFETCH_SEQUENTIAL) {
+				result.prefetched = prefetch(info, p, vpn, 1, &result.write_backs);
+			} else if (info->config.prefetch == PREFETCH_STRIDE && p->stride_confirmed) {
+				result.prefetched = prefetch(info, p, vpn, p->stride, &result.write_backs);
 			}
+			result.physical_page_number = load_page(info, p, vpn, page, &result.write_backs);
+		}
+		info->page_faults++;
+		p->page_faults++;
+		p->last_fault = now;
 
-			LOG_MSG("Found LUR page %d for VPN %d", lru_vpn, vpn);
-			assert(lru_vpn != INT_MAX);
-			result.physical_page_number = info.processes[pid].page_table[lru_vpn].physical_page;
-			info.processes[pid].page_table[lru_vpn].valid = false;
+	} else {
+		assert(page->valid);
+		result.physical_page_number = page->physical_page;
+		if (page->prefetched) {
+			info->prefetch_hits++;
+			page->prefetched = false;
 		}
+	}
 
-		info.processes[pid].page_table[vpn].valid = true;
-		info.processes[pid].page_table[vpn].physical_page = result.physical_page_number;
-		LOG_MSG("VPN %d is allocated and mapped with physical page %d", vpn, result.physical_page_number);
+	if (write) {
+		info->writes++;
+		page->dirty = true;
+	}
 
-	} else {
-		assert(info.processes[pid].page_table[vpn].valid);
-		result.physical_page_number = info.processes[pid].page_table[vpn].physical_page;
+	// The access itself, a page table walk without a TLB hit and the reads
+	// and writes of a fault
+	result.cost = info->cost.memory;
+	if (!result.tlb_hit) {
+		result.cost += info->page_table_levels * info->cost.memory;
 	}
+	if (result.page_fault) {
+		result.cost += info->cost.fault + result.prefetched * info->cost.transfer + result.write_backs * info->cost.write_back;
+	}
+	info->simulated_ns += result.cost;
+	p->simulated_ns += result.cost;
 
-	time_now(&info.processes[pid].page_table[vpn].last_accessed);
+	if (info->tlb != NULL) {
+		if (!result.tlb_hit && page->huge) {
+			tlb_insert(info->tlb, asid, vpn >> info->huge_shift, true, page - (vpn & (info->huge_ratio - 1)));
+		} else if (!result.tlb_hit) {
+			tlb_insert(info->tlb, asid, vpn, false, page);
+		}
+		info->tlb_reach_sum += ((unsigned long long)(info->tlb->used - info->tlb->huge) + ((unsigned long long)info->tlb->huge << info->huge_shift)) * info->page_size;
+	}
+
+	// The policy sees a huge page as its first frame and page
+	frame = result.physical_page_number;
+	key = page_key(pid, vpn);
+	if (page->huge) {
+		frame &= ~(info->huge_ratio - 1);
+		key = page_key(pid, vpn & ~(info->huge_ratio - 1));
+	}
+	info->policy->access(p->policy_state, frame, key, result.page_fault, info->accesses++);
+	page->last_accessed = now;
+	p->resident_sum += p->resident;
 
 	result.virtual_page_number = vpn;
-	result.physical_address = info.free_list[result.physical_page_number].start_address + offset;
-	assert(result.physical_address <= info.free_list[result.physical_page_number].end_address);
+	result.physical_address = info->free_list[result.physical_page_number].start_address + offset;
+	assert(result.physical_address <= info->free_list[result.physical_page_number].end_address);
 
 	LOG_MSG("Access is done, the physical address is %d", result.physical_address);
-	LOG_MSG("Access time is microsec %d-%s",
-			info.processes[pid].page_table[vpn].last_accessed.tv_nsec,
-			ctime(&info.processes[pid].page_table[vpn].last_accessed.tv_sec));
+	LOG_MSG("Access %llu of process %d", page->last_accessed, pid);
 
 	return result;
 }
 
-void destroy_page_manager() {
+// An access of the trace, ordered by page and then by position
+typedef struct {
+	unsigned long long page; // pid in the high half, vpn in the low half
+	unsigned long long index;
+} trace_entry;
+
+static int compare_trace_entries(const void * left, const void * right) {
+	const trace_entry * l = left, * r = right;
+	if (l->page != r->page) return l->page < r->page ? -1 : 1;
+	return l->index < r->index ? -1 : l->index > r->index;
+}
+
+void flush_tlb(os_memory_info * info, unsigned int pid) {
+	assert(pid < info->config.processes);
+	if (info->tlb != NULL) {
+		tlb_flush(info->tlb, info->config.tlb_asid ? pid : 0);
+	}
+}
+
+void flush_whole_tlb(os_memory_info * info) {
+	if (info->tlb != NULL) {
+		tlb_flush_all(info->tlb);
+	}
+}
+
+void set_future_accesses(os_memory_info * info, const memory_access * trace, unsigned long long count) {
+	trace_entry * entries;
+	unsigned long long i;
+
+	assert(info->accesses == 0);
+	info->next_accesses = safe_malloc(count * sizeof(unsigned long long));
+	info->future_count = count;
+
+	// Sorting the accesses by page puts the next access of every page right
+	// after it, without a table as large as the virtual address space
+	entries = safe_malloc(count * sizeof(trace_entry));
+	for (i = 0; i < count; i++) {
+		assert(trace[i].pid < info->config.processes);
+		entries[i].page = page_key(trace[i].pid, page_number(info, trace[i].virtual_address));
+		entries[i].index = i;
+	}
+
+	qsort(entries, count, sizeof(trace_entry), compare_trace_entries);
+	for (i = 0; i < count; i++) {
+		info->next_accesses[entries[i].index] = i + 1 < count && entries[i + 1].page == entries[i].page ? entries[i + 1].index : NO_NEXT_ACCESS;
+	}
+
+	safe_free(entries);
+}
+
+void destroy_page_manager(os_memory_info * info) {
 	int i;
 
-	safe_free(info.free_list);
+	safe_free(info->free_list);
 
-	for (i = 0; i < config.processes; i++) {
-		safe_free(info.processes[i].page_table);
+	for (i = 0; i < info->config.processes; i++) {
+		if (info->config.replacement_scope == LOCAL_REPLACEMENT || i == 0) {
+			info->policy->destroy(info->processes[i].policy_state);
+		}
+		free_level(info, info->processes[i].page_table, 0);
+		if (info->processes[i].window != NULL) {
+			safe_free(info->processes[i].window);
+		}
+	}
+
+	safe_free(info->frames);
+	if (info->block_used != NULL) {
+		safe_free(info->block_used);
+	}
+	if (info->tlb != NULL) {
+		destroy_tlb(info->tlb);
+		info->tlb = NULL;
+	}
+	if (info->next_accesses != NULL) {
+		safe_free(info->next_accesses);
+		info->next_accesses = NULL;
 	}
 
-	safe_free(info.processes);
+	safe_free(info->processes);
+	safe_free(info);
 
-	assert(allocated_chunks == 0);
-	write_log2("page_manager destroyed!\n");
+	LOG_DEBUG("page_manager destroyed!");
 }
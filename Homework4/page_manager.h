@@ -2,20 +2,150 @@
 #define _PAGE_MANAGER_H_
 
 #include "utility.h"
-#include <time.h>
+#include <limits.h>
+
+// No page or frame, ends the lists kept by the replacement policies
+#define NO_PAGE (UINT_MAX)
+
+// State of one simulated machine, any number of them can exist at once
+typedef struct os_memory_info_t os_memory_info;
+
+// Chooses which page leaves memory when a page fault finds no free frame.
+// With local replacement every process gets its own state and the victim
+// belongs to that process, with global replacement a single state sees the
+// accesses of every process and the victim can belong to any of them.
+// Pages are identified by page_key.
+typedef struct {
+	const char * name;
+	// Creates the state of one process of info, or of all of them, frames is
+	// the number of physical pages
+	void * (*create)(unsigned int frames, const os_memory_info * info);
+	void (*destroy)(void * state);
+	// page was accessed, held in frame. fault is true when it was just loaded
+	// there, time counts the accesses since initialization.
+	void (*access)(void * state, unsigned int frame, unsigned long long page, bool fault, unsigned long long time);
+	// Returns the frame of a page to evict before page is loaded and forgets
+	// it. Never called while the state holds no frame.
+	unsigned int (*evict)(void * state, unsigned long long page);
+	// Forgets frame, whose page left memory without being chosen by evict
+	void (*forget)(void * state, unsigned int frame);
+} replacement_policy;
+
+// Least recently used page
+extern const replacement_policy lru_policy;
+// Frames on a ring swept by a hand that clears reference bits, the victim is
+// the first frame found with its bit clear
+extern const replacement_policy clock_policy;
+// FIFO queue where a referenced page goes back to the tail once with its bit
+// cleared, same victims as clock_policy with a list instead of a ring
+extern const replacement_policy second_chance_policy;
+// 2Q: new pages enter a FIFO, pages referenced again after leaving it while
+// still remembered go to an LRU list
+extern const replacement_policy two_queue_policy;
+// Adaptive replacement cache, balances recency and frequency lists using the
+// pages it recently evicted from each
+extern const replacement_policy arc_policy;
+// Least frequently used page since it was loaded, the least recently used among equals
+extern const replacement_policy lfu_policy;
+// Belady's optimal policy: the page used again the farthest in the future.
+// Needs the whole trace from set_future_accesses.
+extern const replacement_policy opt_policy;
+
+// Returns the policy with the given name or NULL
+const replacement_policy * find_replacement_policy(const char * name);
+
+// Where the victim of a page fault is looked for
+#define LOCAL_REPLACEMENT (0)   // among the pages of the faulting process
+#define GLOBAL_REPLACEMENT (1)  // among every page
+
+// How many frames a process may hold with local replacement. A process below
+// its allocation takes a free frame, or a frame of a process above its own,
+// before evicting one of its pages. A process holding no frame always gets one.
+#define ALLOCATE_ON_DEMAND (0)      // as many as it can get
+#define ALLOCATE_WORKING_SET (1)    // its pages accessed in the last window accesses
+#define ALLOCATE_FAULT_FREQUENCY (2) // one more after a fault less than fault_interval_low accesses
+                                     // after the previous one, one less after more than fault_interval_high
+
+// Defaults of the frame allocation parameters, in accesses of the process
+#define WORKING_SET_WINDOW (10000)
+#define FAULT_INTERVAL_LOW (100)
+#define FAULT_INTERVAL_HIGH (1000)
+
+// Pages loaded along with a faulting page. Sequential prefetching loads the
+// pages following it, stride prefetching the pages continuing the distance
+// between the last pages the process accessed when the last two were equal.
+#define PREFETCH_NONE (0)
+#define PREFETCH_SEQUENTIAL (1)
+#define PREFETCH_STRIDE (2)
+
+// Latencies of the simulated machine in nanoseconds, 0 for the default
+typedef struct {
+	unsigned int memory;      /* one memory access, a page table walk makes one per level */
+	unsigned int fault;       /* reading a page from the backing store */
+	unsigned int transfer;    /* every page prefetched by the same read */
+	unsigned int write_back;  /* writing a dirty page before its frame is reused */
+} io_cost;
+
+// Defaults of io_cost, a solid state drive
+#define MEMORY_COST_NS (100)
+#define FAULT_COST_NS (100000)
+#define TRANSFER_COST_NS (10000)
+#define WRITE_BACK_COST_NS (100000)
+
+// When pages of huge_page_size bytes, a power of 2 times page_size and at
+// most a last level page table of pages, map the aligned regions of that size.
+// A huge page takes a free aligned block of frames and a single TLB entry,
+// without a free block a fault loads a page as usual. It is loaded whole, the
+// pages of its region already in memory move into it.
+#define HUGE_PAGES_NEVER (0)
+#define HUGE_PAGES_ALWAYS (1)   // on the first fault in a region, and when promoted
+#define HUGE_PAGES_PROMOTE (2)  // when a fault brings promote_threshold pages of a region in memory
+
+// Default huge page size, and of promote_threshold in pages of a region
+#define HUGE_PAGE_SIZE (2u << 20)
+#define PROMOTE_THRESHOLD(pages) ((pages) / 2)
 
 typedef struct {
 	unsigned int physical_address_space;  /* in bits, between 2 and 32 (inclusive) */
 	unsigned int virtual_address_space;   /* in bits, between 2 and 32 (inclusive) */
 	unsigned int page_size;               /* in bytes, a power of 2 */
 	unsigned int processes;               /* positive */
+	const replacement_policy * policy;    /* lru_policy when NULL */
+	unsigned int tlb_entries;             /* 0 for no TLB */
+	unsigned int tlb_ways;                /* entries per set dividing tlb_entries, 0 for fully associative */
+	bool tlb_asid;                        /* entries tagged with the pid, otherwise flushed on every process switch */
+	byte replacement_scope;               /* LOCAL_REPLACEMENT or GLOBAL_REPLACEMENT */
+	byte frame_allocation;                /* ALLOCATE_*, ALLOCATE_ON_DEMAND with global replacement */
+	unsigned int working_set_window;      /* WORKING_SET_WINDOW when 0 */
+	unsigned int fault_interval_low;      /* FAULT_INTERVAL_LOW when both are 0 */
+	unsigned int fault_interval_high;     /* FAULT_INTERVAL_HIGH when both are 0 */
+	byte prefetch;                        /* PREFETCH_*, PREFETCH_NONE with opt_policy */
+	unsigned int prefetch_pages;          /* most pages prefetched by a fault */
+	io_cost cost;
+	byte huge_pages;                      /* HUGE_PAGES_*, HUGE_PAGES_NEVER with opt_policy */
+	unsigned int huge_page_size;          /* HUGE_PAGE_SIZE when 0 */
+	unsigned int promote_threshold;       /* PROMOTE_THRESHOLD when 0 */
+	bool demote;                          /* a huge victim with pages never accessed is split, only those leave */
+	unsigned int huge_start;              /* virtual addresses where huge pages may be, */
+	unsigned int huge_end;                /* to the end of the address space when huge_end is 0 */
 } memory_config;
 
+// One access of a trace
+typedef struct {
+	unsigned int pid;
+	unsigned int virtual_address;
+	byte write;                         /* zero for reads */
+} memory_access;
+
 typedef struct {
 	unsigned int virtual_page_number;
 	unsigned int physical_page_number;
 	unsigned int physical_address;
 	char page_fault;                    /* zero means false, non-zero means true */
+	char tlb_hit;                       /* non-zero when the TLB held the translation */
+	unsigned int prefetched;            /* pages loaded along with the faulting one */
+	unsigned int write_backs;           /* dirty pages written back to free their frames */
+	unsigned int cost;                  /* simulated latency in nanoseconds */
 } access_result;
 
 typedef struct {
@@ -25,34 +155,234 @@ typedef struct {
 
 typedef struct {
 	byte valid;
+	// Written since loaded
+	byte dirty;
+	// Loaded by a prefetch or along with a huge page and not accessed since
+	byte prefetched;
+	// Part of a huge page, the entries of its region all are
+	byte huge;
 	unsigned int physical_page;
-	time_spec last_accessed;
+	// Value of the access counter of the process after the last access, 0
+	// before the first one
+	unsigned long long last_accessed;
 } virtual_page;
 
+// No TLB entry, free entries have this key
+#define NO_TLB_KEY (ULLONG_MAX)
+
+// Translation lookaside buffer caching page table entries. A page can only
+// be cached in the set of ways entries picked by its number, every set
+// replaces its least recently used entry. Entries are found through an open
+// addressing table whatever the associativity, so a hit costs one probe.
+typedef struct {
+	unsigned int entries;
+	unsigned int ways;
+	unsigned int sets;
+	// Address space id in the high 31 bits, whether the entry maps a huge
+	// page in bit 32 and the page number in the low half of every entry,
+	// NO_TLB_KEY when free
+	unsigned long long * keys;
+	virtual_page ** pages;
+	// Value of clock at the last use of every entry, 0 when free. Entries of a
+	// set are contiguous, a miss takes the one with the smallest value.
+	unsigned long long * last_used;
+	unsigned long long clock;
+	// Entry of every key, NO_PAGE in empty slots
+	unsigned int * slots;
+	unsigned int slots_mask;
+	// Entries in use and how many of them map huge pages
+	unsigned int used;
+	unsigned int huge;
+} tlb;
+
+// ways is 0 for a fully associative TLB
+tlb * create_tlb(unsigned int entries, unsigned int ways);
+
+void destroy_tlb(tlb * t);
+
+// Returns the page table entry cached for vpn of address space asid or NULL.
+// Huge pages are cached apart, vpn is then the number of the huge page and
+// the entry the one of its first page.
+virtual_page * tlb_lookup(tlb * t, unsigned int asid, unsigned int vpn, bool huge);
+
+// Caches the page table entry of vpn, which must not be cached yet
+void tlb_insert(tlb * t, unsigned int asid, unsigned int vpn, bool huge, virtual_page * page);
+
+// Drops the entry of vpn if cached
+void tlb_invalidate(tlb * t, unsigned int asid, unsigned int vpn, bool huge);
+
+// Drops every entry of address space asid
+void tlb_flush(tlb * t, unsigned int asid);
+
+// Drops every entry
+void tlb_flush_all(tlb * t);
+
+// Virtual page number bits resolved by every level of a page table. Tables
+// are radix trees whose levels are allocated on the first access below them.
+// Compile with -DFLAT_PAGE_TABLES to give every process a single level
+// instead, one entry per virtual page allocated on its first access.
+#define PAGE_TABLE_LEVEL_BITS (10)
+#define PAGE_TABLE_MAX_LEVELS (4)
+
 typedef struct {
 	unsigned int id;
-	virtual_page * page_table;
+	// Root of the page table, NULL until the first access. With a single
+	// level it is an array of virtual_page, otherwise an array of pointers
+	// to the next level, the last level holding virtual_page arrays.
+	void * page_table;
+	// Accesses made by this process, its logical clock
+	unsigned long long accesses;
+	// State of the replacement policy for this process, shared by every
+	// process with global replacement
+	void * policy_state;
+	unsigned long long page_faults;
+	// Pages of the process evicted, by any process
+	unsigned long long evictions;
+	// Frames held now, at most and summed over the accesses of the process
+	unsigned int resident;
+	unsigned int peak_resident;
+	unsigned long long resident_sum;
+	// Frames the process may hold, see ALLOCATE_*
+	unsigned int allocation;
+	// Pages accessed in the working set window and the page of each of the
+	// last window accesses, at the position of its access modulo the window
+	unsigned int working_set;
+	virtual_page ** window;
+	// Value of accesses at the last page fault
+	unsigned long long last_fault;
+	unsigned long long write_backs;
+	// Simulated latency of the accesses of the process in nanoseconds
+	unsigned long long simulated_ns;
+	// Last page accessed and the distance from the one before, confirmed
+	// when it was also the distance before that
+	unsigned int last_vpn;
+	int stride;
+	bool stride_confirmed;
 } process;
 
+// Owner of a physical page
 typedef struct {
-	unsigned int physical_memory;
-	unsigned int virtual_memory;
+	unsigned int pid;
+	unsigned int virtual_page;
+} frame_owner;
+
+struct os_memory_info_t {
+	memory_config config;
+	unsigned long long physical_memory;
+	unsigned long long virtual_memory;
 	unsigned int page_size;
 	unsigned int free_list_count;
 	unsigned int free_list_index;
 	unsigned int virtual_page_number_bits_count;
 	unsigned int offset_bits_count;
-	unsigned int page_table_count;
+	// Masks of the offset and of the virtual page number once shifted down
+	unsigned int offset_mask;
+	unsigned int virtual_page_number_mask;
+	unsigned long long page_table_count;
+	// Levels of every page table, the last one holds the pages
+	unsigned int page_table_levels;
+	// Shift and mask of the index of every level in a virtual page number,
+	// levels are numbered from the root and the root takes the bits left over
+	unsigned int level_shift[PAGE_TABLE_MAX_LEVELS];
+	unsigned int level_mask[PAGE_TABLE_MAX_LEVELS];
+	// Bytes allocated for the page tables of every process
+	unsigned long long page_table_bytes;
 	physical_page * free_list;
+	frame_owner * frames;
 	process * processes;
-} os_memory_info;
+	const replacement_policy * policy;
+	// Accesses made by every process, the logical clock given to the policy
+	unsigned long long accesses;
+	unsigned long long page_faults;
+	// NULL when the configuration has no TLB
+	tlb * tlb;
+	unsigned long long tlb_hits;
+	unsigned long long writes;
+	unsigned long long write_backs;
+	unsigned long long prefetches;
+	// Prefetched pages accessed before leaving memory
+	unsigned long long prefetch_hits;
+	unsigned long long simulated_ns;
+	// Latencies, defaults resolved
+	io_cost cost;
+	// Pages in a huge page and its log2, 1 and 0 without huge pages
+	unsigned int huge_ratio;
+	unsigned int huge_shift;
+	// Huge pages allowed from huge_first to huge_last (exclusive), in huge pages
+	unsigned int huge_first;
+	unsigned int huge_last;
+	unsigned int promote_threshold;
+	// With huge pages, frames in use in every block of huge_ratio frames, how
+	// many frames and whole blocks are free and the block last allocated
+	// from. Free frames have NO_PAGE as pid.
+	unsigned int * block_used;
+	unsigned int free_frames;
+	unsigned int free_blocks;
+	unsigned int block_cursor;
+	// Huge pages mapped by first faults and by promotions, and huge victims split
+	unsigned long long huge_faults;
+	unsigned long long promotions;
+	unsigned long long demotions;
+	// Bytes mapped by the TLB entries summed over the accesses
+	unsigned long long tlb_reach_sum;
+	// Process of the last access, a switch flushes a TLB without address space ids
+	unsigned int running_pid;
+	// Frame allocation parameters, defaults resolved
+	unsigned int working_set_window;
+	unsigned int fault_interval_low;
+	unsigned int fault_interval_high;
+	// Index of the next access to the same page by the same process for every
+	// access of the trace given to set_future_accesses, NO_NEXT_ACCESS if none
+	unsigned long long * next_accesses;
+	unsigned long long future_count;
+};
+
+#define NO_NEXT_ACCESS (ULLONG_MAX)
+
+// Compile with -DFIXED_PAGE_SIZE=<bytes> to decode addresses with constant
+// shifts and masks. Every configuration must then use that page size.
+#ifdef FIXED_PAGE_SIZE
+#define OFFSET_BITS_COUNT (__builtin_ctz(FIXED_PAGE_SIZE))
+#define OFFSET_MASK (FIXED_PAGE_SIZE - 1u)
+#else
+#define OFFSET_BITS_COUNT (info->offset_bits_count)
+#define OFFSET_MASK (info->offset_mask)
+#endif
+
+// Offset of a virtual address in its page
+static inline unsigned int page_offset(const os_memory_info * info, unsigned int virtual_address) {
+	return virtual_address & OFFSET_MASK;
+}
+
+// Identifies a page among those of every process
+static inline unsigned long long page_key(unsigned int pid, unsigned int vpn) {
+	return (unsigned long long)pid << 32 | vpn;
+}
+
+// Virtual page number of a virtual address, bits above the virtual address
+// space are ignored
+static inline unsigned int page_number(const os_memory_info * info, unsigned int virtual_address) {
+	return virtual_address >> OFFSET_BITS_COUNT & info->virtual_page_number_mask;
+}
+
+// Creates a simulated machine. Machines share nothing, different threads can
+// use different machines at the same time.
+os_memory_info * initialize_page_manager(memory_config mc);
+
+void destroy_page_manager(os_memory_info * info);
 
-os_memory_info info;
+// Reads or writes virtual_address for process pid
+access_result access_memory(os_memory_info * info, unsigned int pid, unsigned int virtual_address, bool write);
 
-void initialize_page_manager(memory_config mc);
+// Drops the TLB entries of process pid, like an operating system reusing its
+// address space id
+void flush_tlb(os_memory_info * info, unsigned int pid);
 
-void destroy_page_manager();
+// Drops every TLB entry
+void flush_whole_tlb(os_memory_info * info);
 
-access_result access_memory(unsigned int pid, unsigned int virtual_address);
+// Tells the page manager the whole trace that will be replayed, in order,
+// before the first access_memory. Only opt_policy needs it.
+void set_future_accesses(os_memory_info * info, const memory_access * trace, unsigned long long count);
 
 #endif
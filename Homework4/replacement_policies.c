@@ -0,0 +1,597 @@
+#include "page_manager.h"
+#include <string.h>
+#include <assert.h>
+
+// Where a frame or a remembered page is in the lists of a policy
+#define NOWHERE (0)
+#define RECENT (1)          // 2Q A1in, ARC T1
+#define FREQUENT (2)        // 2Q Am, ARC T2
+#define RECENT_GHOST (3)    // 2Q A1out, ARC B1
+#define FREQUENT_GHOST (4)  // ARC B2
+
+// Share of the frames of a process 2Q gives to its FIFO and how many evicted
+// pages it remembers, in percent, as suggested by Johnson and Shasha
+#define TWO_QUEUE_IN_SHARE (25)
+#define TWO_QUEUE_OUT_SHARE (50)
+
+// Doubly linked list threaded through the previous and next arrays of a
+// policy, its nodes are frames and, for the policies remembering evicted
+// pages, ghost nodes numbered from the frame count
+typedef struct {
+	unsigned int head; // oldest
+	unsigned int tail; // newest
+	unsigned int count;
+} node_list;
+
+// Open addressing table from page keys to ghost nodes
+typedef struct {
+	unsigned long long * keys;
+	unsigned int * values;
+	unsigned int capacity;
+} ghost_table;
+
+// State shared by every policy of this file, each uses what it needs
+typedef struct {
+	// Machine of the process, OPT reads the future accesses of its trace
+	const os_memory_info * info;
+	unsigned int frames;
+	unsigned int * previous;
+	unsigned int * next;
+	byte * where;
+	byte * referenced;
+	// Page held by every frame, then page remembered by every ghost node
+	unsigned long long * pages;
+	node_list lists[FREQUENT_GHOST + 1];
+	// Ghost nodes not in use
+	unsigned int * free_ghosts;
+	unsigned int free_ghosts_count;
+	ghost_table ghosts;
+	// Clock hand, NO_PAGE while the ring is empty
+	unsigned int hand;
+	// ARC target size of its recency list
+	unsigned int target;
+	// Binary min-heap of frames ordered by (primary, secondary) keys and the
+	// position of every frame in it
+	unsigned int * heap;
+	unsigned int * heap_positions;
+	unsigned int heap_count;
+	unsigned long long * primary_keys;
+	unsigned long long * secondary_keys;
+} policy_state;
+
+static policy_state * create_state(unsigned int frames, unsigned int ghosts, bool heap, const os_memory_info * info) {
+	policy_state * state = safe_malloc(sizeof(policy_state));
+	unsigned int i, nodes = frames + ghosts;
+
+	state->info = info;
+	state->frames = frames;
+	state->previous = safe_malloc(nodes * sizeof(unsigned int));
+	state->next = safe_malloc(nodes * sizeof(unsigned int));
+	state->where = safe_malloc(nodes);
+	state->referenced = safe_malloc(frames);
+	state->pages = safe_malloc(nodes * sizeof(unsigned long long));
+	for (i = 0; i <= FREQUENT_GHOST; i++) {
+		state->lists[i].head = NO_PAGE;
+		state->lists[i].tail = NO_PAGE;
+	}
+
+	state->free_ghosts = safe_malloc(ghosts * sizeof(unsigned int));
+	for (i = 0; i < ghosts; i++) {
+		state->free_ghosts[i] = nodes - 1 - i;
+	}
+	state->free_ghosts_count = ghosts;
+
+	if (ghosts > 0) {
+		// Less than half full, probes stay short
+		for (state->ghosts.capacity = 1; state->ghosts.capacity < 2 * ghosts; state->ghosts.capacity *= 2);
+		state->ghosts.keys = safe_malloc(state->ghosts.capacity * sizeof(unsigned long long));
+		state->ghosts.values = safe_malloc(state->ghosts.capacity * sizeof(unsigned int));
+		memset(state->ghosts.values, 0xFF, state->ghosts.capacity * sizeof(unsigned int));
+	}
+
+	state->hand = NO_PAGE;
+	if (heap) {
+		state->heap = safe_malloc(frames * sizeof(unsigned int));
+		state->heap_positions = safe_malloc(frames * sizeof(unsigned int));
+		state->primary_keys = safe_malloc(frames * sizeof(unsigned long long));
+		state->secondary_keys = safe_malloc(frames * sizeof(unsigned long long));
+	}
+
+	return state;
+}
+
+static void destroy_state(void * opaque) {
+	policy_state * state = opaque;
+
+	safe_free(state->previous);
+	safe_free(state->next);
+	safe_free(state->where);
+	safe_free(state->referenced);
+	safe_free(state->pages);
+	safe_free(state->free_ghosts);
+	if (state->ghosts.capacity > 0) {
+		safe_free(state->ghosts.keys);
+		safe_free(state->ghosts.values);
+	}
+	if (state->heap != NULL) {
+		safe_free(state->heap);
+		safe_free(state->heap_positions);
+		safe_free(state->primary_keys);
+		safe_free(state->secondary_keys);
+	}
+	safe_free(state);
+}
+
+static void list_remove(policy_state * state, unsigned int node) {
+	node_list * list = &state->lists[state->where[node]];
+
+	if (state->previous[node] == NO_PAGE) {
+		list->head = state->next[node];
+	} else {
+		state->next[state->previous[node]] = state->next[node];
+	}
+
+	if (state->next[node] == NO_PAGE) {
+		list->tail = state->previous[node];
+	} else {
+		state->previous[state->next[node]] = state->previous[node];
+	}
+
+	list->count--;
+	state->where[node] = NOWHERE;
+}
+
+static void list_append(policy_state * state, unsigned int where, unsigned int node) {
+	node_list * list = &state->lists[where];
+
+	state->previous[node] = list->tail;
+	state->next[node] = NO_PAGE;
+	if (list->tail == NO_PAGE) {
+		list->head = node;
+	} else {
+		state->next[list->tail] = node;
+	}
+
+	list->tail = node;
+	list->count++;
+	state->where[node] = where;
+}
+
+static unsigned int ghost_slot(const ghost_table * table, unsigned long long page) {
+	return (page * 0x9E3779B97F4A7C15ull) >> 32 & (table->capacity - 1);
+}
+
+// Returns the ghost node remembering page or NO_PAGE
+static unsigned int find_ghost(const policy_state * state, unsigned long long page) {
+	const ghost_table * table = &state->ghosts;
+	unsigned int slot = ghost_slot(table, page);
+
+	while (table->values[slot] != NO_PAGE) {
+		if (table->keys[slot] == page) {
+			return table->values[slot];
+		}
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	return NO_PAGE;
+}
+
+// Remembers the page that left frame in the ghost list where
+static void add_ghost(policy_state * state, unsigned int where, unsigned int frame) {
+	ghost_table * table = &state->ghosts;
+	unsigned int node, slot;
+
+	assert(state->free_ghosts_count > 0);
+	node = state->free_ghosts[--state->free_ghosts_count];
+	state->pages[node] = state->pages[frame];
+	list_append(state, where, node);
+
+	slot = ghost_slot(table, state->pages[node]);
+	while (table->values[slot] != NO_PAGE) {
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	table->keys[slot] = state->pages[node];
+	table->values[slot] = node;
+}
+
+// Forgets the page remembered by a ghost node
+static void remove_ghost(policy_state * state, unsigned int node) {
+	ghost_table * table = &state->ghosts;
+	unsigned int slot = ghost_slot(table, state->pages[node]), empty, home;
+
+	while (table->values[slot] != node) {
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	// Shift back the entries that probed past the freed slot
+	empty = slot;
+	table->values[empty] = NO_PAGE;
+	for (slot = (slot + 1) & (table->capacity - 1); table->values[slot] != NO_PAGE; slot = (slot + 1) & (table->capacity - 1)) {
+		home = ghost_slot(table, table->keys[slot]);
+		if (((slot - home) & (table->capacity - 1)) >= ((slot - empty) & (table->capacity - 1))) {
+			table->keys[empty] = table->keys[slot];
+			table->values[empty] = table->values[slot];
+			table->values[slot] = NO_PAGE;
+			empty = slot;
+		}
+	}
+
+	list_remove(state, node);
+	state->free_ghosts[state->free_ghosts_count++] = node;
+}
+
+static bool heap_before(const policy_state * state, unsigned int a, unsigned int b) {
+	if (state->primary_keys[a] != state->primary_keys[b]) {
+		return state->primary_keys[a] < state->primary_keys[b];
+	}
+	return state->secondary_keys[a] < state->secondary_keys[b];
+}
+
+static void heap_place(policy_state * state, unsigned int position, unsigned int frame) {
+	state->heap[position] = frame;
+	state->heap_positions[frame] = position;
+}
+
+// Moves frame to its place after its keys changed
+static void heap_update(policy_state * state, unsigned int frame) {
+	unsigned int position = state->heap_positions[frame], child;
+
+	while (position > 0 && heap_before(state, frame, state->heap[(position - 1) / 2])) {
+		heap_place(state, position, state->heap[(position - 1) / 2]);
+		position = (position - 1) / 2;
+	}
+
+	while ((child = 2 * position + 1) < state->heap_count) {
+		if (child + 1 < state->heap_count && heap_before(state, state->heap[child + 1], state->heap[child])) {
+			child++;
+		}
+		if (!heap_before(state, state->heap[child], frame)) {
+			break;
+		}
+		heap_place(state, position, state->heap[child]);
+		position = child;
+	}
+
+	heap_place(state, position, frame);
+}
+
+static void heap_push(policy_state * state, unsigned int frame) {
+	state->heap_positions[frame] = state->heap_count++;
+	heap_update(state, frame);
+}
+
+static unsigned int heap_pop(policy_state * state) {
+	unsigned int frame = state->heap[0];
+
+	assert(state->heap_count > 0);
+	if (--state->heap_count > 0) {
+		heap_place(state, 0, state->heap[state->heap_count]);
+		heap_update(state, state->heap[0]);
+	}
+
+	return frame;
+}
+
+/* LRU */
+
+static void * lru_create(unsigned int frames, const os_memory_info * info) {
+	return create_state(frames, 0, false, info);
+}
+
+static void lru_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+
+	if (!fault) {
+		list_remove(state, frame);
+	}
+	list_append(state, RECENT, frame);
+}
+
+static unsigned int lru_evict(void * opaque, unsigned long long page) {
+	policy_state * state = opaque;
+	unsigned int frame = state->lists[RECENT].head;
+
+	list_remove(state, frame);
+	return frame;
+}
+
+// Every policy keeping its frames in lists, whichever list holds frame
+static void list_forget(void * opaque, unsigned int frame) {
+	list_remove(opaque, frame);
+}
+
+const replacement_policy lru_policy = { "lru", lru_create, destroy_state, lru_access, lru_evict, list_forget };
+
+/* CLOCK */
+
+// A loaded frame joins the ring right behind the hand. The victim leaves the
+// ring, so a frame loaded again at once takes back its place.
+static void clock_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+
+	state->referenced[frame] = true;
+	if (state->where[frame] != NOWHERE) {
+		return;
+	}
+
+	state->where[frame] = RECENT;
+	if (state->hand == NO_PAGE) {
+		state->previous[frame] = frame;
+		state->next[frame] = frame;
+		state->hand = frame;
+	} else {
+		state->previous[frame] = state->previous[state->hand];
+		state->next[frame] = state->hand;
+		state->next[state->previous[state->hand]] = frame;
+		state->previous[state->hand] = frame;
+	}
+}
+
+// Takes frame off the ring, the hand moves past it
+static void clock_forget(void * opaque, unsigned int frame) {
+	policy_state * state = opaque;
+
+	if (state->next[frame] == frame) {
+		state->hand = NO_PAGE;
+	} else {
+		state->next[state->previous[frame]] = state->next[frame];
+		state->previous[state->next[frame]] = state->previous[frame];
+		if (state->hand == frame) {
+			state->hand = state->next[frame];
+		}
+	}
+	state->where[frame] = NOWHERE;
+}
+
+static unsigned int clock_evict(void * opaque, unsigned long long page) {
+	policy_state * state = opaque;
+	unsigned int frame;
+
+	while (state->referenced[state->hand]) {
+		state->referenced[state->hand] = false;
+		state->hand = state->next[state->hand];
+	}
+
+	frame = state->hand;
+	clock_forget(state, frame);
+	return frame;
+}
+
+const replacement_policy clock_policy = { "clock", lru_create, destroy_state, clock_access, clock_evict, clock_forget };
+
+/* Second chance */
+
+static void second_chance_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+
+	state->referenced[frame] = true;
+	if (fault) {
+		list_append(state, RECENT, frame);
+	}
+}
+
+static unsigned int second_chance_evict(void * opaque, unsigned long long page) {
+	policy_state * state = opaque;
+	unsigned int frame;
+
+	while (state->referenced[frame = state->lists[RECENT].head]) {
+		state->referenced[frame] = false;
+		list_remove(state, frame);
+		list_append(state, RECENT, frame);
+	}
+
+	list_remove(state, frame);
+	return frame;
+}
+
+const replacement_policy second_chance_policy = { "second-chance", lru_create, destroy_state, second_chance_access, second_chance_evict, list_forget };
+
+/* 2Q */
+
+static void * two_queue_create(unsigned int frames, const os_memory_info * info) {
+	return create_state(frames, frames * TWO_QUEUE_OUT_SHARE / 100 + 1, false, info);
+}
+
+static void two_queue_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+	unsigned int ghost;
+
+	if (!fault) {
+		// Hits in the FIFO don't count, they are usually correlated references
+		if (state->where[frame] == FREQUENT) {
+			list_remove(state, frame);
+			list_append(state, FREQUENT, frame);
+		}
+		return;
+	}
+
+	state->pages[frame] = page;
+	ghost = find_ghost(state, page);
+	if (ghost != NO_PAGE) {
+		remove_ghost(state, ghost);
+		list_append(state, FREQUENT, frame);
+	} else {
+		list_append(state, RECENT, frame);
+	}
+}
+
+static unsigned int two_queue_evict(void * opaque, unsigned long long page) {
+	policy_state * state = opaque;
+	unsigned int frame, resident = state->lists[RECENT].count + state->lists[FREQUENT].count;
+
+	if (state->lists[RECENT].count > resident * TWO_QUEUE_IN_SHARE / 100 || state->lists[FREQUENT].count == 0) {
+		frame = state->lists[RECENT].head;
+		list_remove(state, frame);
+		if (state->lists[RECENT_GHOST].count >= resident * TWO_QUEUE_OUT_SHARE / 100 + 1) {
+			remove_ghost(state, state->lists[RECENT_GHOST].head);
+		}
+		add_ghost(state, RECENT_GHOST, frame);
+	} else {
+		frame = state->lists[FREQUENT].head;
+		list_remove(state, frame);
+	}
+
+	return frame;
+}
+
+const replacement_policy two_queue_policy = { "2q", two_queue_create, destroy_state, two_queue_access, two_queue_evict, list_forget };
+
+/* ARC */
+
+static void * arc_create(unsigned int frames, const os_memory_info * info) {
+	// B1 and B2 together never remember more pages than the process has
+	// frames, plus one while a remembered page is being loaded again
+	return create_state(frames, frames + 1, false, info);
+}
+
+static void arc_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+	unsigned int ghost;
+
+	if (!fault) {
+		list_remove(state, frame);
+		list_append(state, FREQUENT, frame);
+		return;
+	}
+
+	state->pages[frame] = page;
+	ghost = find_ghost(state, page);
+	if (ghost != NO_PAGE) {
+		remove_ghost(state, ghost);
+		list_append(state, FREQUENT, frame);
+	} else {
+		list_append(state, RECENT, frame);
+	}
+}
+
+// ARC's REPLACE: takes the LRU page of T1 when T1 is over its target (or at
+// it for a page found in B2), the LRU page of T2 otherwise
+static unsigned int arc_replace(policy_state * state, bool in_frequent_ghost) {
+	node_list * recent = &state->lists[RECENT];
+	unsigned int frame;
+
+	if (recent->count > 0 && (recent->count > state->target || (in_frequent_ghost && recent->count == state->target) ||
+							  state->lists[FREQUENT].count == 0)) {
+		frame = recent->head;
+		list_remove(state, frame);
+		add_ghost(state, RECENT_GHOST, frame);
+	} else {
+		frame = state->lists[FREQUENT].head;
+		list_remove(state, frame);
+		add_ghost(state, FREQUENT_GHOST, frame);
+	}
+
+	return frame;
+}
+
+// The size of the cache is the number of frames the state holds when a page
+// has to leave, it changes when frames move between processes
+static unsigned int arc_evict(void * opaque, unsigned long long page) {
+	policy_state * state = opaque;
+	node_list * lists = state->lists;
+	unsigned int ghost = find_ghost(state, page), delta, frame;
+	unsigned int size = lists[RECENT].count + lists[FREQUENT].count;
+
+	if (ghost != NO_PAGE && state->where[ghost] == RECENT_GHOST) {
+		delta = lists[RECENT_GHOST].count >= lists[FREQUENT_GHOST].count ? 1 : lists[FREQUENT_GHOST].count / lists[RECENT_GHOST].count;
+		state->target = state->target + delta < size ? state->target + delta : size;
+		return arc_replace(state, false);
+	}
+
+	if (ghost != NO_PAGE) {
+		delta = lists[FREQUENT_GHOST].count >= lists[RECENT_GHOST].count ? 1 : lists[RECENT_GHOST].count / lists[FREQUENT_GHOST].count;
+		state->target = state->target > delta ? state->target - delta : 0;
+		return arc_replace(state, true);
+	}
+
+	if (lists[RECENT].count + lists[RECENT_GHOST].count >= size) {
+		if (lists[RECENT].count < size) {
+			remove_ghost(state, lists[RECENT_GHOST].head);
+			return arc_replace(state, false);
+		}
+
+		// B1 is empty, T1 fills the cache: drop its LRU page without remembering it
+		frame = lists[RECENT].head;
+		list_remove(state, frame);
+		return frame;
+	}
+
+	if (size + lists[RECENT_GHOST].count + lists[FREQUENT_GHOST].count >= 2 * size && lists[FREQUENT_GHOST].count > 0) {
+		remove_ghost(state, lists[FREQUENT_GHOST].head);
+	}
+	return arc_replace(state, false);
+}
+
+const replacement_policy arc_policy = { "arc", arc_create, destroy_state, arc_access, arc_evict, list_forget };
+
+/* LFU */
+
+static void * heap_create(unsigned int frames, const os_memory_info * info) {
+	return create_state(frames, 0, true, info);
+}
+
+static void lfu_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+
+	state->primary_keys[frame] = fault ? 1 : state->primary_keys[frame] + 1;
+	state->secondary_keys[frame] = time;
+	if (fault) {
+		heap_push(state, frame);
+	} else {
+		heap_update(state, frame);
+	}
+}
+
+static unsigned int heap_evict(void * opaque, unsigned long long page) {
+	return heap_pop(opaque);
+}
+
+// The last frame of the heap takes the place of frame
+static void heap_forget(void * opaque, unsigned int frame) {
+	policy_state * state = opaque;
+	unsigned int last;
+
+	assert(state->heap_count > 0);
+	last = state->heap[--state->heap_count];
+	if (last != frame) {
+		heap_place(state, state->heap_positions[frame], last);
+		heap_update(state, last);
+	}
+}
+
+const replacement_policy lfu_policy = { "lfu", heap_create, destroy_state, lfu_access, heap_evict, heap_forget };
+
+/* OPT */
+
+// The heap keeps the frame used again the farthest first, pages never used
+// again come first, the least recently used of them first
+static void opt_access(void * opaque, unsigned int frame, unsigned long long page, bool fault, unsigned long long time) {
+	policy_state * state = opaque;
+
+	assert(time < state->info->future_count);
+	state->primary_keys[frame] = NO_NEXT_ACCESS - state->info->next_accesses[time];
+	state->secondary_keys[frame] = time;
+	if (fault) {
+		heap_push(state, frame);
+	} else {
+		heap_update(state, frame);
+	}
+}
+
+const replacement_policy opt_policy = { "opt", heap_create, destroy_state, opt_access, heap_evict, heap_forget };
+
+static const replacement_policy * policies[] = {
+	&lru_policy, &clock_policy, &second_chance_policy, &two_queue_policy, &arc_policy, &lfu_policy, &opt_policy
+};
+
+const replacement_policy * find_replacement_policy(const char * name) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if (strcmp(policies[i]->name, name) == 0) {
+			return policies[i];
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,66 @@
+#include "sweep.h"
+#include <stdatomic.h>
+
+typedef struct {
+	const memory_access * trace;
+	unsigned long long count;
+	sweep_run * runs;
+	unsigned int runs_count;
+	// Index of the next run to start
+	atomic_uint next;
+} sweep_work;
+
+static void replay(const sweep_work * work, sweep_run * run) {
+	os_memory_info * info = initialize_page_manager(run->config);
+	long long start = time_ns();
+	unsigned long long i;
+
+	// Only OPT looks ahead, the other policies would just pay for the table
+	if (info->policy == &opt_policy) {
+		set_future_accesses(info, work->trace, work->count);
+	}
+	for (i = 0; i < work->count; i++) {
+		access_memory(info, work->trace[i].pid, work->trace[i].virtual_address, work->trace[i].write);
+	}
+
+	run->seconds = (time_ns() - start) / 1e9;
+	run->page_faults = info->page_faults;
+	run->tlb_hits = info->tlb_hits;
+	run->write_backs = info->write_backs;
+	run->simulated_ns = info->simulated_ns;
+	destroy_page_manager(info);
+}
+
+// Takes runs until none is left, so long runs do not hold back short ones
+static void * sweep_worker(void * arg) {
+	sweep_work * work = arg;
+	unsigned int run;
+
+	while ((run = atomic_fetch_add(&work->next, 1)) < work->runs_count) {
+		replay(work, &work->runs[run]);
+	}
+
+	return NULL;
+}
+
+void run_sweep(const memory_access * trace, unsigned long long count, sweep_run * runs, unsigned int runs_count, unsigned int threads) {
+	sweep_work work = { trace, count, runs, runs_count, 0 };
+	pthread_t * workers;
+	unsigned int i;
+
+	if (threads > runs_count) {
+		threads = runs_count;
+	}
+	if (threads == 0) {
+		return;
+	}
+
+	workers = safe_malloc(threads * sizeof(pthread_t));
+	for (i = 0; i < threads; i++) {
+		safe_pthread_create(&workers[i], NULL, sweep_worker, &work);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	safe_free(workers);
+}
@@ -0,0 +1,20 @@
+#ifndef _SWEEP_H_
+#define _SWEEP_H_
+
+#include "page_manager.h"
+
+// One configuration of a sweep and what replaying the trace with it gave
+typedef struct {
+	memory_config config;
+	unsigned long long page_faults;
+	unsigned long long tlb_hits;
+	unsigned long long write_backs;
+	unsigned long long simulated_ns;
+	double seconds;
+} sweep_run;
+
+// Replays the count accesses of trace once for every run, on up to threads
+// threads. Each run gets its own page manager, the trace is only read.
+void run_sweep(const memory_access * trace, unsigned long long count, sweep_run * runs, unsigned int runs_count, unsigned int threads);
+
+#endif
@@ -0,0 +1,143 @@
+#include "page_manager.h"
+#include <string.h>
+#include <assert.h>
+
+static unsigned long long tlb_key(unsigned int asid, unsigned int vpn, bool huge) {
+	return (unsigned long long)asid << 33 | (unsigned long long)huge << 32 | vpn;
+}
+
+static unsigned int tlb_slot(const tlb * t, unsigned long long key) {
+	return (key * 0x9E3779B97F4A7C15ull) >> 32 & t->slots_mask;
+}
+
+tlb * create_tlb(unsigned int entries, unsigned int ways) {
+	tlb * t = safe_malloc(sizeof(tlb));
+	unsigned int capacity;
+
+	assert(entries > 0);
+	assert(ways <= entries && (ways == 0 || entries % ways == 0));
+	t->entries = entries;
+	t->ways = ways == 0 ? entries : ways;
+	t->sets = entries / t->ways;
+	t->keys = safe_malloc(entries * sizeof(unsigned long long));
+	t->pages = safe_malloc(entries * sizeof(virtual_page *));
+	t->last_used = safe_malloc(entries * sizeof(unsigned long long));
+	t->clock = 0;
+
+	// At most half full, probes stay short
+	for (capacity = 1; capacity < 2 * entries; capacity *= 2);
+	t->slots = safe_malloc(capacity * sizeof(unsigned int));
+	t->slots_mask = capacity - 1;
+
+	tlb_flush_all(t);
+	return t;
+}
+
+void destroy_tlb(tlb * t) {
+	safe_free(t->keys);
+	safe_free(t->pages);
+	safe_free(t->last_used);
+	safe_free(t->slots);
+	safe_free(t);
+}
+
+virtual_page * tlb_lookup(tlb * t, unsigned int asid, unsigned int vpn, bool huge) {
+	unsigned long long key = tlb_key(asid, vpn, huge);
+	unsigned int slot = tlb_slot(t, key), entry;
+
+	while ((entry = t->slots[slot]) != NO_PAGE) {
+		if (t->keys[entry] == key) {
+			t->last_used[entry] = ++t->clock;
+			return t->pages[entry];
+		}
+		slot = (slot + 1) & t->slots_mask;
+	}
+
+	return NULL;
+}
+
+// Frees entry, shifting back the slots that probed past its slot
+static void remove_entry(tlb * t, unsigned int entry) {
+	unsigned int slot = tlb_slot(t, t->keys[entry]), empty, home;
+
+	while (t->slots[slot] != entry) {
+		slot = (slot + 1) & t->slots_mask;
+	}
+
+	empty = slot;
+	t->slots[empty] = NO_PAGE;
+	for (slot = (slot + 1) & t->slots_mask; t->slots[slot] != NO_PAGE; slot = (slot + 1) & t->slots_mask) {
+		home = tlb_slot(t, t->keys[t->slots[slot]]);
+		if (((slot - home) & t->slots_mask) >= ((slot - empty) & t->slots_mask)) {
+			t->slots[empty] = t->slots[slot];
+			t->slots[slot] = NO_PAGE;
+			empty = slot;
+		}
+	}
+
+	t->used--;
+	t->huge -= t->keys[entry] >> 32 & 1;
+	t->keys[entry] = NO_TLB_KEY;
+	t->last_used[entry] = 0;
+}
+
+void tlb_insert(tlb * t, unsigned int asid, unsigned int vpn, bool huge, virtual_page * page) {
+	unsigned long long key = tlb_key(asid, vpn, huge);
+	unsigned int first = vpn % t->sets * t->ways, entry = first, way, slot;
+	unsigned long long oldest = t->last_used[first];
+
+	// A free entry if any, the least recently used one otherwise. Free
+	// entries were last used at 0 so they win without a test. Selects
+	// instead of a branch, the comparisons are unpredictable.
+	for (way = first + 1; way < first + t->ways; way++) {
+		entry = t->last_used[way] < oldest ? way : entry;
+		oldest = t->last_used[way] < oldest ? t->last_used[way] : oldest;
+	}
+	if (t->keys[entry] != NO_TLB_KEY) {
+		remove_entry(t, entry);
+	}
+
+	t->keys[entry] = key;
+	t->pages[entry] = page;
+	t->last_used[entry] = ++t->clock;
+	t->used++;
+	t->huge += huge;
+
+	slot = tlb_slot(t, key);
+	while (t->slots[slot] != NO_PAGE) {
+		assert(t->keys[t->slots[slot]] != key);
+		slot = (slot + 1) & t->slots_mask;
+	}
+	t->slots[slot] = entry;
+}
+
+void tlb_invalidate(tlb * t, unsigned int asid, unsigned int vpn, bool huge) {
+	unsigned long long key = tlb_key(asid, vpn, huge);
+	unsigned int slot = tlb_slot(t, key), entry;
+
+	while ((entry = t->slots[slot]) != NO_PAGE) {
+		if (t->keys[entry] == key) {
+			remove_entry(t, entry);
+			return;
+		}
+		slot = (slot + 1) & t->slots_mask;
+	}
+}
+
+void tlb_flush(tlb * t, unsigned int asid) {
+	unsigned int entry;
+
+	for (entry = 0; entry < t->entries; entry++) {
+		if (t->keys[entry] != NO_TLB_KEY && t->keys[entry] >> 33 == asid) {
+			remove_entry(t, entry);
+		}
+	}
+}
+
+void tlb_flush_all(tlb * t) {
+	memset(t->keys, 0xFF, t->entries * sizeof(unsigned long long));
+	memset(t->last_used, 0, t->entries * sizeof(unsigned long long));
+	memset(t->slots, 0xFF, (t->slots_mask + 1) * sizeof(unsigned int));
+	t->used = 0;
+	t->huge = 0;
+}
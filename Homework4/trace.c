@@ -0,0 +1,255 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+static void trace_error(const trace_reader * reader, const char * problem) {
+	if (reader->binary) {
+		printf("ERROR: %s: %s\n", reader->path, problem);
+	} else {
+		printf("ERROR: %s:%llu: %s\n", reader->path, reader->line, problem);
+	}
+	exit(1);
+}
+
+trace_reader * open_trace(const char * path, unsigned int processes) {
+	trace_reader * reader = safe_malloc(sizeof(trace_reader));
+	struct stat status;
+
+	reader->path = path;
+	reader->processes = processes;
+	reader->fd = open(path, O_RDONLY);
+	if (reader->fd < 0 || fstat(reader->fd, &status) != 0) {
+		printf("ERROR: loading file at %s\n", path);
+		exit(1);
+	}
+
+	reader->size = status.st_size;
+	reader->data = NULL;
+	if (reader->size > 0) {
+		reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+		if (reader->data == MAP_FAILED) {
+			printf("ERROR: mapping file at %s\n", path);
+			exit(1);
+		}
+		madvise((void *)reader->data, reader->size, MADV_SEQUENTIAL);
+	}
+
+	reader->binary = reader->size >= TRACE_MAGIC_SIZE && memcmp(reader->data, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0;
+	reader->position = reader->binary ? TRACE_MAGIC_SIZE : 0;
+	reader->released = 0;
+	reader->line = 1;
+
+	if (reader->binary && (reader->size - TRACE_MAGIC_SIZE) % sizeof(trace_record) != 0) {
+		trace_error(reader, "truncated binary trace");
+	}
+
+	return reader;
+}
+
+// Gives the pages before position back to the kernel, in TRACE_RELEASE_SIZE steps
+static void release_parsed(trace_reader * reader) {
+	size_t end = reader->position / TRACE_RELEASE_SIZE * TRACE_RELEASE_SIZE;
+
+	if (end > reader->released) {
+		madvise((void *)(reader->data + reader->released), end - reader->released, MADV_DONTNEED);
+		reader->released = end;
+	}
+}
+
+static void check_pid(const trace_reader * reader, unsigned int pid) {
+	char problem[96];
+
+	if (pid >= reader->processes) {
+		snprintf(problem, sizeof(problem), "pid %u of an access is not below the %u processes simulated", pid, reader->processes);
+		trace_error(reader, problem);
+	}
+}
+
+static unsigned int read_binary(trace_reader * reader, memory_access * accesses, unsigned int count) {
+	size_t available = (reader->size - reader->position) / sizeof(trace_record);
+	trace_record record;
+	unsigned int i;
+
+	if (count > available) {
+		count = available;
+	}
+
+	for (i = 0; i < count; i++) {
+		// Records may be unaligned in the mapping
+		memcpy(&record, reader->data + reader->position, sizeof(trace_record));
+		reader->position += sizeof(trace_record);
+		accesses[i].pid = record.pid & ~TRACE_WRITE_FLAG;
+		accesses[i].virtual_address = record.virtual_address;
+		accesses[i].write = (record.pid & TRACE_WRITE_FLAG) != 0;
+		check_pid(reader, accesses[i].pid);
+	}
+
+	return count;
+}
+
+// Skips spaces, tabs and carriage returns, then a comment if any
+static void skip_blanks(trace_reader * reader) {
+	while (reader->position < reader->size &&
+		   (reader->data[reader->position] == ' ' || reader->data[reader->position] == '\t' || reader->data[reader->position] == '\r')) {
+		reader->position++;
+	}
+
+	if (reader->position < reader->size && reader->data[reader->position] == '#') {
+		while (reader->position < reader->size && reader->data[reader->position] != '\n') {
+			reader->position++;
+		}
+	}
+}
+
+// Parses a decimal or 0x prefixed hexadecimal number of at most 32 bits
+static unsigned int parse_number(trace_reader * reader) {
+	const char * data = reader->data;
+	unsigned long long value = 0;
+	size_t start;
+	int digit;
+	unsigned int base = 10;
+
+	if (reader->position + 1 < reader->size && data[reader->position] == '0' &&
+		(data[reader->position + 1] == 'x' || data[reader->position + 1] == 'X')) {
+		base = 16;
+		reader->position += 2;
+	}
+
+	for (start = reader->position; reader->position < reader->size; reader->position++) {
+		char c = data[reader->position];
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			break;
+		}
+
+		value = value * base + digit;
+		if (value > UINT_MAX) {
+			trace_error(reader, "number larger than 32 bits");
+		}
+	}
+
+	if (reader->position == start) {
+		trace_error(reader, "expected a number");
+	}
+
+	return value;
+}
+
+static unsigned int read_text(trace_reader * reader, memory_access * accesses, unsigned int count) {
+	const char * data = reader->data;
+	unsigned int read = 0;
+	char kind;
+
+	while (read < count && reader->position < reader->size) {
+		skip_blanks(reader);
+		if (reader->position == reader->size) {
+			break;
+		}
+		if (data[reader->position] == '\n') {
+			reader->position++;
+			reader->line++;
+			continue;
+		}
+
+		accesses[read].pid = parse_number(reader);
+		check_pid(reader, accesses[read].pid);
+		skip_blanks(reader);
+		accesses[read].virtual_address = parse_number(reader);
+		skip_blanks(reader);
+
+		accesses[read].write = false;
+		if (reader->position < reader->size && data[reader->position] != '\n') {
+			kind = data[reader->position++];
+			if (kind == 'W' || kind == 'w') {
+				accesses[read].write = true;
+			} else if (kind != 'R' && kind != 'r') {
+				trace_error(reader, "expected R or W");
+			}
+			skip_blanks(reader);
+			if (reader->position < reader->size && data[reader->position] != '\n') {
+				trace_error(reader, "unexpected text after the access");
+			}
+		}
+
+		read++;
+	}
+
+	return read;
+}
+
+unsigned int read_trace(trace_reader * reader, memory_access * accesses, unsigned int count) {
+	unsigned int read = reader->binary ? read_binary(reader, accesses, count) : read_text(reader, accesses, count);
+
+	release_parsed(reader);
+	return read;
+}
+
+void close_trace(trace_reader * reader) {
+	if (reader->data != NULL) {
+		munmap((void *)reader->data, reader->size);
+	}
+	close(reader->fd);
+	safe_free(reader);
+}
+
+memory_access * load_trace(const char * path, unsigned int processes, unsigned long long * count) {
+	memory_access * batch = safe_malloc(TRACE_BATCH * sizeof(memory_access)), * trace;
+	trace_reader * reader;
+	unsigned long long i;
+	unsigned int read;
+
+	// Text traces have no fixed record size, the first pass counts the accesses
+	*count = 0;
+	reader = open_trace(path, processes);
+	while ((read = read_trace(reader, batch, TRACE_BATCH)) > 0) {
+		*count += read;
+	}
+	close_trace(reader);
+	safe_free(batch);
+
+	// The file may have changed since, never read more than was counted
+	trace = safe_malloc(*count * sizeof(memory_access));
+	reader = open_trace(path, processes);
+	for (i = 0; i < *count && (read = read_trace(reader, trace + i, *count - i < TRACE_BATCH ? *count - i : TRACE_BATCH)) > 0; i += read);
+	close_trace(reader);
+	// and keep only what was read if it got shorter
+	*count = i;
+
+	return trace;
+}
+
+FILE * create_trace(const char * path) {
+	FILE * stream = safe_fopen(path, "wb");
+
+	if (fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, stream) != 1) {
+		printf("ERROR: writing file at %s\n", path);
+		exit(1);
+	}
+
+	return stream;
+}
+
+void write_trace(FILE * stream, const memory_access * accesses, unsigned int count) {
+	trace_record record;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		assert(accesses[i].pid < TRACE_WRITE_FLAG);
+		record.pid = accesses[i].pid | (accesses[i].write ? TRACE_WRITE_FLAG : 0);
+		record.virtual_address = accesses[i].virtual_address;
+		if (fwrite(&record, sizeof(record), 1, stream) != 1) {
+			printf("ERROR: writing a binary trace\n");
+			exit(1);
+		}
+	}
+}
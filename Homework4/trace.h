@@ -0,0 +1,65 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "page_manager.h"
+
+// Binary traces start with these 8 bytes followed by one trace_record per
+// access, in host byte order. Any other file is read as a text trace with
+// one "<pid> <virtual address> [R|W]" access per line, numbers in decimal
+// or 0x prefixed hexadecimal, reads when the kind is missing. Blank lines
+// and everything after a # are ignored.
+#define TRACE_MAGIC "HW4TRACE"
+#define TRACE_MAGIC_SIZE (8)
+
+// Set in trace_record.pid for writes
+#define TRACE_WRITE_FLAG (0x80000000u)
+
+typedef struct {
+	uint32_t pid;
+	uint32_t virtual_address;
+} trace_record;
+
+// Reads a trace file through a read-only mapping. Pages already parsed are
+// handed back to the kernel every TRACE_RELEASE_SIZE bytes so files larger
+// than memory can be replayed.
+#define TRACE_RELEASE_SIZE (64 << 20)
+
+typedef struct {
+	const char * path;
+	// Pids of the trace must be below this
+	unsigned int processes;
+	int fd;
+	const char * data;
+	size_t size;
+	size_t position;
+	// Mapped bytes before this offset were released
+	size_t released;
+	bool binary;
+	// Line of position in a text trace
+	unsigned long long line;
+} trace_reader;
+
+// Accesses read from a trace file at a time by the functions streaming it
+#define TRACE_BATCH (4096)
+
+// Opens the trace at path, exits on failure like the safe_* functions. Every
+// pid of the trace must be below processes.
+trace_reader * open_trace(const char * path, unsigned int processes);
+
+// Reads up to count accesses of the trace into accesses and returns how many
+// were read, 0 once the trace is over. Exits on malformed traces.
+unsigned int read_trace(trace_reader * reader, memory_access * accesses, unsigned int count);
+
+void close_trace(trace_reader * reader);
+
+// Reads the whole trace at path into memory, sets count to its accesses
+memory_access * load_trace(const char * path, unsigned int processes, unsigned long long * count);
+
+// Creates a binary trace at path, accesses are added with write_trace
+FILE * create_trace(const char * path);
+
+void write_trace(FILE * stream, const memory_access * accesses, unsigned int count);
+
+#endif
@@ -2,64 +2,167 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <stdarg.h>
-#include <math.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "utility.h"
 
-#define MAX_LOG_LINE (512)
-#define ENABLE_LOG false
-
-int allocated_chunks = 0;
-bool logging_enabled;
-bool init = false;
-pthread_mutex_t memory_mutex;
-pthread_mutex_t logging_mutex;
-
-void * safe_malloc(int size) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
+// Allocation counters are split in per-thread shards. Every shard has a
+// single writer, its thread, so counting needs neither a lock nor atomic
+// read-modify-write instructions; readers add up all the shards. Shards of
+// exited threads are handed to new threads with their counts. Peak usage
+// is sampled on large allocations and on every PEAK_SAMPLE_INTERVAL-th
+// allocation of a thread.
+#define CACHE_LINE_SIZE (64)
+#define PEAK_SAMPLE_SIZE (4096)
+#define PEAK_SAMPLE_INTERVAL (64)
+
+typedef struct memory_shard {
+	atomic_long chunks;
+	atomic_long bytes;
+	atomic_long total_chunks;
+	atomic_long total_bytes;
+	// List of every shard ever created, only ever prepended to
+	struct memory_shard * next;
+	// List of shards released by exited threads
+	struct memory_shard * next_free;
+} __attribute__((aligned(CACHE_LINE_SIZE))) memory_shard;
+
+// Every chunk starts with its size so safe_free can account for its bytes,
+// padded to the strictest alignment malloc guarantees
+typedef union {
+	size_t size;
+	long long integer_alignment;
+	long double float_alignment;
+	void * pointer_alignment;
+} chunk_header;
+
+static _Atomic(memory_shard *) memory_shards = NULL;
+static memory_shard * free_memory_shards = NULL;
+static pthread_mutex_t memory_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t memory_shards_once = PTHREAD_ONCE_INIT;
+static pthread_key_t memory_shard_key;
+static __thread memory_shard * thread_shard = NULL;
+static atomic_long peak_bytes = 0;
+
+static void release_shard(void * shard) {
+	pthread_mutex_lock(&memory_shards_mutex);
+	((memory_shard *)shard)->next_free = free_memory_shards;
+	free_memory_shards = shard;
+	pthread_mutex_unlock(&memory_shards_mutex);
+	thread_shard = NULL;
+}
+
+static void create_shard_key() {
+	pthread_key_create(&memory_shard_key, release_shard);
+}
+
+static memory_shard * get_thread_shard() {
+	memory_shard * shard = thread_shard;
+
+	if (shard == NULL) {
+		pthread_once(&memory_shards_once, create_shard_key);
+		pthread_mutex_lock(&memory_shards_mutex);
+		if (free_memory_shards != NULL) {
+			shard = free_memory_shards;
+			free_memory_shards = shard->next_free;
+		} else {
+			if (posix_memalign((void **)&shard, CACHE_LINE_SIZE, sizeof(memory_shard)) != 0) {
+				printf("ERROR: memory allocation failed, exit\n");
+				exit(1);
+			}
+			memset(shard, 0, sizeof(memory_shard));
+			shard->next = atomic_load_explicit(&memory_shards, memory_order_relaxed);
+			atomic_store_explicit(&memory_shards, shard, memory_order_release);
+		}
+		pthread_mutex_unlock(&memory_shards_mutex);
+
+		pthread_setspecific(memory_shard_key, shard);
+		thread_shard = shard;
+	}
+
+	return shard;
+}
+
+// Only the owning thread writes its shard, a plain load and store is enough
+static void shard_add(atomic_long * counter, long value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void sum_shards(memory_stats * stats) {
+	memory_shard * shard = atomic_load_explicit(&memory_shards, memory_order_acquire);
+
+	memset(stats, 0, sizeof(memory_stats));
+	for (; shard != NULL; shard = shard->next) {
+		stats->chunks += atomic_load_explicit(&shard->chunks, memory_order_relaxed);
+		stats->bytes += atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+		stats->total_chunks += atomic_load_explicit(&shard->total_chunks, memory_order_relaxed);
+		stats->total_bytes += atomic_load_explicit(&shard->total_bytes, memory_order_relaxed);
 	}
+}
+
+static void sample_peak() {
+	memory_stats stats;
+	long peak = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
 
-	void * chunk = malloc(size);
+	sum_shards(&stats);
+	while (stats.bytes > peak && !atomic_compare_exchange_weak_explicit(&peak_bytes, &peak, stats.bytes, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void account_allocation(memory_shard * shard, long size) {
+	long chunks = atomic_load_explicit(&shard->total_chunks, memory_order_relaxed);
+
+	shard_add(&shard->chunks, 1);
+	shard_add(&shard->bytes, size);
+	shard_add(&shard->total_chunks, 1);
+	shard_add(&shard->total_bytes, size);
+
+	if (size >= PEAK_SAMPLE_SIZE || chunks % PEAK_SAMPLE_INTERVAL == 0) {
+		sample_peak();
+	}
+}
+
+void * safe_malloc(size_t size) {
+	chunk_header * chunk = malloc(sizeof(chunk_header) + size);
 	if (chunk == NULL) {
 		printf("ERROR: memory allocation failed, exit\n");
 		exit(1);
 	}
 
-	// increment number of created chunks
-	pthread_mutex_lock(&memory_mutex);
-	allocated_chunks++;
-	pthread_mutex_unlock(&memory_mutex);
-
+	chunk->size = size;
+	account_allocation(get_thread_shard(), size);
 
 	// Set the memory chunk values to 0;
-	memset(chunk, 0, size);
+	memset(chunk + 1, 0, size);
 
-	return chunk;
+	return chunk + 1;
 }
 
 void safe_free(void * chunk) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
+	chunk_header * header;
+	memory_shard * shard;
 
 	if (chunk != NULL) {
-		free(chunk);
-		chunk = NULL;
-
-		// decrement number of created chunks
-		pthread_mutex_lock(&memory_mutex);
-		allocated_chunks--;
-		pthread_mutex_unlock(&memory_mutex);
+		header = (chunk_header *)chunk - 1;
+		shard = get_thread_shard();
+
+		// decrement number of created chunks, the shard of the allocating
+		// thread may differ but only the sum of the shards matters
+		shard_add(&shard->chunks, -1);
+		shard_add(&shard->bytes, -(long)header->size);
+		free(header);
 	}
 }
 
+memory_stats get_memory_stats() {
+	memory_stats stats;
+
+	sample_peak();
+	sum_shards(&stats);
+	stats.peak_bytes = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
+	return stats;
+}
+
 FILE * safe_fopen(const char * file_name, const char * mode) {
 	FILE * stream = fopen(file_name, mode);
 	if (stream == NULL) {
@@ -79,24 +182,9 @@ void safe_fread(void * buffer, int size, FILE * stream) {
 }
 
 char * safe_strdup(const char * str) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	char * dup = strdup(str);
-	if (dup == NULL) {
-		printf("ERROR: duplicating string %s\n", str);
-		exit(1);
-	}
-
-	// increment number of created chunks
-	pthread_mutex_lock(&memory_mutex);
-	allocated_chunks++;
-	pthread_mutex_unlock(&memory_mutex);
-
+	size_t length = strlen(str) + 1;
+	char * dup = safe_malloc(length);
+	memcpy(dup, str, length);
 	return dup;
 }
 
@@ -108,89 +196,17 @@ void safe_pthread_create(pthread_t * thread, const pthread_attr_t * attr, void *
 	}
 }
 
-void write_log2(const char * msg, ...) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	if (!logging_enabled) {
-		return;
-	}
-
-	char buffer[MAX_LOG_LINE];
-	va_list format_args;
-	FILE * file_stream;
-
-	// Format input message
-	va_start(format_args, msg);
-	vsprintf(buffer, msg, format_args);
-	va_end(format_args);
-
-	pthread_mutex_lock(&logging_mutex);
-	file_stream = safe_fopen("log.txt", "a");
-	fprintf(file_stream, buffer);
-	fclose(file_stream);
-	pthread_mutex_unlock(&logging_mutex);
-}
-
-void write_log1(const char * func, const char * msg, ...) {
-	if (!init) {
-		init = true;
-		logging_enabled = ENABLE_LOG;
-		pthread_mutex_init(&memory_mutex, NULL);
-		pthread_mutex_init(&logging_mutex, NULL);
-	}
-
-	if (!logging_enabled) {
-		return;
-	}
-
-	char buffer1[MAX_LOG_LINE];
-	char buffer2[MAX_LOG_LINE];
-	va_list format_args;
-	FILE * file_stream;
-
-	// Format input message
-	va_start(format_args, msg);
-	vsprintf(buffer1, msg, format_args);
-	va_end(format_args);
-
-	// Format time
-	sprintf(buffer2, "[%s] %s\n", func, buffer1);
-
-	pthread_mutex_lock(&logging_mutex);
-	file_stream = safe_fopen("log.txt", "a");
-	fprintf(file_stream, buffer2);
-	fclose(file_stream);
-	pthread_mutex_unlock(&logging_mutex);
-}
-
 unsigned int get_bits(unsigned int n, unsigned int start, unsigned count) {
-	unsigned int result = 0;
-	int k = start;
-	int i;
-	for (i = 0; i < count; i++, k++) {
-		result += ((n >> k)  & 1) * pow(2, i);
+	// Shifting a 32 bit value by 32 is undefined, the full width is special
+	if (start >= sizeof(n) * BITS_PER_BYTE) {
+		return 0;
 	}
-
-	return result;
-}
-
-bool smaller_than(time_spec left, time_spec right) {
-	double time_diff, sec_diff, nano_diff;
-	time_diff = difftime(left.time, right.time);
-	sec_diff = difftime(left.sec.tv_sec, right.sec.tv_sec);
-	nano_diff = left.sec.tv_nsec - right.sec.tv_nsec;
-
-	return time_diff < 0 ||
-		   sec_diff < 0 ||
-		   nano_diff < 0;
+	n >>= start;
+	return count >= sizeof(n) * BITS_PER_BYTE ? n : n & ((1u << count) - 1);
 }
 
-void time_now(time_spec * time_var) {
-	clock_gettime(CLOCK_MONOTONIC, &time_var->sec);
-	time(&time_var->time);
+long long time_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
 }
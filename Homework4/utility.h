@@ -2,7 +2,8 @@
 #define _UTILITY_H_
 
 #include <stdio.h>
-#include <time.h>
+#include <pthread.h>
+#include "logger.h"
 
 #define true (1)
 #define false (0)
@@ -10,27 +11,29 @@
 
 typedef int bool;
 typedef unsigned char byte;
-typedef struct {
-	time_t time;
-	struct timespec sec;
-} time_spec;
 
-extern int allocated_chunks;
+// Allocation statistics kept by safe_malloc, safe_free and safe_strdup
+typedef struct {
+	long chunks;       // chunks currently allocated
+	long bytes;        // bytes currently allocated
+	long peak_bytes;   // highest number of bytes allocated at once, sampled
+	long total_chunks; // chunks allocated since the start
+	long total_bytes;  // bytes allocated since the start
+} memory_stats;
 
 /* GENERAL MANAGEMENT APIs */
 
+// Returns the count bits of n starting at bit start, lowest bit first
 unsigned int get_bits(unsigned int n, unsigned int start, unsigned count);
 
-bool smaller_than(time_spec left, time_spec right);
-
-void time_now(time_spec * time_var);
-
 /* MEMORY MANAGEMENT APIs */
 
-void * safe_malloc(int size);
+void * safe_malloc(size_t size);
 
 void safe_free(void * chunk);
 
+memory_stats get_memory_stats();
+
 /* DISK MANAGEMENT APIs */
 
 FILE * safe_fopen(const char * file_name, const char * mode);
@@ -43,12 +46,7 @@ char * safe_strdup(const char * str);
 
 void safe_pthread_create(pthread_t * thread, const pthread_attr_t * attr, void * (*start_routine) (void *), void *arg);
 
-/* LOGGING MANAGEMENT APIs */
-
-void write_log1(const char * func, const char * msg, ...);
-
-void write_log2(const char * msg, ...);
-
-#define LOG_MSG(format, ...) write_log1(__FUNCTION__, format, __VA_ARGS__)
+// Returns a monotonic timestamp in nanoseconds
+long long time_ns();
 
 #endif // _UTILITY_H_
@@ -0,0 +1,152 @@
+// Measures the ramdisk's block storage the way fio jobs would: sequential and
+// random reads and writes of a fixed size, on data that compresses to a
+// chosen degree. Build from Homework6 with make -f Makefile.linux, or from
+// Homework6/benchmark with:
+//   gcc -O2 -o io_benchmark io_benchmark.c ../crd_store.c -lz
+// Usage:
+//   ./io_benchmark [-b block size] [-n operations] [-c compressible %] [-s seed]
+// Every job prints its bandwidth, IOPS and average and 99th percentile
+// latency, and the memory of the ramdisk once it is done.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../crd_store.h"
+
+// A job, as fio's rw= option names it.
+typedef struct {
+	const char * name;
+	int do_write;
+	int random;
+} job;
+
+static const job jobs[] = {
+	{ "write", 1, 0 },
+	{ "read", 0, 0 },
+	{ "randwrite", 1, 1 },
+	{ "randread", 0, 1 },
+};
+#define JOBS (sizeof(jobs) / sizeof(jobs[0]))
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int copy_segment(void * context, unsigned long addr, size_t offset, unsigned char * buffer, size_t count, int to_segment) {
+	if (to_segment)
+		memcpy((unsigned char *)addr + offset, buffer, count);
+	else
+		memcpy(buffer, (const unsigned char *)addr + offset, count);
+	return 0;
+}
+
+// Fills the buffers written by the jobs, like fio's buffer_compress_percentage:
+// the first compressible % of every block repeats one byte, the rest is random.
+static void fill(unsigned char * data, size_t size, unsigned int compressible) {
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		data[i] = i % RAMDISK_BLOCK_SIZE < RAMDISK_BLOCK_SIZE * compressible / 100 ? 'c' : rand();
+}
+
+static int compare_latencies(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Runs a job of operations transfers of size bytes on store, the random jobs
+// at size aligned positions, and prints its results. Writes refill data
+// first, untimed, like fio's refill_buffers. Compressing the same block
+// over and over trains the branch predictors on it and halves its cost.
+static void run(crd_store * store, const job * job, unsigned char * data, size_t size, unsigned int compressible, unsigned long operations, double * latencies) {
+	unsigned long positions = RAMDISK_SIZE / size, i, position;
+	crd_iovec iov = { (unsigned long)data, size };
+	double start, end, total = 0;
+	crd_usage usage;
+
+	for (i = 0; i < operations; i++) {
+		position = (job->random ? (unsigned long)rand() % positions : i % positions) * size;
+		if (job->do_write)
+			fill(data, size, compressible);
+		start = now();
+		if (crd_transfer(store, job->do_write, position, &iov, 1, copy_segment, NULL) != (long)size) {
+			printf("ERROR: %s transfer %lu at %lu failed\n", job->name, i, position);
+			exit(1);
+		}
+		end = now();
+		latencies[i] = end - start;
+		total += latencies[i];
+	}
+
+	qsort(latencies, operations, sizeof(double), compare_latencies);
+	crd_get_usage(store, &usage);
+	printf("%-10s %9.1f MiB/s %10.0f IOPS   lat avg %7.2f us  p99 %7.2f us   slabs %lu of %lu bytes\n",
+		job->name, operations * size / total / (1 << 20), operations / total,
+		total / operations * 1e6, latencies[operations * 99 / 100] * 1e6, usage.slabs, usage.logical);
+}
+
+int main(int argc, char ** argv) {
+	size_t size = RAMDISK_BLOCK_SIZE;
+	unsigned long operations = 100000;
+	unsigned int compressible = 50, seed = 1, i;
+	unsigned long position;
+	unsigned char * data;
+	crd_iovec iov;
+	double * latencies;
+	crd_store * store;
+	int option;
+
+	while ((option = getopt(argc, argv, "b:n:c:s:")) != -1) {
+		switch (option) {
+		case 'b':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			operations = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			compressible = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			printf("Usage: %s [-b block size] [-n operations] [-c compressible %%] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size == 0 || size > RAMDISK_SIZE || RAMDISK_SIZE % size != 0 || operations == 0 || compressible > 100) {
+		printf("ERROR: the block size must divide %d, with at least one operation and at most 100%% compressible\n", RAMDISK_SIZE);
+		return 1;
+	}
+
+	srand(seed);
+	data = malloc(size);
+	latencies = malloc(operations * sizeof(double));
+	store = crd_create();
+	if (data == NULL || latencies == NULL || store == NULL) {
+		printf("ERROR: out of memory\n");
+		return 1;
+	}
+	// Writes the whole ramdisk once untimed, like preconditioning a device,
+	// so the first job doesn't pay for creating the slabs. The jobs then run
+	// on the same ramdisk.
+	iov.iov_addr = (unsigned long)data;
+	iov.iov_size = size;
+	for (position = 0; position < RAMDISK_SIZE; position += size) {
+		fill(data, size, compressible);
+		crd_transfer(store, 1, position, &iov, 1, copy_segment, NULL);
+	}
+
+	printf("bs=%zu, %lu operations per job, %u%% compressible\n", size, operations, compressible);
+	for (i = 0; i < JOBS; i++)
+		run(store, &jobs[i], data, size, compressible, operations, latencies);
+
+	crd_destroy(store);
+	free(latencies);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,360 @@
+// Runs the ramdisk's block storage on Linux, outside of MINIX. Build with
+// Makefile.linux, then either check it against a plain copy of the ramdisk:
+//   ./crd_linux test [iterations] [seed]
+// or serve it over NBD on localhost, so a kernel or userspace NBD client can
+// format and mount it:
+//   ./crd_linux nbd [port]
+//   nbd-client localhost 10809 /dev/nbd0
+#include "crd_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+
+//-----------------------------------------------------------------------------
+// Stand-ins for the MINIX kernel calls.
+//-----------------------------------------------------------------------------
+
+// Segments hold plain pointers here, where the driver holds grants. Copying
+// fails for context set to a non-zero int, so the test can check errors.
+static int sys_safecopyto(void * context, unsigned long addr, size_t offset, const unsigned char * buffer, size_t count) {
+	if (context != NULL && *(int *)context)
+		return EFAULT;
+	memcpy((unsigned char *)addr + offset, buffer, count);
+	return 0;
+}
+
+static int sys_safecopyfrom(void * context, unsigned long addr, size_t offset, unsigned char * buffer, size_t count) {
+	if (context != NULL && *(int *)context)
+		return EFAULT;
+	memcpy(buffer, (const unsigned char *)addr + offset, count);
+	return 0;
+}
+
+static int copy_segment(void * context, unsigned long addr, size_t offset, unsigned char * buffer, size_t count, int to_segment) {
+	if (to_segment)
+		return sys_safecopyto(context, addr, offset, buffer, count);
+	return sys_safecopyfrom(context, addr, offset, buffer, count);
+}
+
+static void fail(const char * problem) {
+	printf("CRD: %s\n", problem);
+	exit(1);
+}
+
+static crd_store * create_store(void) {
+	crd_store * store = crd_create();
+
+	if (store == NULL)
+		fail("out of memory");
+	return store;
+}
+
+static void report(const crd_store * store) {
+	crd_usage usage;
+
+	crd_get_usage(store, &usage);
+	printf("CRD: %lu bytes stored, %lu bytes compressed, %lu bytes of slabs (%lu%%)\n",
+		usage.logical, usage.compressed, usage.slabs, usage.logical == 0 ? 0 : 100 * usage.slabs / usage.logical);
+}
+
+//-----------------------------------------------------------------------------
+// Test driver.
+//-----------------------------------------------------------------------------
+
+// The largest transfer of the test, spanning several blocks.
+#define TEST_TRANSFER (5 * RAMDISK_BLOCK_SIZE)
+// The most segments a transfer of the test is split into.
+#define TEST_SEGMENTS 4
+
+// Fills data with zeros, a short repeating pattern, text-like bytes or random
+// bytes, so blocks land in every size class.
+static void fill(unsigned char * data, size_t count) {
+	int kind = rand() % 4;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (kind == 0)
+			data[i] = 0;
+		else if (kind == 1)
+			data[i] = (i / 64) & 7;
+		else if (kind == 2)
+			data[i] = "etaoin shrdlu"[rand() % 13];
+		else
+			data[i] = rand();
+	}
+}
+
+// Splits count bytes of data into up to TEST_SEGMENTS segments, some of which
+// may be empty. Returns the number of segments.
+static unsigned int split(unsigned char * data, size_t count, crd_iovec * iov) {
+	unsigned int segments = 1 + rand() % TEST_SEGMENTS, i;
+	size_t size;
+
+	for (i = 0; i < segments; i++) {
+		size = i + 1 == segments ? count : (size_t)rand() % (count + 1);
+		iov[i].iov_addr = (unsigned long)data;
+		iov[i].iov_size = size;
+		data += size;
+		count -= size;
+	}
+	return segments;
+}
+
+// Checks random reads and writes through crd_transfer against the same
+// transfers on a plain copy of the ramdisk.
+static void run_test(unsigned long iterations, unsigned int seed) {
+	static unsigned char shadow[RAMDISK_SIZE], written[RAMDISK_BLOCKS];
+	static unsigned char data[TEST_TRANSFER];
+	crd_store * store = create_store();
+	crd_iovec iov[TEST_SEGMENTS];
+	crd_usage usage;
+	unsigned long i, position, logical = 0;
+	size_t count, expected, j;
+	unsigned int segments;
+	int do_write, failing = 1;
+	long r;
+
+	srand(seed);
+	for (i = 0; i < iterations; i++) {
+		// Some transfers start at or run past the end of the ramdisk.
+		position = rand() % (RAMDISK_SIZE + RAMDISK_BLOCK_SIZE);
+		count = rand() % (rand() % 8 == 0 ? TEST_TRANSFER : RAMDISK_BLOCK_SIZE) + 1;
+		expected = position >= RAMDISK_SIZE ? 0 : position + count > RAMDISK_SIZE ? RAMDISK_SIZE - position : count;
+		do_write = rand() % 2;
+		if (do_write)
+			fill(data, count);
+		segments = split(data, count, iov);
+
+		r = crd_transfer(store, do_write, position, iov, segments, copy_segment, NULL);
+		if (r != (long)expected) {
+			printf("CRD: transfer %lu of %zu bytes at %lu returned %ld\n", i, count, position, r);
+			exit(1);
+		}
+		if (do_write) {
+			memcpy(shadow + position, data, expected);
+			for (j = position / RAMDISK_BLOCK_SIZE; j < RAMDISK_BLOCKS && j * RAMDISK_BLOCK_SIZE < position + expected; j++)
+				written[j] = 1;
+		} else if (memcmp(data, shadow + position, expected) != 0) {
+			printf("CRD: transfer %lu read %zu bytes at %lu that differ\n", i, expected, position);
+			exit(1);
+		}
+	}
+
+	// A failing copy is reported and leaves the ramdisk as it was.
+	iov[0].iov_addr = (unsigned long)data;
+	iov[0].iov_size = RAMDISK_BLOCK_SIZE;
+	if (crd_transfer(store, 1, 0, iov, 1, copy_segment, &failing) != CRD_ECOPY ||
+			crd_transfer(store, 0, 0, iov, 1, copy_segment, &failing) != CRD_ECOPY)
+		fail("a failing copy wasn't reported");
+	if (crd_transfer(store, 0, 0, iov, 1, copy_segment, NULL) != RAMDISK_BLOCK_SIZE ||
+			memcmp(data, shadow, RAMDISK_BLOCK_SIZE) != 0)
+		fail("a failing copy changed the ramdisk");
+
+	crd_get_usage(store, &usage);
+	for (j = 0; j < RAMDISK_BLOCKS; j++)
+		logical += written[j] * RAMDISK_BLOCK_SIZE;
+	if (usage.logical != logical || usage.compressed > usage.slabs)
+		fail("the usage doesn't match the blocks written");
+
+	printf("CRD: %lu transfers checked\n", iterations);
+	report(store);
+	crd_destroy(store);
+}
+
+//-----------------------------------------------------------------------------
+// NBD loopback front end.
+//-----------------------------------------------------------------------------
+
+// The default NBD port.
+#define NBD_PORT 10809
+// Handshake values of the fixed newstyle negotiation, which linux/nbd.h
+// leaves to the servers.
+#define NBD_MAGIC 0x4e42444d41474943ULL
+#define NBD_OPTION_MAGIC 0x49484156454f5054ULL
+#define NBD_OPTION_REPLY_MAGIC 0x3e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_REP_ACK 1
+#define NBD_REP_ERR_UNSUP (0x80000000 | 1)
+
+// Reads or writes all count bytes of a socket, returns 0 if the client is gone.
+static int read_all(int fd, void * data, size_t count) {
+	ssize_t r;
+
+	for (; count > 0; count -= r, data = (char *)data + r) {
+		if ((r = read(fd, data, count)) <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int write_all(int fd, const void * data, size_t count) {
+	ssize_t r;
+
+	for (; count > 0; count -= r, data = (const char *)data + r) {
+		if ((r = write(fd, data, count)) <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+// Negotiates the export with a client. Returns 1 once the client moves to
+// the transmission phase, 0 if it aborted or left.
+static int negotiate(int fd) {
+	static unsigned char zeroes[124];
+	struct {
+		uint64_t magic;
+		uint64_t option_magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting = { htobe64(NBD_MAGIC), htobe64(NBD_OPTION_MAGIC), htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES) };
+	struct {
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	} __attribute__((packed)) option;
+	struct {
+		uint64_t magic;
+		uint32_t option;
+		uint32_t type;
+		uint32_t length;
+	} __attribute__((packed)) reply;
+	struct {
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) export = { htobe64(RAMDISK_SIZE), htobe16(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH) };
+	uint32_t client_flags;
+	char skipped[256];
+	uint32_t length, part;
+
+	if (!write_all(fd, &greeting, sizeof(greeting)) || !read_all(fd, &client_flags, sizeof(client_flags)))
+		return 0;
+	client_flags = be32toh(client_flags);
+
+	while (read_all(fd, &option, sizeof(option)) && be64toh(option.magic) == NBD_OPTION_MAGIC) {
+		// There is a single export, its name doesn't matter.
+		for (length = be32toh(option.length); length > 0; length -= part) {
+			part = length < sizeof(skipped) ? length : sizeof(skipped);
+			if (!read_all(fd, skipped, part))
+				return 0;
+		}
+
+		if (be32toh(option.option) == NBD_OPT_EXPORT_NAME)
+			return write_all(fd, &export, sizeof(export)) &&
+				((client_flags & NBD_FLAG_NO_ZEROES) || write_all(fd, zeroes, sizeof(zeroes)));
+
+		reply.magic = htobe64(NBD_OPTION_REPLY_MAGIC);
+		reply.option = option.option;
+		reply.type = htobe32(be32toh(option.option) == NBD_OPT_ABORT ? NBD_REP_ACK : NBD_REP_ERR_UNSUP);
+		reply.length = 0;
+		if (!write_all(fd, &reply, sizeof(reply)) || be32toh(option.option) == NBD_OPT_ABORT)
+			return 0;
+	}
+	return 0;
+}
+
+// Serves the requests of a client until it disconnects.
+static void transmit(int fd, crd_store * store) {
+	static unsigned char data[RAMDISK_SIZE];
+	struct nbd_request request;
+	struct nbd_reply reply;
+	crd_iovec iov;
+	uint64_t from;
+	uint32_t length, command;
+	long r;
+
+	reply.magic = htobe32(NBD_REPLY_MAGIC);
+	while (read_all(fd, &request, sizeof(request)) && be32toh(request.magic) == NBD_REQUEST_MAGIC) {
+		from = be64toh(request.from);
+		length = be32toh(request.len);
+		command = be32toh(request.type) & 0xffff;
+		memcpy(reply.handle, request.handle, sizeof(reply.handle));
+		reply.error = 0;
+
+		switch (command) {
+		case NBD_CMD_READ:
+		case NBD_CMD_WRITE:
+			// Clients keep to the export size, a longer request can't be
+			// skipped reliably.
+			if (length > RAMDISK_SIZE)
+				return;
+			if (command == NBD_CMD_WRITE && !read_all(fd, data, length))
+				return;
+			iov.iov_addr = (unsigned long)data;
+			iov.iov_size = length;
+			r = from > RAMDISK_SIZE ? 0 : crd_transfer(store, command == NBD_CMD_WRITE, from, &iov, 1, copy_segment, NULL);
+			if (r == CRD_ENOMEM)
+				reply.error = htobe32(ENOSPC);
+			else if (r == CRD_ECORRUPT)
+				reply.error = htobe32(EIO);
+			else if (r != (long)length)
+				reply.error = htobe32(EINVAL);
+			if (!write_all(fd, &reply, sizeof(reply)))
+				return;
+			if (command == NBD_CMD_READ && reply.error == 0 && !write_all(fd, data, length))
+				return;
+			break;
+		case NBD_CMD_DISC:
+			return;
+		case NBD_CMD_FLUSH:
+			// The ramdisk has nothing to flush.
+			if (!write_all(fd, &reply, sizeof(reply)))
+				return;
+			break;
+		default:
+			reply.error = htobe32(EINVAL);
+			if (!write_all(fd, &reply, sizeof(reply)))
+				return;
+		}
+	}
+}
+
+// Serves the ramdisk to one client after the other, on localhost only.
+static void run_nbd(unsigned short port) {
+	crd_store * store = create_store();
+	struct sockaddr_in address;
+	int listener, fd, on = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0)
+		fail("can't listen on the NBD port");
+	printf("CRD: serving %d bytes on localhost:%u\n", RAMDISK_SIZE, port);
+	fflush(stdout);
+
+	while ((fd = accept(listener, NULL, NULL)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (negotiate(fd))
+			transmit(fd, store);
+		close(fd);
+		report(store);
+		fflush(stdout);
+	}
+	fail("can't accept NBD clients");
+}
+
+int main(int argc, char ** argv) {
+	if (argc >= 2 && argc <= 4 && strcmp(argv[1], "test") == 0)
+		run_test(argc > 2 ? strtoul(argv[2], NULL, 10) : 200000, argc > 3 ? strtoul(argv[3], NULL, 10) : 1);
+	else if (argc >= 2 && argc <= 3 && strcmp(argv[1], "nbd") == 0)
+		run_nbd(argc > 2 ? strtoul(argv[2], NULL, 10) : NBD_PORT);
+	else {
+		printf("Usage: %s test [iterations] [seed]\n", argv[0]);
+		printf("       %s nbd [port]\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
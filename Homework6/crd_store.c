@@ -0,0 +1,371 @@
+#include "crd_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+//-----------------------------------------------------------------------------
+// Slab allocator for the compressed blocks.
+//-----------------------------------------------------------------------------
+
+// The size of each slab, 16 KB.
+#define SLAB_SIZE 0x4000
+// The slot sizes of the slabs. A compressed block takes a slot of the
+// smallest size class it fits in.
+static const unsigned short size_classes[] = {
+	32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, RAMDISK_BLOCK_SIZE
+};
+#define SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+// No slot. Ends the free list of a slab, and is the owner of free slots.
+#define NO_SLOT 0xFFFF
+
+// A slab, split into slots of one size class.
+struct slab {
+	// The next slab of the same size class.
+	struct slab * next;
+	unsigned char * data;
+	unsigned short size_class;
+	unsigned short slots;
+	unsigned short used;
+	// The first free slot. Each free slot holds the index of the next one.
+	unsigned short free_slot;
+	// The block held by each slot.
+	unsigned short owners[];
+};
+
+struct crd_store {
+	// A buffer for holding compressed data.
+	unsigned char * compressed_data_buffer;
+	// The size of the buffer for compressed data.
+	unsigned long compressed_data_buffer_size;
+	// A buffer for holding uncompressed data, exactly one block's worth of
+	// data.
+	unsigned char uncompressed_data_buffer[RAMDISK_BLOCK_SIZE];
+	// An array of pointers to compressed ramdisk blocks.
+	// Initially, all elements are NULL.
+	unsigned char * compressed_blocks[RAMDISK_BLOCKS];
+	// A parallel array of the sizes of each compressed ramdisk block. A
+	// block that doesn't compress below RAMDISK_BLOCK_SIZE is stored as it
+	// is, with that size. Initially, all elements are 0.
+	unsigned long compressed_block_sizes[RAMDISK_BLOCKS];
+	// The slabs of each size class.
+	struct slab * slabs[SIZE_CLASSES];
+	// The slab holding each block, NULL if the block isn't stored.
+	struct slab * block_slabs[RAMDISK_BLOCKS];
+	// The number of bytes allocated for slabs.
+	unsigned long slab_bytes;
+	// The streams compressing and uncompressing blocks. They are reset for
+	// each block instead of set up by compress() and uncompress(), whose
+	// 270 KB of deflate state malloc trims away again after every block.
+	z_stream deflater;
+	z_stream inflater;
+};
+
+// Returns the start of a slot of a slab.
+static unsigned char * slab_slot(const struct slab * slab, unsigned short slot) {
+	return slab->data + slot * size_classes[slab->size_class];
+}
+
+// Creates an empty slab of a size class, returns NULL if out of memory.
+static struct slab * slab_create(crd_store * store, int size_class) {
+	unsigned short slots = SLAB_SIZE / size_classes[size_class], i;
+	struct slab * slab = malloc(sizeof(struct slab) + slots * sizeof(unsigned short));
+
+	if (slab == NULL)
+		return NULL;
+	slab->data = malloc(SLAB_SIZE);
+	if (slab->data == NULL) {
+		free(slab);
+		return NULL;
+	}
+
+	slab->size_class = size_class;
+	slab->slots = slots;
+	slab->used = 0;
+	// Chain every slot in the free list.
+	for (i = 0; i < slots; i++) {
+		*(unsigned short *)slab_slot(slab, i) = i + 1 < slots ? i + 1 : NO_SLOT;
+		slab->owners[i] = NO_SLOT;
+	}
+	slab->free_slot = 0;
+
+	slab->next = store->slabs[size_class];
+	store->slabs[size_class] = slab;
+	store->slab_bytes += SLAB_SIZE + sizeof(struct slab) + slots * sizeof(unsigned short);
+	return slab;
+}
+
+// Takes a slab out of the list of its size class.
+static void slab_unlink(crd_store * store, struct slab * slab) {
+	struct slab ** link = &store->slabs[slab->size_class];
+
+	while (*link != slab)
+		link = &(*link)->next;
+	*link = slab->next;
+}
+
+static void slab_destroy(crd_store * store, struct slab * slab) {
+	store->slab_bytes -= SLAB_SIZE + sizeof(struct slab) + slab->slots * sizeof(unsigned short);
+	free(slab->data);
+	free(slab);
+}
+
+// Returns a free slot of a size class for a block, from the first slab with
+// one, or NULL if out of memory.
+static unsigned char * slot_alloc(crd_store * store, int size_class, int block_address) {
+	struct slab * slab;
+	unsigned short slot;
+
+	for (slab = store->slabs[size_class]; slab != NULL && slab->free_slot == NO_SLOT; slab = slab->next)
+		;
+	if (slab == NULL && (slab = slab_create(store, size_class)) == NULL)
+		return NULL;
+
+	slot = slab->free_slot;
+	slab->free_slot = *(unsigned short *)slab_slot(slab, slot);
+	slab->owners[slot] = block_address;
+	slab->used++;
+	store->block_slabs[block_address] = slab;
+	return slab_slot(slab, slot);
+}
+
+// Moves the blocks of the emptiest slab of a size class into free slots of
+// the other slabs and frees it, as long as the free slots of the class
+// would fill two slabs. Rewrites that make blocks compress better or worse
+// leave slabs partly empty, this gives their memory back.
+static void slab_compact(crd_store * store, int size_class) {
+	struct slab * slab, * emptiest;
+	unsigned int free_slots;
+	unsigned short slot;
+	unsigned char * data;
+	int block_address;
+
+	for (;;) {
+		free_slots = 0;
+		emptiest = NULL;
+		for (slab = store->slabs[size_class]; slab != NULL; slab = slab->next) {
+			free_slots += slab->slots - slab->used;
+			if (emptiest == NULL || slab->used < emptiest->used)
+				emptiest = slab;
+		}
+		if (emptiest == NULL || free_slots < 2u * emptiest->slots)
+			return;
+
+		// The other slabs have free slots for all its blocks.
+		slab_unlink(store, emptiest);
+		for (slot = 0; slot < emptiest->slots; slot++) {
+			block_address = emptiest->owners[slot];
+			if (block_address == NO_SLOT)
+				continue;
+			data = slot_alloc(store, size_class, block_address);
+			memcpy(data, slab_slot(emptiest, slot), store->compressed_block_sizes[block_address]);
+			store->compressed_blocks[block_address] = data;
+		}
+		slab_destroy(store, emptiest);
+	}
+}
+
+// Frees the slot holding data in a slab. An empty slab is freed, otherwise
+// its size class may be compacted.
+static void slot_free(crd_store * store, struct slab * slab, unsigned char * data) {
+	unsigned short slot = (data - slab->data) / size_classes[slab->size_class];
+
+	*(unsigned short *)data = slab->free_slot;
+	slab->free_slot = slot;
+	slab->owners[slot] = NO_SLOT;
+	if (--slab->used == 0) {
+		slab_unlink(store, slab);
+		slab_destroy(store, slab);
+	} else
+		slab_compact(store, slab->size_class);
+}
+
+//-----------------------------------------------------------------------------
+// Block storage.
+//-----------------------------------------------------------------------------
+
+crd_store * crd_create(void) {
+	crd_store * store = calloc(1, sizeof(crd_store));
+
+	if (store == NULL)
+		return NULL;
+	store->compressed_data_buffer_size = compressBound(RAMDISK_BLOCK_SIZE);
+	store->compressed_data_buffer = malloc(store->compressed_data_buffer_size);
+	if (store->compressed_data_buffer == NULL) {
+		free(store);
+		return NULL;
+	}
+	if (deflateInit(&store->deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(store->compressed_data_buffer);
+		free(store);
+		return NULL;
+	}
+	if (inflateInit(&store->inflater) != Z_OK) {
+		deflateEnd(&store->deflater);
+		free(store->compressed_data_buffer);
+		free(store);
+		return NULL;
+	}
+	return store;
+}
+
+void crd_destroy(crd_store * store) {
+	struct slab * slab;
+	unsigned int i;
+
+	for (i = 0; i < SIZE_CLASSES; i++) {
+		while ((slab = store->slabs[i]) != NULL) {
+			store->slabs[i] = slab->next;
+			slab_destroy(store, slab);
+		}
+	}
+	deflateEnd(&store->deflater);
+	inflateEnd(&store->inflater);
+	free(store->compressed_data_buffer);
+	free(store);
+}
+
+// Uncompresses a block into the uncompressed data buffer. Returns 0, or
+// CRD_ECORRUPT if the block doesn't uncompress to a whole block.
+static int load_block(crd_store * store, int block_address) {
+	z_stream * inflater = &store->inflater;
+
+	if (store->compressed_blocks[block_address] == NULL)
+		// The block doesn't exist, so we'll treat it as all 0's.
+		memset(store->uncompressed_data_buffer, 0, RAMDISK_BLOCK_SIZE);
+	else if (store->compressed_block_sizes[block_address] == RAMDISK_BLOCK_SIZE)
+		// The block didn't compress and is stored as it is.
+		memcpy(store->uncompressed_data_buffer, store->compressed_blocks[block_address], RAMDISK_BLOCK_SIZE);
+	else {
+		inflateReset(inflater);
+		inflater->next_in = store->compressed_blocks[block_address];
+		inflater->avail_in = store->compressed_block_sizes[block_address];
+		inflater->next_out = store->uncompressed_data_buffer;
+		inflater->avail_out = RAMDISK_BLOCK_SIZE;
+		if (Z_STREAM_END != inflate(inflater, Z_FINISH) || inflater->total_out != RAMDISK_BLOCK_SIZE)
+			return CRD_ECORRUPT;
+	}
+	return 0;
+}
+
+// Compresses the uncompressed data buffer into a slot of the smallest size
+// class it fits in and makes it the block's data, freeing the previous slot.
+// Returns 0, or CRD_ENOMEM, keeping the previous data, if out of memory.
+static int store_block(crd_store * store, int block_address) {
+	z_stream * deflater = &store->deflater;
+	const unsigned char * source = store->compressed_data_buffer;
+	unsigned long length;
+	struct slab * previous_slab = store->block_slabs[block_address];
+	unsigned char * previous = store->compressed_blocks[block_address], * data;
+	int size_class = 0;
+
+	// The buffer fits any compressed block, so a single deflate() finishes.
+	deflateReset(deflater);
+	deflater->next_in = store->uncompressed_data_buffer;
+	deflater->avail_in = RAMDISK_BLOCK_SIZE;
+	deflater->next_out = store->compressed_data_buffer;
+	deflater->avail_out = store->compressed_data_buffer_size;
+	if (Z_STREAM_END != deflate(deflater, Z_FINISH))
+		return CRD_ENOMEM;
+	length = deflater->total_out;
+	if (length >= RAMDISK_BLOCK_SIZE) {
+		length = RAMDISK_BLOCK_SIZE;
+		source = store->uncompressed_data_buffer;
+	}
+
+	while (size_classes[size_class] < length)
+		size_class++;
+	// The new slot is taken before the previous one is freed, so rewriting
+	// a block in the same size class never frees and recreates a slab.
+	data = slot_alloc(store, size_class, block_address);
+	if (data == NULL)
+		return CRD_ENOMEM;
+	memcpy(data, source, length);
+	store->compressed_blocks[block_address] = data;
+	store->compressed_block_sizes[block_address] = length;
+
+	if (previous != NULL)
+		slot_free(store, previous_slab, previous);
+	return 0;
+}
+
+long crd_transfer(crd_store * store, int do_write, unsigned long position, const crd_iovec * iov, unsigned int nr_req, crd_copy copy, void * context) {
+	size_t count, vir_offset = 0;
+	long total = 0;
+	int r;
+
+	while (nr_req > 0) {
+		count = iov->iov_size - vir_offset;
+
+//-----------------------------------------------------------------------------
+// At this point in the code, the meaningful data transfer parameters are held
+// in two variables, "position" and "count".  Position holds the index into
+// the ramdisk at which the transfer will begin.  Count holds the number of
+// bytes to be transfered.
+//-----------------------------------------------------------------------------
+
+		// If the transfer position is invalid, stop the transfer here.
+		if (position >= RAMDISK_SIZE)
+			return total;
+		// If the transfer would extend beyond the end of the ramdisk, lower
+		// the number of bytes to transfer so that the transfer stops at the
+		// end of the ramdisk.
+		if (position + count > RAMDISK_SIZE)
+			count = RAMDISK_SIZE - position;
+		// Calculate which block within the ramdisk the position refers to.
+		int block_address = position / RAMDISK_BLOCK_SIZE;
+		// Calculate the offset within the block that position refers to.
+		int block_offset = position % RAMDISK_BLOCK_SIZE;
+		// If the transfer would span multiple blocks, lower the number of
+		// bytes to transfer so that only one block is involved.  Subsequent
+		// iterations of the loop will transfer the rest of the data.
+		if (count > (size_t)(RAMDISK_BLOCK_SIZE - block_offset))
+			count = RAMDISK_BLOCK_SIZE - block_offset;
+		if (!do_write) {
+			// Reading from the ramdisk.
+			if ((r = load_block(store, block_address)) != 0)
+				return r;
+			// Transfer data from the ramdisk to the caller.
+			if (copy(context, iov->iov_addr, vir_offset, store->uncompressed_data_buffer + block_offset, count, 1) != 0)
+				return CRD_ECOPY;
+		} else {
+			// Writing to the ramdisk.
+			if (count < RAMDISK_BLOCK_SIZE && (r = load_block(store, block_address)) != 0)
+				// If the transfer is less than an entire block, we need the
+				// block's current data since it will be only partially
+				// overwritten.
+				return r;
+			// Transfer data from the caller to the ramdisk.
+			if (copy(context, iov->iov_addr, vir_offset, store->uncompressed_data_buffer + block_offset, count, 0) != 0)
+				return CRD_ECOPY;
+			// Compress the block into a slab. The block keeps its previous
+			// data if there is no memory for it.
+			if ((r = store_block(store, block_address)) != 0)
+				return r;
+		}
+
+		/* Book the number of bytes transferred. */
+		position += count;
+		vir_offset += count;
+		total += count;
+		if (vir_offset == iov->iov_size) {
+			iov++;
+			nr_req--;
+			vir_offset = 0;
+		}
+	}
+	return total;
+}
+
+void crd_get_usage(const crd_store * store, crd_usage * usage) {
+	int i;
+
+	usage->logical = 0;
+	usage->compressed = 0;
+	for (i = 0; i < RAMDISK_BLOCKS; i++) {
+		if (store->compressed_blocks[i] != NULL) {
+			usage->logical += RAMDISK_BLOCK_SIZE;
+			usage->compressed += store->compressed_block_sizes[i];
+		}
+	}
+	usage->slabs = store->slab_bytes;
+}
@@ -0,0 +1,58 @@
+#ifndef CRD_STORE_H
+#define CRD_STORE_H
+
+// The compressed block storage of the ramdisk. It has no MINIX dependencies,
+// so the same code runs in the driver and in the Linux test driver.
+
+#include <stddef.h>
+
+// Ramdisk size, 2 MB.
+#define RAMDISK_SIZE 0x200000
+// The size of each block within the ramdisk, 4 KB.
+#define RAMDISK_BLOCK_SIZE 0x1000
+// The number of blocks within the ramdisk, 512.
+#define RAMDISK_BLOCKS (RAMDISK_SIZE / RAMDISK_BLOCK_SIZE)
+
+// Errors returned by crd_transfer.
+// There is no memory to store a written block.
+#define CRD_ENOMEM (-1)
+// The copy function failed.
+#define CRD_ECOPY (-2)
+// A stored block doesn't uncompress.
+#define CRD_ECORRUPT (-3)
+
+// A segment of the caller's memory. The address is only handed to the copy
+// function, it may be a grant or a pointer.
+typedef struct {
+	unsigned long iov_addr;
+	size_t iov_size;
+} crd_iovec;
+
+// Copies count bytes between buffer and the segment at addr, starting offset
+// bytes into the segment. Copies into the segment if to_segment is set.
+// Returns 0 on success.
+typedef int (*crd_copy)(void * context, unsigned long addr, size_t offset, unsigned char * buffer, size_t count, int to_segment);
+
+// The memory taken by the stored blocks, in bytes.
+typedef struct {
+	// The blocks ever written, at RAMDISK_BLOCK_SIZE each.
+	unsigned long logical;
+	unsigned long compressed;
+	// The slabs holding the compressed blocks, with their headers.
+	unsigned long slabs;
+} crd_usage;
+
+typedef struct crd_store crd_store;
+
+// Returns an empty ramdisk, which reads as all 0's, or NULL if out of memory.
+crd_store * crd_create(void);
+void crd_destroy(crd_store * store);
+
+// Reads or writes the ramdisk from position on, filling or draining the
+// nr_req segments in order. Stops at the end of the ramdisk. Returns the
+// number of bytes transferred, or one of the errors above.
+long crd_transfer(crd_store * store, int do_write, unsigned long position, const crd_iovec * iov, unsigned int nr_req, crd_copy copy, void * context);
+
+void crd_get_usage(const crd_store * store, crd_usage * usage);
+
+#endif